@@ -0,0 +1,59 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_ALLPAIRS_H
+#define FILEDISTANCE_ALLPAIRS_H
+
+#include <stdbool.h>
+
+#include "filter.h"
+#include "tokens.h"
+
+
+/* The distances between all the files of a directory. The pairs i < j
+ * are computed in tiles of files close enough in the order to be in
+ * the cache together, the tiles of the same rows by any thread, and
+ * the rows are written out as soon as all of their tiles are done.
+ *
+ * File: ALLPAIRS_MAGIC, 1 if sparse else 0 (32 bits), the number of
+ * files, the limit or -1 if none, the bytes of the names (64 bits
+ * each). Then the names of the files relative to the directory, each
+ * ended by a '\0'. Then, dense: the distance of each pair i < j, row by
+ * row, limit + 1 for those farther than the limit. Sparse: an (i, j,
+ * distance) triple for each pair within the limit, row by row. The
+ * distances are 32 bits, UINT32_MAX for those that don't fit. Host byte
+ * order, like the indexes. */
+
+#define ALLPAIRS_MAGIC "FDM\1"
+#define ALLPAIRS_MAGIC_LEN 4
+
+
+/// Writes the distances between all the files under dir to output
+///
+/// \param dir the directory
+/// \param output the file to write
+/// \param unit what the distances count
+/// \param limit the greatest distance to compute, -1 for no limit
+/// \param sparse write the pairs within the limit only
+/// \param threads how many distances to compute at the same time
+/// \param stats receives the pairs ruled out by the filters and compared
+/// \return the number of files, -1 on error
+long allpairs_run(const char* dir, const char* output, unit_t unit, long limit, bool sparse, int threads,
+                  filter_stats* stats);
+
+
+#endif //FILEDISTANCE_ALLPAIRS_H
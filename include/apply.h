@@ -20,8 +20,10 @@
 
 #include <stdio.h>
 
+#include "script_io.h"
 
-enum {
+
+typedef enum {
     EEMPTYSCRIPT,
     ECANTOPEN,
     ECORRUPTD
@@ -34,6 +36,16 @@ enum {
 void apply_print_err(int err);
 
 
+/// Applies a loaded script to infile, outputting to outfile. The input is
+/// mapped and the output presized, unchanged spans are copied in bulk
+///
+/// \param script the script to apply
+/// \param infilename the file to apply to
+/// \param outfilename the file to save to
+/// \return 0 if succeeds, -1 if err. Sets errno
+int apply_script(const edit_script* script, const char* infilename, const char* outfilename);
+
+
 /// Applies the filem edits to infile, outputting to outfile
 ///
 /// \param infile the file to apply to
@@ -43,4 +55,16 @@ void apply_print_err(int err);
 int apply_edit_script(const char* infilename, const char* scriptfilename, const char* outfilename);
 
 
+/// Applies scripts to many files. Each line of the manifest holds
+/// "input script output", or "input output" when scriptfilename is
+/// given; blank lines and lines starting with # are skipped. Every
+/// distinct script is decoded once, files are patched on threads threads
+///
+/// \param manifest the manifest, - for stdin
+/// \param scriptfilename the script for every line, NULL if lines name theirs
+/// \param threads how many files to patch at the same time
+/// \return 0 if every file was patched, -1 otherwise
+int apply_batch(const char* manifest, const char* scriptfilename, int threads);
+
+
 #endif // APPLY_H
@@ -0,0 +1,52 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_CLUSTER_H
+#define FILEDISTANCE_CLUSTER_H
+
+#include <stddef.h>  // size_t
+
+#include "filter.h"
+#include "tokens.h"
+
+
+/* what cluster_run did besides the filters */
+typedef struct
+{
+    size_t files;
+    size_t clusters;          /* of 2 files or more */
+    unsigned long together;   /* pairs skipped, already in the same cluster */
+} cluster_stats;
+
+
+/// Groups the files under dir linked by a chain of distances within
+/// threshold, printing each group of two or more to stdout, a blank line
+/// between them. The pairs the filters can't rule out are compared the
+/// closest bound first, skipping those already grouped together
+///
+/// \param dir the directory
+/// \param threshold the greatest distance linking two files
+/// \param unit what the distances count
+/// \param threads how many distances to compute at the same time
+/// \param stats receives the pairs ruled out by the filters and compared
+/// \param cstats receives the groups found and the pairs skipped
+/// \return 0 if succeeded, -1 otherwise
+int cluster_run(const char* dir, long threshold, unit_t unit, int threads, filter_stats* stats,
+                cluster_stats* cstats);
+
+
+#endif //FILEDISTANCE_CLUSTER_H
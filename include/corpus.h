@@ -0,0 +1,100 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_CORPUS_H
+#define FILEDISTANCE_CORPUS_H
+
+#include <stddef.h>   // size_t
+#include <stdint.h>   // uint32_t
+#include <stdbool.h>
+
+#include "filter.h"
+#include "tokens.h"
+
+
+/* The files under a directory, mapped once for all the pairs they're
+ * in, with what their distances need: the signatures to rule pairs out
+ * when counting bytes, each file as ids of one table of all their
+ * tokens when counting lines or words. The files are in name order. */
+typedef struct
+{
+    char* root;
+    unit_t unit;
+    size_t n;
+    char** names;          /* relative to root */
+    const char** bufs;
+    size_t* lens;
+    signature* sigs;       /* NULL unless asked for */
+    token_table* tokens;   /* NULL when counting bytes */
+    uint32_t** ids;        /* of the tokens of each file */
+    size_t* ntokens;
+} corpus;
+
+
+/// Maps the files under dir
+///
+/// \param c the corpus to fill
+/// \param dir the directory
+/// \param unit what the distances count
+/// \param signatures compute the signatures, for bounded distances of bytes
+/// \param threads how many files to read at the same time
+/// \return 0 if succeeded, -1 otherwise
+int corpus_load(corpus* c, const char* dir, unit_t unit, bool signatures, int threads);
+
+
+/// Finds a lower bound on the distance between files i and j from
+/// their lengths and signatures, the cheaper ones first
+///
+/// \param c the corpus
+/// \param i first file
+/// \param j second file
+/// \param k the threshold on the distance
+/// \param stats counts the pair if it's ruled out
+/// \return the bound if <= k, k + 1 if the pair is ruled out
+long corpus_bound(const corpus* c, size_t i, size_t j, long k, filter_stats* stats);
+
+
+/// Finds the distance between files i and j if it doesn't exceed k,
+/// with no filter
+///
+/// \param c the corpus
+/// \param i first file
+/// \param j second file
+/// \param k the threshold on the distance
+/// \return the distance if <= k, k + 1 otherwise. -1 if out of memory
+long corpus_compare(const corpus* c, size_t i, size_t j, long k);
+
+
+/// Finds the distance between files i and j if it doesn't exceed k,
+/// the signatures ruling the pair out first if there are any
+///
+/// \param c the corpus
+/// \param i first file
+/// \param j second file
+/// \param k the threshold on the distance
+/// \param stats counts the pair
+/// \return the distance if <= k, k + 1 otherwise. -1 if out of memory
+long corpus_distance(const corpus* c, size_t i, size_t j, long k, filter_stats* stats);
+
+
+/// Unmaps the files and frees the contents of c
+///
+/// \param c the corpus
+void corpus_free(corpus* c);
+
+
+#endif //FILEDISTANCE_CORPUS_H
@@ -0,0 +1,138 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_DEDUP_H
+#define FILEDISTANCE_DEDUP_H
+
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint64_t
+#include <pthread.h>
+
+
+/* The files and the contents met during a search, so that each one is
+ * compared once. The first thread to claim a key computes its distance
+ * and publishes it, the others take it from there, or wait for the end
+ * of the search if it's not published yet. A file can stand for its
+ * contents: its claimers then go on to the contents' entry. */
+
+#define DEDUP_STRIPES 64
+#define DEDUP_BLOCK 256
+
+
+typedef enum
+{
+    DEDUP_INODE,    /* a and b are st_dev and st_ino */
+    DEDUP_CONTENTS  /* a and b are the size and the hash */
+} dedup_kind;
+
+
+/* what a claim gives */
+typedef enum
+{
+    DEDUP_OWNER,   /* the caller computes and publishes */
+    DEDUP_DONE,    /* the value is there */
+    DEDUP_PENDING  /* another thread is computing it */
+} dedup_claim_t;
+
+
+typedef struct dedup_entry
+{
+    uint64_t a;
+    uint64_t b;
+    dedup_kind kind;
+    int state;
+    long value;
+    struct dedup_entry* alias; /* the contents a file stands for */
+    unsigned stripe;
+} dedup_entry;
+
+
+typedef struct dedup_block
+{
+    struct dedup_block* next;
+    size_t used;
+    dedup_entry entries[DEDUP_BLOCK];
+} dedup_block;
+
+
+/* the keys of one lock, open addressing */
+typedef struct
+{
+    pthread_mutex_t lock;
+    dedup_entry** slots;
+    size_t nslots;
+    size_t n;
+    dedup_block* blocks;
+} dedup_stripe;
+
+
+typedef struct
+{
+    dedup_stripe stripes[DEDUP_STRIPES];
+} dedup_table;
+
+
+/// Creates an empty table
+///
+/// \param t the table
+/// \return 0 if succeeded, -1 if out of memory
+int dedup_init(dedup_table* t);
+
+
+/// Claims a key, following the file to its contents if it stands for them
+///
+/// \param t the table
+/// \param kind what the key is of
+/// \param a first half of the key
+/// \param b second half of the key
+/// \param e receives the entry to publish to or to wait on
+/// \param value receives the value if DEDUP_DONE
+/// \return a dedup_claim_t, -1 if out of memory
+int dedup_claim(dedup_table* t, dedup_kind kind, uint64_t a, uint64_t b, dedup_entry** e, long* value);
+
+
+/// Publishes the value of an entry claimed as owner
+///
+/// \param t the table
+/// \param e the entry
+/// \param value the value
+void dedup_publish(dedup_table* t, dedup_entry* e, long value);
+
+
+/// Makes the file claimed as owner stand for the contents, whose value
+/// is still to come
+///
+/// \param t the table
+/// \param e the file's entry
+/// \param contents the contents' entry
+void dedup_alias(dedup_table* t, dedup_entry* e, dedup_entry* contents);
+
+
+/// Finds the value of an entry once no thread is computing anymore
+///
+/// \param e the entry
+/// \return the value, -1 if it was never published
+long dedup_value(const dedup_entry* e);
+
+
+/// Frees the table
+///
+/// \param t the table
+void dedup_free(dedup_table* t);
+
+
+#endif //FILEDISTANCE_DEDUP_H
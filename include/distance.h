@@ -19,22 +19,81 @@
 #define DISTANCE_H
 
 #include <stddef.h> // size_t
+#include <stdint.h> // uint32_t
+#include <limits.h> // LONG_MAX
 
 
 /// Finds the distance between file1 and file2
 ///
 /// \param file1 first file
 /// \param file2 second file
-/// \return the distance
-int distance_file(const char* file1, const char* file2);
+/// \return the distance, -1 on error
+long distance_file(const char* file1, const char* file2);
 
 
 /// Finds the Levenshtein distance between str1 and str2
 ///
 /// \param str1 the first string
 /// \param str2 the second string
-/// \return the distance
-int distance_string(const char* str1, size_t len1, const char* str2, size_t len2);
+/// \return the distance, -1 if out of memory
+long distance_string(const char* str1, size_t len1, const char* str2, size_t len2);
+
+
+/// Finds the distances between every prefix of str1 and the whole str2
+///
+/// \param str1 the first string
+/// \param str2 the second string
+/// \param col receives len1 + 1 distances, col[i] for the first i bytes of str1
+/// \param threads how many threads can share the work
+/// \return 0 if succeeded, -1 if out of memory
+int distance_prefixes(const char* str1, size_t len1, const char* str2, size_t len2, long* col, int threads);
+
+
+/// Finds the distance between file1 and file2 if it doesn't exceed k
+///
+/// \param file1 first file
+/// \param file2 second file
+/// \param k the threshold on the distance
+/// \return the distance if <= k, k + 1 otherwise. -1 on error
+long distance_file_bounded(const char* file1, const char* file2, long k);
+
+
+/* the greatest bound given to the bounded kernels: k + 1 must not overflow */
+#define BOUND_MAX (LONG_MAX - 1)
+
+
+/// Finds the Levenshtein distance between str1 and str2 if it doesn't exceed k.
+/// Only the diagonal band of the matrix that can hold a path within k is
+/// computed, and the computation stops as soon as a whole column is past k
+///
+/// \param str1 the first string
+/// \param str2 the second string
+/// \param k the threshold on the distance
+/// \return the distance if <= k, k + 1 otherwise
+long distance_string_bounded(const char* str1, size_t len1, const char* str2, size_t len2, long k);
+
+
+/// Finds the Levenshtein distance between two sequences of symbols,
+/// such as the ids of the lines or words of two files
+///
+/// \param ids1 the first sequence
+/// \param ids2 the second sequence
+/// \param nsyms every symbol is < nsyms
+/// \return the distance, -1 if out of memory
+long distance_ids(const uint32_t* ids1, size_t len1, const uint32_t* ids2, size_t len2, uint32_t nsyms);
+
+
+/// Finds the distance between two sequences of symbols if it doesn't exceed k.
+/// Only the diagonal band of the matrix that can hold a path within k is
+/// computed, and the computation stops as soon as a whole row is past k
+///
+/// \param ids1 the first sequence
+/// \param ids2 the second sequence
+/// \param nsyms every symbol is < nsyms
+/// \param k the threshold on the distance
+/// \return the distance if <= k, k + 1 otherwise. -1 if out of memory
+long distance_ids_bounded(const uint32_t* ids1, size_t len1, const uint32_t* ids2, size_t len2,
+                          uint32_t nsyms, long k);
 
 
 #endif // DISTANCE_H
@@ -0,0 +1,88 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_DISTANCE_SIMD_H
+#define FILEDISTANCE_DISTANCE_SIMD_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+
+/* Wavefront Myers kernels. The pattern is split in 64-row blocks and
+ * each vector lane advances one block: lane l works on text column s - l
+ * at step s, so the horizontal delta it needs was produced by lane l - 1
+ * at the previous step. Blocks are processed in groups of as many blocks
+ * as lanes, the deltas leaving the bottom of a group feed the next one.
+ *
+ * All kernels advance the nblocks blocks of a stripe of the pattern over
+ * n columns of text:
+ * peq[c * nblocks + b] holds the rows of block b where the pattern is c,
+ * pv/mv the vertical deltas of each block, updated,
+ * hb[j] the delta entering the top of the stripe at column j, replaced by
+ * the one leaving its last block at row lastbit.
+ * They return the sum of the deltas leaving. */
+
+typedef long (*myers_kernel_f)(const uint64_t* peq, size_t nblocks, uint64_t lastbit,
+                               uint64_t* pv, uint64_t* mv, const char* txt, size_t n, int8_t* hb);
+
+
+/// Advances a stripe with 2 blocks per step, SSE4.1
+///
+/// \param peq pattern bitmasks
+/// \param nblocks number of 64-row blocks of the stripe
+/// \param lastbit row of the last block reporting its delta
+/// \param pv positive vertical deltas of each block
+/// \param mv negative vertical deltas of each block
+/// \param txt the text
+/// \param n length of the text
+/// \param hb horizontal deltas entering, then leaving, the stripe
+/// \return the sum of the deltas leaving the stripe
+long distance_myers_sse41(const uint64_t* peq, size_t nblocks, uint64_t lastbit,
+                          uint64_t* pv, uint64_t* mv, const char* txt, size_t n, int8_t* hb);
+
+
+/// Advances a stripe with 4 blocks per step, AVX2
+///
+/// \param peq pattern bitmasks
+/// \param nblocks number of 64-row blocks of the stripe
+/// \param lastbit row of the last block reporting its delta
+/// \param pv positive vertical deltas of each block
+/// \param mv negative vertical deltas of each block
+/// \param txt the text
+/// \param n length of the text
+/// \param hb horizontal deltas entering, then leaving, the stripe
+/// \return the sum of the deltas leaving the stripe
+long distance_myers_avx2(const uint64_t* peq, size_t nblocks, uint64_t lastbit,
+                         uint64_t* pv, uint64_t* mv, const char* txt, size_t n, int8_t* hb);
+
+
+/// Advances a stripe with 8 blocks per step, AVX-512
+///
+/// \param peq pattern bitmasks
+/// \param nblocks number of 64-row blocks of the stripe
+/// \param lastbit row of the last block reporting its delta
+/// \param pv positive vertical deltas of each block
+/// \param mv negative vertical deltas of each block
+/// \param txt the text
+/// \param n length of the text
+/// \param hb horizontal deltas entering, then leaving, the stripe
+/// \return the sum of the deltas leaving the stripe
+long distance_myers_avx512(const uint64_t* peq, size_t nblocks, uint64_t lastbit,
+                           uint64_t* pv, uint64_t* mv, const char* txt, size_t n, int8_t* hb);
+
+
+#endif //FILEDISTANCE_DISTANCE_SIMD_H
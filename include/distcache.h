@@ -0,0 +1,95 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_DISTCACHE_H
+#define FILEDISTANCE_DISTCACHE_H
+
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint64_t
+#include <stdbool.h>
+
+#include "tokens.h"
+
+
+/* Cache of distances between contents, shared by every process that
+ * opens the same file. A pair is known by the hashes and sizes of its
+ * two contents and the unit, in either order, so renaming or copying a
+ * file doesn't lose it. A bounded computation that gave up is kept as
+ * a lower bound, which still answers the queries with a lower threshold.
+ *
+ * File: a DISTCACHE_HEADER bytes header, then sets of DISTCACHE_WAYS
+ * slots. A pair can only go in the set its key hashes to, where it takes
+ * a free slot or the least recently used one: the file never grows past
+ * the size it was created with. Slots are written without locks, each
+ * carries a check of its contents and a torn one is just a miss. */
+
+#define DISTCACHE_MAGIC "FDC\1"
+#define DISTCACHE_MAGIC_LEN 4
+#define DISTCACHE_HEADER 4096
+#define DISTCACHE_WAYS 8
+
+/* size of a new cache if not given */
+#define DISTCACHE_DEFAULT_BYTES ((size_t) 64 << 20)
+
+
+/// Opens the cache in file, creating it with bytes bytes if it's missing.
+/// An existing cache keeps its size
+///
+/// \param file the cache file
+/// \param bytes the size of a new cache
+/// \return 0 if succeeded, -1 otherwise
+int distcache_open(const char* file, size_t bytes);
+
+
+/// Tells whether a cache is open
+///
+/// \return true if the distances go through the cache
+bool distcache_enabled(void);
+
+
+/// Looks the distance between two contents up
+///
+/// \param hash1 hash of the first contents
+/// \param size1 size of the first contents
+/// \param hash2 hash of the second contents
+/// \param size2 size of the second contents
+/// \param unit what the distance counts
+/// \param k the threshold on the distance, LONG_MAX if none
+/// \param distance receives the distance if <= k, k + 1 if it's known to be greater
+/// \return true if the cache answered
+bool distcache_get(uint64_t hash1, size_t size1, uint64_t hash2, size_t size2, unit_t unit, long k,
+                   long* distance);
+
+
+/// Records the distance between two contents
+///
+/// \param hash1 hash of the first contents
+/// \param size1 size of the first contents
+/// \param hash2 hash of the second contents
+/// \param size2 size of the second contents
+/// \param unit what the distance counts
+/// \param k the threshold it was computed with, LONG_MAX if none
+/// \param distance the distance if <= k, k + 1 if it gave up
+void distcache_put(uint64_t hash1, size_t size1, uint64_t hash2, size_t size2, unit_t unit, long k,
+                   long distance);
+
+
+/// Unmaps the cache
+void distcache_close(void);
+
+
+#endif //FILEDISTANCE_DISTCACHE_H
@@ -0,0 +1,130 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_FILTER_H
+#define FILEDISTANCE_FILTER_H
+
+#include <stdio.h>
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t
+
+
+/* length of the q-grams */
+#define QGRAM_Q 3
+
+/* q-grams are hashed into 2^QGRAM_BITS counters */
+#define QGRAM_BITS 9
+#define QGRAM_BUCKETS (1 << QGRAM_BITS)
+
+
+/* Lower bounds on the edit distance, from the cheapest to the most
+ * expensive. Each one only needs the contents summary of the two files. */
+typedef enum
+{
+    FILTER_SIZE,
+    FILTER_HISTOGRAM,
+    FILTER_QGRAM,
+    FILTER_STAGES
+} filter_stage;
+
+
+/* contents summary of a file. The counters wrap on files of 4 GB or
+ * more: the bounds from them are 0 then */
+typedef struct
+{
+    size_t size;
+    uint32_t hist[256];
+    uint32_t qgram[QGRAM_BUCKETS];
+} signature;
+
+
+/* candidates rejected by each stage, passed to the DP, answered by the
+ * cache, or copies of others */
+typedef struct
+{
+    unsigned long rejected[FILTER_STAGES];
+    unsigned long passed;
+    unsigned long cached;
+    unsigned long duplicates;
+} filter_stats;
+
+
+/// Fills the byte histogram of buf
+///
+/// \param buf the contents
+/// \param len length of buf
+/// \param sig the signature to fill
+void signature_histogram(const char* buf, size_t len, signature* sig);
+
+
+/// Fills the hashed q-gram counts of buf
+///
+/// \param buf the contents
+/// \param len length of buf
+/// \param sig the signature to fill
+void signature_qgrams(const char* buf, size_t len, signature* sig);
+
+
+/// Fills the whole signature of buf
+///
+/// \param buf the contents
+/// \param len length of buf
+/// \param sig the signature to fill
+void signature_compute(const char* buf, size_t len, signature* sig);
+
+
+/// Lower bound from the sizes: each edit changes the length by 1 at most
+///
+/// \param a first signature
+/// \param b second signature
+/// \return the bound
+long filter_size_bound(const signature* a, const signature* b);
+
+
+/// Lower bound from the byte histograms: each edit removes at most one
+/// byte in excess and adds at most one byte missing
+///
+/// \param a first signature
+/// \param b second signature
+/// \return the bound
+long filter_histogram_bound(const signature* a, const signature* b);
+
+
+/// Lower bound from the q-gram counts: each edit touches QGRAM_Q q-grams
+/// at most, on either side
+///
+/// \param a first signature
+/// \param b second signature
+/// \return the bound
+long filter_qgram_bound(const signature* a, const signature* b);
+
+
+/// Counts a candidate as rejected at stage, or as passed if stage is FILTER_STAGES
+///
+/// \param stats the counters
+/// \param stage the stage that rejected the candidate
+void filter_count(filter_stats* stats, filter_stage stage);
+
+
+/// Prints the counters
+///
+/// \param stats the counters
+/// \param out the stream to print to
+void filter_print_stats(const filter_stats* stats, FILE* out);
+
+
+#endif //FILEDISTANCE_FILTER_H
@@ -21,7 +21,7 @@
 #include "list.h"
 #include "name_distance.h"
 
-enum {
+typedef enum {
     EEMPTYLIST
 } list_err;
 
@@ -38,7 +38,7 @@ int list_namedistance_save_to_array(node* list, name_distance** arr);
 ///
 /// \param list the list to go through
 /// \return the min distance found
-int list_namedistance_min(node* list);
+long list_namedistance_min(node* list);
 
 
 /// Prints filename of node
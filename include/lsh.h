@@ -0,0 +1,88 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_LSH_H
+#define FILEDISTANCE_LSH_H
+
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint32_t, uint64_t
+
+
+/* Near-duplicate candidates of a directory, for corpora too big to go
+ * through. Each file is cut in shingles of LSH_SHINGLE bytes, their
+ * hashes are spread over LSH_HASHES bins keeping the least of each bin
+ * (one permutation MinHash), and the bins are cut in LSH_BANDS bands of
+ * LSH_ROWS. Two files are candidates when all the rows of a band match:
+ * the more shingles they share, the likelier it is.
+ *
+ * File: LSH_MAGIC, the number of bands, of files and the bytes of the
+ * names. Then, for each band, a (key, file) pair per file sorted by key,
+ * then an (offset, length) pair per file for its path relative to the
+ * directory, then the names. Host byte order, like the signature index. */
+
+#define LSH_NAME ".filedistance.lsh"
+#define LSH_MAGIC "FDL\1"
+#define LSH_MAGIC_LEN 4
+
+#define LSH_SHINGLE 8
+#define LSH_BANDS 16
+#define LSH_ROWS 4
+#define LSH_HASHES (LSH_BANDS * LSH_ROWS)
+
+
+/* the keys of the bands of a file */
+typedef struct
+{
+    uint32_t band[LSH_BANDS];
+} lsh_keys;
+
+
+/// Computes the band keys of buf
+///
+/// \param buf the contents
+/// \param len length of buf
+/// \param keys receives the keys
+void lsh_compute(const char* buf, size_t len, lsh_keys* keys);
+
+
+/// Builds the LSH index of the files under dir, in place of the old one
+///
+/// \param dir the directory
+/// \param threads how many threads read the files
+/// \return the number of files indexed, -1 on error
+long lsh_build(const char* dir, int threads);
+
+
+/// Finds the files of dir's LSH index that share a band with buf
+///
+/// \param dir the directory
+/// \param buf the contents to look up
+/// \param len length of buf
+/// \param paths receives the absolute paths, to be freed with lsh_free_paths
+/// \param n receives the number of paths
+/// \return 0 if succeeded, -1 if there's no usable index or out of memory
+int lsh_query(const char* dir, const char* buf, size_t len, char*** paths, size_t* n);
+
+
+/// Frees the paths from lsh_query
+///
+/// \param paths the paths
+/// \param n the number of paths
+void lsh_free_paths(char** paths, size_t n);
+
+
+#endif //FILEDISTANCE_LSH_H
@@ -23,7 +23,7 @@
 
 typedef struct
 {
-    int distance;
+    long distance;
     char filename[PATH_MAX];
 } name_distance;
 
@@ -32,41 +32,38 @@ typedef enum
 } op_type;
 
 
-/* edit struct is byte-aligned */
+/* position is the byte of the input the edit refers to; ADD inserts
+ * after it, so an ADD before the first byte has position (size_t) -1 */
 typedef struct _edit
 {
-    op_type operation     : 2;
-    unsigned int score    : 14;
-    unsigned int position : 16;
+    op_type operation;
+    size_t position;
     char c;
 } edit;
 
 
-/// Saves e binarily to a file according to the prescribed format
-///
-/// \param e the edit to save
-/// \param outfile the file to save to
-void script_print_edit(const edit* e, FILE* outfile);
-
-
-/// Finds the minimal edit script and distance between two strings
+/// Finds the minimal edit script and distance between two strings,
+/// in memory linear in len1 + len2
 ///
 /// \param str1 first string
 /// \param len1 len of first string
 /// \param str2 second string
 /// \param len2 length of second string
-/// \param script edit script to save
-/// \return the distance
-int script_string_distance(const char* str1, size_t len1, const char* str2, size_t len2, edit** script);
+/// \param script edit script to save, to be freed by the caller
+/// \param threads how many threads can share the work, the script is the same
+/// \return the distance, -1 if out of memory
+long script_string_distance(const char* str1, size_t len1, const char* str2, size_t len2, edit** script, int threads);
 
 
-/// Finds the minimal edit script and distance between two files, saving script it to outfile
+/// Finds the minimal edit script and distance between two files, saving it to outfile
+/// in the v2 format
 ///
 /// \param file1 first file
 /// \param file2 second file
 /// \param outfile file to save to
-/// \return the distance
-int script_file_distance(const char* file1, const char* file2, const char* outfile);
+/// \param threads how many threads can share the work
+/// \return the distance, -1 on error
+long script_file_distance(const char* file1, const char* file2, const char* outfile, int threads);
 
 
 #endif // FILEDISTANCE_SCRIPT_H
@@ -0,0 +1,106 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_SCRIPT_IO_H
+#define FILEDISTANCE_SCRIPT_IO_H
+
+#include <stddef.h> // size_t
+
+#include "script.h"
+
+
+/* Script files.
+ *
+ * v1: one 8-byte record per edit, "ADD"/"DEL"/"SET", the position as a
+ * big endian 32-bit int and the byte ("ADD" inserts after position).
+ *
+ * v2: SCRIPT_MAGIC, then one record per run of edits:
+ *   tag      op in the low 2 bits, length in the high 6 bits, 63 meaning
+ *            the length - 63 follows as a varint
+ *   varint   distance from the end of the previous run
+ *   bytes    length bytes to insert (ADD) or to overwrite with (SET)
+ * Varints are LEB128: 7 bits per byte, low bits first. */
+
+#define SCRIPT_MAGIC "FDS\2"
+#define SCRIPT_MAGIC_LEN 4
+
+
+/* a run of edits of the same kind on contiguous bytes */
+typedef struct
+{
+    op_type operation;
+    size_t position; /* offset in the input: ADD inserts before it */
+    size_t len;      /* bytes added, deleted or set */
+    size_t data;     /* offset of the bytes added or set in the script's data */
+} edit_run;
+
+
+/* a whole script, runs in input order */
+typedef struct
+{
+    edit_run* runs;
+    size_t nruns;
+    size_t runcap;
+    char* data;
+    size_t ndata;
+    size_t datacap;
+} edit_script;
+
+
+/// Appends a run, merging it into the last one when they are contiguous
+///
+/// \param s the script
+/// \param op the kind of the run
+/// \param position offset in the input
+/// \param bytes the bytes added or set, NULL for DEL
+/// \param len length of the run
+/// \return 0 if succeeded, -1 if out of memory
+int script_push(edit_script* s, op_type op, size_t position, const char* bytes, size_t len);
+
+
+/// Groups single edits into runs
+///
+/// \param edits the edits, in input order
+/// \param len number of edits
+/// \param s the script to fill, empty
+/// \return 0 if succeeded, -1 if out of memory
+int script_from_edits(const edit* edits, size_t len, edit_script* s);
+
+
+/// Saves s to file in the v2 format
+///
+/// \param s the script
+/// \param file the file to save to
+/// \return 0 if succeeded, -1 otherwise
+int script_save(const edit_script* s, const char* file);
+
+
+/// Loads a v1 or v2 script from file
+///
+/// \param file the file to load
+/// \param s the script to fill
+/// \return 0 if succeeded, -1 if it can't be read, -2 if it's corrupted
+int script_load(const char* file, edit_script* s);
+
+
+/// Frees the contents of s
+///
+/// \param s the script
+void script_free(edit_script* s);
+
+
+#endif //FILEDISTANCE_SCRIPT_IO_H
@@ -0,0 +1,68 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_SCRIPT_OPS_H
+#define FILEDISTANCE_SCRIPT_OPS_H
+
+#include <stddef.h> // size_t
+
+#include "script_io.h"
+
+
+/// Composes two scripts: applying out to A gives what applying s1 to A,
+/// then s2 to the result, would. Only the runs are used, the files are
+/// never read
+///
+/// \param s1 script from A to B
+/// \param s2 script from B to C
+/// \param out the script from A to C, empty
+/// \return 0 if succeeded, -1 if out of memory, -2 if the runs are out of order
+int script_compose(const edit_script* s1, const edit_script* s2, edit_script* out);
+
+
+/// Composes a chain of script files into one
+///
+/// \param files the scripts, in the order they'd be applied
+/// \param n number of scripts, at least 1
+/// \param outfile the file to save the composed script to
+/// \return 0 if succeeded, -1 if a script can't be read, -2 if it's corrupted,
+///         -3 if the output can't be saved
+int script_compose_files(char* const* files, size_t n, const char* outfile);
+
+
+/// Inverts a script: applying out to B gives back A. Runs deleting or
+/// setting bytes of A take them from in
+///
+/// \param s script from A to B
+/// \param in the contents of A, NULL if it's empty
+/// \param insize size of A
+/// \param out the script from B to A, empty
+/// \return 0 if succeeded, -1 if out of memory, -2 if s doesn't fit in A
+int script_invert(const edit_script* s, const char* in, size_t insize, edit_script* out);
+
+
+/// Inverts a script file
+///
+/// \param infile the file the script applies to
+/// \param scriptfile the script
+/// \param outfile the file to save the inverted script to
+/// \return 0 if succeeded, -1 if a file can't be read, -2 if the script is
+///         corrupted or doesn't fit infile, -3 if the output can't be saved
+int script_invert_file(const char* infile, const char* scriptfile, const char* outfile);
+
+
+#endif //FILEDISTANCE_SCRIPT_OPS_H
@@ -19,6 +19,21 @@
 #define SEARCH_H
 
 #include <stdio.h>
+#include <stdbool.h>
+
+#include "tokens.h"
+
+
+/* how searches go */
+typedef struct
+{
+    unit_t unit;  /* what the distance counts: bytes, lines or words */
+    int threads;  /* how many files to compare at the same time */
+    bool index;   /* keep the signatures of dir's files in its index, bytes only */
+    bool lsh;     /* compare the candidates of dir's LSH index only */
+    bool exact;   /* with lsh: the candidates only lower the bound, all the files are searched */
+    bool tree;    /* answer from dir's vantage point tree, built with the same unit */
+} search_opts;
 
 
 /// Search files in dir (and subdirs) with distance from inputfile <= limit,
@@ -27,17 +42,30 @@
 /// \param inputfile the file to compare against
 /// \param dir the directory to traverse
 /// \param limit the limit on the distance
+/// \param opts how the search goes
+/// \return 0 if succeeded, -1 otherwise
+int search_all(const char* inputfile, const char* dir, long limit, const search_opts* opts);
+
+
+/// Search the k files in dir (and subdirs) closest to inputfile, printing
+/// them to stdout sorted by distance ascending, filename ascending. The
+/// k-th best distance found so far bounds the later comparisons
+///
+/// \param inputfile the file to compare against
+/// \param dir the directory to traverse
+/// \param k how many files to print, at least 1
+/// \param opts how the search goes
 /// \return 0 if succeeded, -1 otherwise
-int search_all(const char* inputfile, const char* dir, long limit);
+int search_k(const char* inputfile, const char* dir, long k, const search_opts* opts);
 
 
 /// Search files in dir (and subdirs) with distance from inputfile == limit
 ///
 /// \param inputfile the file to compare against
 /// \param dir the directory to traverse
-/// \param limit the limit on the distance
+/// \param opts how the search goes
 /// \return 0 if succeeded, -1 otherwise
-int search_min(const char* filename, const char* dir);
+int search_min(const char* filename, const char* dir, const search_opts* opts);
 
 
 #endif //UNTITLED_SEARCH_H
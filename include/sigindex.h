@@ -0,0 +1,149 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_SIGINDEX_H
+#define FILEDISTANCE_SIGINDEX_H
+
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint64_t
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "filter.h"
+
+
+/* Index of the signatures of the files under a directory, kept in the
+ * directory itself. Searches look files up by path: an entry is used
+ * only while the device, inode, size and mtime of the file still match,
+ * otherwise the file is read again and its entry replaced.
+ *
+ * File: SIGINDEX_MAGIC, the size of an entry, the number of entries and
+ * the bytes of the names, then the entries and the names. Entries are in
+ * the host's layout, the index is mapped and its signatures used as they
+ * are: one written by another build or machine is just rebuilt. */
+
+#define SIGINDEX_NAME ".filedistance.idx"
+#define SIGINDEX_MAGIC "FDI\1"
+#define SIGINDEX_MAGIC_LEN 4
+
+
+/* a file of the directory */
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;    /* of the contents */
+    uint64_t name;    /* offset of the path, relative to the directory, in the names */
+    uint64_t namelen;
+    signature sig;
+} sigindex_entry;
+
+
+/* entries added by one thread during a run */
+typedef struct
+{
+    sigindex_entry* entries;
+    size_t n;
+    size_t cap;
+    char* names;
+    size_t nnames;
+    size_t namecap;
+} sigindex_batch;
+
+
+/* the index as it was when the run started */
+typedef struct
+{
+    char* root;           /* the directory, absolute */
+    size_t rootlen;
+    const char* map;
+    size_t mapsize;
+    const sigindex_entry* entries;
+    size_t n;
+    const char* names;
+    uint32_t* slots;      /* open addressing on the names, entry + 1, 0 if free */
+    size_t nslots;
+    atomic_uchar* seen;   /* per entry: walked this run, or replaced. Marked by any thread */
+} sigindex;
+
+
+/// Maps the index of dir, an empty one if it's missing or unusable
+///
+/// \param idx the index to open
+/// \param dir the directory
+/// \return 0 if succeeded, -1 if dir is not a directory or out of memory
+int sigindex_open(sigindex* idx, const char* dir);
+
+
+/// Marks the entry of path as still there, if it has one. Entries not
+/// marked during a run are dropped when the index is saved
+///
+/// \param idx the index
+/// \param path absolute path of a file under the directory
+void sigindex_mark(sigindex* idx, const char* path);
+
+
+/// Finds the entry of path, if it's up to date with st. An outdated
+/// entry is dropped when the index is saved
+///
+/// \param idx the index
+/// \param path absolute path of a file under the directory
+/// \param st the file's current status
+/// \return the entry, NULL if there's none or it's outdated
+const sigindex_entry* sigindex_find(sigindex* idx, const char* path, const struct stat* st);
+
+
+/// Adds the entry of a file read during the run
+///
+/// \param b the thread's batch
+/// \param idx the index
+/// \param path absolute path of the file
+/// \param st the file's status when it was read
+/// \param hash the hash of the contents
+/// \param sig the whole signature of the contents
+/// \return 0 if succeeded, -1 if out of memory
+int sigindex_batch_add(sigindex_batch* b, const sigindex* idx, const char* path, const struct stat* st,
+                       uint64_t hash, const signature* sig);
+
+
+/// Frees the contents of b
+///
+/// \param b the batch
+void sigindex_batch_free(sigindex_batch* b);
+
+
+/// Writes the marked entries and the batches' ones in place of the index,
+/// if anything changed. The new file is renamed over the old one, so
+/// other runs reading it are not disturbed
+///
+/// \param idx the index
+/// \param batches the batches of the run
+/// \param nbatches how many
+/// \return 0 if succeeded, -1 otherwise
+int sigindex_save(sigindex* idx, const sigindex_batch* batches, int nbatches);
+
+
+/// Unmaps the index and frees idx's contents
+///
+/// \param idx the index
+void sigindex_close(sigindex* idx);
+
+
+#endif //FILEDISTANCE_SIGINDEX_H
@@ -0,0 +1,117 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_TOKENS_H
+#define FILEDISTANCE_TOKENS_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t, uint64_t
+
+
+/* what an edit adds, deletes or changes */
+typedef enum
+{
+    UNIT_BYTE,
+    UNIT_LINE, /* the bytes up to a newline, which isn't part of the line */
+    UNIT_WORD  /* a run of non blank bytes */
+} unit_t;
+
+
+/* a token of the interned file */
+typedef struct
+{
+    const char* p; /* NULL if the slot is free */
+    size_t len;
+    uint64_t hash;
+    uint32_t id;
+} token_slot;
+
+
+/* The tokens of one file, each distinct one with its own id from 0 up.
+ * Any other file is compared to it by looking its tokens up: those not
+ * found can't match any token of the interned file, they all get nids.
+ * Files added to the table get the ids of all the ones before. */
+typedef struct
+{
+    unit_t unit;
+    token_slot* slots; /* open addressing, a power of 2 of them */
+    size_t nslots;
+    uint32_t nids;
+    uint32_t* ids;     /* the interned file as ids */
+    size_t n;
+} token_table;
+
+
+/// Parses the name of a unit
+///
+/// \param name "byte", "line" or "word"
+/// \param unit receives the unit
+/// \return 0 if succeeded, -1 if name is not a unit
+int unit_parse(const char* name, unit_t* unit);
+
+
+/// Splits buf in tokens and gives each distinct one an id. The table
+/// points into buf, which must outlive it
+///
+/// \param buf the contents
+/// \param len length of buf
+/// \param unit line or word
+/// \param t the table to fill
+/// \return 0 if succeeded, -1 if out of memory
+int tokens_intern(const char* buf, size_t len, unit_t unit, token_table* t);
+
+
+/// Splits buf in tokens and finds their ids in t, the tokens not in t
+/// added with new ids: the files added to one table share its ids. The
+/// table points into buf, which must outlive it
+///
+/// \param t the table, of an empty buffer for a table of files only
+/// \param buf the contents
+/// \param len length of buf
+/// \param ids receives the ids. To be freed
+/// \param n receives the number of tokens
+/// \return 0 if succeeded, -1 if out of memory
+int tokens_add(token_table* t, const char* buf, size_t len, uint32_t** ids, size_t* n);
+
+
+/// Splits buf in tokens and finds their ids in t
+///
+/// \param t the table
+/// \param buf the contents
+/// \param len length of buf
+/// \param ids receives the ids, t->nids for tokens not in t. To be freed
+/// \param n receives the number of tokens
+/// \return 0 if succeeded, -1 if out of memory
+int tokens_lookup(const token_table* t, const char* buf, size_t len, uint32_t** ids, size_t* n);
+
+
+/// Frees the contents of t
+///
+/// \param t the table
+void tokens_free(token_table* t);
+
+
+/// Finds the distance between file1 and file2 counted in units
+///
+/// \param file1 first file
+/// \param file2 second file
+/// \param unit line or word
+/// \return the distance, -1 on error
+long tokens_file_distance(const char* file1, const char* file2, unit_t unit);
+
+
+#endif //FILEDISTANCE_TOKENS_H
@@ -19,6 +19,10 @@
 #define FILEDISTANCE_UTIL_H
 
 #include <stdio.h>
+#include <stddef.h>    // size_t
+#include <stdint.h>    // uint64_t
+#include <stdbool.h>
+#include <sys/types.h> // u_int32_t
 #include "script.h"
 
 
@@ -39,27 +43,36 @@ int min(int x, int y);
 int minmin(int x, int y, int z);
 
 
-/// Copies len bytes from in to out, starting off from their current seek
+/// Loads contents of file into buffer
+/// \param filename the file to be loaded
+/// \param buffer the buffer to copy into
+/// \return the size of the file if succeeded, < 0 otherwise
+long file_load(const char* filename, char** buffer);
+
+
+/// Maps the contents of file read only, to be released with file_unmap
 ///
-/// \param in the file to copy from
-/// \param out the file to copy to
-/// \param len amount of bytes to copy
+/// \param filename the file to be mapped
+/// \param buffer receives the contents, NULL if the file is empty
+/// \param size receives the size of the file
 /// \return 0 if succeeded, -1 otherwise
-int file_copy_to(FILE* infile, FILE* outfile, u_int32_t pos_to);
+int file_map(const char* filename, const char** buffer, size_t* size);
 
 
-/// Copies bytes from infile to outfile
+/// Maps size bytes of an open file read only, to be released with file_unmap
 ///
-/// \param infile file to copy from
-/// \param outfile file to copy to
-void file_copy(FILE* infile, FILE* outfile);
+/// \param fd the file, it can be closed once mapped
+/// \param size the size of the file
+/// \param buffer receives the contents, NULL if size is 0
+/// \return 0 if succeeded, -1 otherwise
+int file_map_fd(int fd, size_t size, const char** buffer);
 
 
-/// Loads contents of file into buffer
-/// \param filename the file to be loaded
-/// \param buffer the buffer to copy into
-/// \return 0 if succeeded, -1 otherwise
-int file_load(const char* filename, char** buffer);
+/// Releases a mapping from file_map
+///
+/// \param buffer the contents
+/// \param size the size of the file
+void file_unmap(const char* buffer, size_t size);
 
 
 /// Converts buf to unsigned int 32 bit
@@ -69,4 +82,53 @@ int file_load(const char* filename, char** buffer);
 u_int32_t bytes_to_uint32(const char* buf);
 
 
+/* the files this program keeps in the directories it searches start with it */
+#define OWN_PREFIX ".filedistance."
+
+
+/// Tells whether path is one of the files this program keeps in the
+/// directories, an index or one being written
+///
+/// \param path the path
+/// \param len length of path
+/// \return true if the searches must leave it out
+bool file_is_own(const char* path, size_t len);
+
+
+/// Creates a temporary file next to file, readable by all, to be written
+/// and then put in file's place by file_replace_commit: readers of file
+/// never see it half written
+///
+/// \param file the file to replace
+/// \param tmp receives the name of the temporary file, PATH_MAX bytes
+/// \return the temporary file open for writing, NULL on error
+FILE* file_replace_open(const char* file, char* tmp);
+
+
+/// Closes the file from file_replace_open and renames it to file if it
+/// was all written, removes it otherwise
+///
+/// \param f the temporary file
+/// \param tmp its name
+/// \param file the file to replace
+/// \param ok whether all the writes succeeded
+/// \return 0 if file was replaced, -1 otherwise
+int file_replace_commit(FILE* f, const char* tmp, const char* file, bool ok);
+
+
+/// Hashes the contents of buf, to tell files apart without comparing them
+///
+/// \param buf the contents
+/// \param len length of buf
+/// \return the 64-bit hash
+uint64_t hash_bytes(const char* buf, size_t len);
+
+
+/// Counts the cpus this process can use: the ones it may run on,
+/// capped by the cgroup cpu quota if there is one
+///
+/// \return the count, at least 1
+int cpu_count(void);
+
+
 #endif // FILEDISTANCE_UTIL_H
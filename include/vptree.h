@@ -0,0 +1,124 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_VPTREE_H
+#define FILEDISTANCE_VPTREE_H
+
+#include <stddef.h>   // size_t
+#include <stdint.h>   // uint32_t, uint64_t
+#include <stdbool.h>
+
+#include "tokens.h"
+
+
+/* Vantage point tree of a directory, for exact searches that don't
+ * compare every file. Each node is a file, the vantage point: the files
+ * at most radius from it are in the inside subtree, the farther ones in
+ * the outside subtree. A query at distance d from the vantage point
+ * looking for files within tau skips the inside subtree if d - radius
+ * > tau and the outside one if radius + 1 - d > tau: the distance is a
+ * metric, the triangle inequality rules them out.
+ *
+ * The nodes are stored in preorder: the inside subtree of node i starts
+ * at i + 1, the outside one right after it. The tree holds the distances
+ * of one unit, the one it was built with.
+ *
+ * The files changed since the build no longer are where the distances
+ * put them: a query first walks the directory and stats each file,
+ * compares the changed and added ones directly and never prunes on a
+ * changed node. A stale tree gives the same answers, only slower.
+ * A query is then linear in the files stat'ed by the walk, sublinear
+ * only in the distances it computes.
+ *
+ * File: VPTREE_MAGIC, the unit, the number of files and the bytes of the
+ * names. Then a node per file, then the names of the files relative to
+ * the directory. Host byte order, like the signature index. */
+
+#define VPTREE_NAME ".filedistance.vpt"
+#define VPTREE_MAGIC "FDV\1"
+#define VPTREE_MAGIC_LEN 4
+
+
+typedef struct
+{
+    int64_t radius;     /* the files of the inside subtree are at most this far */
+    uint64_t size;      /* of the file when the tree was built */
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t name;      /* offset of the name in the names */
+    uint32_t namelen;
+    uint32_t inside;    /* nodes of the inside subtree */
+    uint32_t count;     /* nodes of the subtree, this one included */
+    uint32_t unused;
+} vptree_node;
+
+
+/* a file found by a query */
+typedef struct
+{
+    char* path;
+    long distance;
+} vptree_hit;
+
+
+/* what a query found */
+typedef struct
+{
+    vptree_hit* hits;
+    size_t n;
+    unsigned long files;    /* in the tree */
+    unsigned long compared; /* to the query, the others were pruned */
+    unsigned long changed;  /* or gone since the build */
+    unsigned long added;    /* since the build */
+} vptree_result;
+
+
+/// Builds the tree of the files under dir, in place of the old one
+///
+/// \param dir the directory
+/// \param unit what the distances count
+/// \param threads how many distances to compute at the same time
+/// \return the number of files in the tree, -1 on error
+long vptree_build(const char* dir, unit_t unit, int threads);
+
+
+/// Finds the files of dir within bound from the query, through its tree
+/// for the files unchanged since the build. With k set the bound drops to
+/// the k-th best distance found, if nearest to the best one, and the
+/// files farther than the final bound are left out
+///
+/// \param dir the directory
+/// \param buf the contents of the query
+/// \param len length of buf
+/// \param tokens the query's tokens, NULL to count bytes
+/// \param bound the greatest distance to look for
+/// \param k keep the k closest only, 0 to keep all within bound
+/// \param nearest the bound drops to the best distance found
+/// \param threads how many distances to compute at the same time
+/// \param res receives the files found, to be freed with vptree_result_free
+/// \return 0 if succeeded, -1 if there's no usable tree for the unit or on error
+int vptree_query(const char* dir, const char* buf, size_t len, const token_table* tokens, long bound, size_t k,
+                 bool nearest, int threads, vptree_result* res);
+
+
+/// Frees the files found by vptree_query
+///
+/// \param res the result
+void vptree_result_free(vptree_result* res);
+
+
+#endif //FILEDISTANCE_VPTREE_H
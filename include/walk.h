@@ -0,0 +1,79 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_WALK_H
+#define FILEDISTANCE_WALK_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t, int64_t
+
+
+/// Called for each regular file found, symlinks to regular files included
+///
+/// \param path absolute path of the file, valid during the call only
+/// \param len length of path
+/// \param walker index of the walking thread, from 0 to threads - 1
+/// \param arg the argument given to walk_tree
+/// \return 0 to go on, anything else stops the walk
+typedef int (*walk_visit_f)(const char* path, size_t len, int walker, void* arg);
+
+
+/// Walks the tree under root, directories are read with getdents64 and
+/// their entries told apart by d_type, falling back to fstatat only when
+/// the file system doesn't fill it. Subtrees are shared between the
+/// threads, the calling one being walker 0, an idle one steals directories
+/// from the others. Symlinks to directories are not followed, directories
+/// that can't be read are skipped
+///
+/// \param root the directory to walk, or a single file
+/// \param threads how many threads walk at the same time
+/// \param visit called for each regular file, from any of the threads
+/// \param arg passed to visit
+/// \return 0 if succeeded, -1 if root can't be read, out of memory or visit stopped the walk
+int walk_tree(const char* root, int threads, walk_visit_f visit, void* arg);
+
+
+/* a file found by walk_collect, as it was when found */
+typedef struct
+{
+    char* name;         /* relative to the root */
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} walk_file;
+
+
+/// Finds the files under root the indexes and the corpora are made of:
+/// the regular files that can be read, but the program's own. They're
+/// sorted by name, whatever order the walk found them in
+///
+/// \param root the directory
+/// \param threads how many threads walk at the same time
+/// \param files receives the files, to be freed with walk_files_free
+/// \param n receives the number of files
+/// \return 0 if succeeded, -1 if root can't be read or out of memory
+int walk_collect(const char* root, int threads, walk_file** files, size_t* n);
+
+
+/// Frees the files from walk_collect
+///
+/// \param files the files, their names included unless NULL
+/// \param n the number of files
+void walk_files_free(walk_file* files, size_t n);
+
+
+#endif //FILEDISTANCE_WALK_H
@@ -0,0 +1,76 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEDISTANCE_WORKQUEUE_H
+#define FILEDISTANCE_WORKQUEUE_H
+
+#include <stddef.h>    // size_t
+#include <stdbool.h>
+#include <stdatomic.h>
+
+
+/* Bounded lock-free queue, any number of threads pushing and popping
+ * (Vyukov). Each cell has a sequence number telling whether it's free
+ * for the push of round k or full for the pop of round k. */
+
+typedef struct
+{
+    atomic_size_t seq;
+    void* data;
+} workqueue_cell;
+
+
+typedef struct
+{
+    workqueue_cell* cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t head; /* next push */
+    _Alignas(64) atomic_size_t tail; /* next pop */
+} workqueue;
+
+
+/// Creates an empty queue
+///
+/// \param q the queue
+/// \param capacity how many items it holds, a power of 2
+/// \return 0 if succeeded, -1 if out of memory
+int workqueue_init(workqueue* q, size_t capacity);
+
+
+/// Adds an item, without waiting
+///
+/// \param q the queue
+/// \param data the item
+/// \return false if the queue is full
+bool workqueue_push(workqueue* q, void* data);
+
+
+/// Takes the oldest item, without waiting
+///
+/// \param q the queue
+/// \param data receives the item
+/// \return false if the queue is empty
+bool workqueue_pop(workqueue* q, void** data);
+
+
+/// Frees the queue, the items left in it aren't touched
+///
+/// \param q the queue
+void workqueue_free(workqueue* q);
+
+
+#endif //FILEDISTANCE_WORKQUEUE_H
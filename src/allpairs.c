@@ -0,0 +1,367 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>  // uint32_t
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../include/allpairs.h"
+#include "../include/corpus.h"
+#include "../include/distance.h"
+
+
+/* bytes of the files of a tile, both sides: about a core's L2 */
+#define TILE_BYTES (512 * 1024)
+
+/* files on each side of a tile */
+#define TILE_MIN 4
+#define TILE_MAX 256
+
+
+typedef struct
+{
+    char magic[ALLPAIRS_MAGIC_LEN];
+    uint32_t sparse;
+    uint64_t n;
+    int64_t limit;
+    uint64_t namesize;
+} allpairs_header;
+
+
+/* a sparse pair */
+typedef struct
+{
+    uint32_t i;
+    uint32_t j;
+    uint32_t distance;
+} allpairs_pair;
+
+
+/* the tile of files rows * side .. and cols * side .. */
+typedef struct
+{
+    uint32_t rows;
+    uint32_t cols;
+} allpairs_tile;
+
+
+/* The tiles are taken in turn, the rows of the first blocks first: the
+ * blocks of rows are written in order, each freed once written. The
+ * lock guards the rows and the output. */
+typedef struct
+{
+    const corpus* c;
+    long bound;
+    bool sparse;
+    size_t side;              /* files per side of a tile */
+    size_t nblocks;
+    allpairs_tile* tiles;
+    size_t ntiles;
+    atomic_size_t next;       /* first tile not taken yet */
+    uint32_t** rows;          /* per block: side rows of n distances */
+    atomic_size_t* left;      /* per block: tiles not done yet */
+    size_t written;           /* blocks written */
+    FILE* out;
+    pthread_mutex_t lock;
+    atomic_bool failed;
+} allpairs_job;
+
+
+typedef struct
+{
+    allpairs_job* job;
+    filter_stats stats;
+} allpairs_worker;
+
+
+/* the rows of block b, allocated by the first of its tiles */
+static uint32_t* block_rows(allpairs_job* job, size_t b)
+{
+    pthread_mutex_lock(&job->lock);
+    if (!job->rows[b])
+    {
+        job->rows[b] = malloc(job->side * job->c->n * sizeof(uint32_t));
+    }
+    uint32_t* rows = job->rows[b];
+    pthread_mutex_unlock(&job->lock);
+
+    return rows;
+}
+
+
+/* writes the pairs of block b. Called with the lock held */
+static bool block_write(allpairs_job* job, size_t b)
+{
+    size_t n = job->c->n;
+    size_t first = b * job->side;
+    size_t last = first + job->side < n ? first + job->side : n;
+    const uint32_t* rows = job->rows[b];
+    bool ok = true;
+
+    for (size_t i = first; ok && i < last; i++)
+    {
+        const uint32_t* row = rows + (i - first) * n;
+        if (!job->sparse)
+        {
+            ok = fwrite(row + i + 1, sizeof(uint32_t), n - i - 1, job->out) == n - i - 1;
+            continue;
+        }
+
+        for (size_t j = i + 1; ok && j < n; j++)
+        {
+            if ((long) row[j] <= job->bound)
+            {
+                allpairs_pair p = {(uint32_t) i, (uint32_t) j, row[j]};
+                ok = fwrite(&p, sizeof(p), 1, job->out) == 1;
+            }
+        }
+    }
+
+    return ok;
+}
+
+
+/* writes the blocks done, in order */
+static void blocks_flush(allpairs_job* job)
+{
+    pthread_mutex_lock(&job->lock);
+    while (!job->failed && job->written < job->nblocks && atomic_load(&job->left[job->written]) == 0)
+    {
+        if (!block_write(job, job->written))
+        {
+            job->failed = true;
+        }
+        free(job->rows[job->written]);
+        job->rows[job->written] = NULL;
+        job->written++;
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+
+static bool tile_run(allpairs_worker* w, const allpairs_tile* t, uint32_t* rows)
+{
+    allpairs_job* job = w->job;
+    size_t n = job->c->n;
+    size_t side = job->side;
+    size_t i0 = t->rows * side;
+    size_t i1 = i0 + side < n ? i0 + side : n;
+    size_t j0 = t->cols * side;
+    size_t j1 = j0 + side < n ? j0 + side : n;
+
+    for (size_t i = i0; i < i1; i++)
+    {
+        uint32_t* row = rows + (i - i0) * n;
+        for (size_t j = j0 > i + 1 ? j0 : i + 1; j < j1; j++)
+        {
+            long d = corpus_distance(job->c, i, j, job->bound, &w->stats);
+            if (d < 0)
+            {
+                return false;
+            }
+            row[j] = d > UINT32_MAX ? UINT32_MAX : (uint32_t) d;
+        }
+    }
+
+    return true;
+}
+
+
+static void* allpairs_worker_run(void* arg)
+{
+    allpairs_worker* w = (allpairs_worker*) arg;
+    allpairs_job* job = w->job;
+
+    size_t t;
+    while (!job->failed && (t = atomic_fetch_add(&job->next, 1)) < job->ntiles)
+    {
+        const allpairs_tile* tile = &job->tiles[t];
+        uint32_t* rows = block_rows(job, tile->rows);
+        if (!rows || !tile_run(w, tile, rows))
+        {
+            job->failed = true;
+            break;
+        }
+
+        /* the last tile of its rows writes out all the rows done */
+        if (atomic_fetch_sub(&job->left[tile->rows], 1) == 1)
+        {
+            blocks_flush(job);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* files per side of a tile, for both sides to fit TILE_BYTES */
+static size_t tile_side(const corpus* c)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < c->n; i++)
+    {
+        total += c->lens[i];
+    }
+
+    size_t avg = c->n ? total / c->n : 0;
+    size_t side = avg ? TILE_BYTES / (2 * avg) : TILE_MAX;
+
+    return side < TILE_MIN ? TILE_MIN : side > TILE_MAX ? TILE_MAX : side;
+}
+
+
+static bool header_write(FILE* out, const corpus* c, long limit, bool sparse)
+{
+    allpairs_header h;
+    memcpy(h.magic, ALLPAIRS_MAGIC, ALLPAIRS_MAGIC_LEN);
+    h.sparse = sparse;
+    h.n = c->n;
+    h.limit = limit;
+    h.namesize = 0;
+    for (size_t i = 0; i < c->n; i++)
+    {
+        h.namesize += strlen(c->names[i]) + 1;
+    }
+
+    bool ok = fwrite(&h, sizeof(h), 1, out) == 1;
+    for (size_t i = 0; ok && i < c->n; i++)
+    {
+        size_t len = strlen(c->names[i]) + 1;
+        ok = fwrite(c->names[i], 1, len, out) == len;
+    }
+
+    return ok;
+}
+
+
+long allpairs_run(const char* dir, const char* output, unit_t unit, long limit, bool sparse, int threads,
+                  filter_stats* stats)
+{
+    memset(stats, 0, sizeof(filter_stats));
+
+    /* the signatures only rule pairs out past a limit */
+    corpus c;
+    if (corpus_load(&c, dir, unit, limit >= 0 && unit == UNIT_BYTE, threads) != 0)
+    {
+        return -1;
+    }
+    if (c.n >= UINT32_MAX)
+    {
+        corpus_free(&c);
+        return -1;
+    }
+
+    FILE* out = fopen(output, "wb");
+    if (!out)
+    {
+        corpus_free(&c);
+        return -1;
+    }
+
+    allpairs_job job;
+    memset(&job, 0, sizeof(job));
+    job.c = &c;
+    job.bound = limit >= 0 && limit < BOUND_MAX ? limit : BOUND_MAX;
+    job.sparse = sparse;
+    job.side = tile_side(&c);
+    job.nblocks = (c.n + job.side - 1) / job.side;
+    job.ntiles = job.nblocks * (job.nblocks + 1) / 2;
+    job.tiles = malloc((job.ntiles ? job.ntiles : 1) * sizeof(allpairs_tile));
+    job.rows = calloc(job.nblocks ? job.nblocks : 1, sizeof(uint32_t*));
+    job.left = malloc((job.nblocks ? job.nblocks : 1) * sizeof(atomic_size_t));
+    job.out = out;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, !job.tiles || !job.rows || !job.left || !header_write(out, &c, limit, sparse));
+    pthread_mutex_init(&job.lock, NULL);
+
+    /* the upper triangle, the tiles of each block of rows together */
+    size_t t = 0;
+    for (size_t r = 0; job.tiles && job.left && r < job.nblocks; r++)
+    {
+        atomic_init(&job.left[r], job.nblocks - r);
+        for (size_t col = r; col < job.nblocks; col++)
+        {
+            job.tiles[t++] = (allpairs_tile) {(uint32_t) r, (uint32_t) col};
+        }
+    }
+
+    int nworkers = threads < 1 ? 1 : threads;
+    allpairs_worker* workers = calloc(nworkers, sizeof(allpairs_worker));
+    pthread_t* tids = malloc(nworkers * sizeof(pthread_t));
+    if (!workers || !tids)
+    {
+        job.failed = true;
+    }
+
+    /* the calling thread is worker 0 */
+    int started = 1;
+    while (!job.failed && started < nworkers)
+    {
+        workers[started].job = &job;
+        if (pthread_create(&tids[started], NULL, allpairs_worker_run, &workers[started]) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+
+    if (!job.failed)
+    {
+        workers[0].job = &job;
+        allpairs_worker_run(&workers[0]);
+    }
+
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; workers && i < started; i++)
+    {
+        for (int s = 0; s < FILTER_STAGES; s++)
+        {
+            stats->rejected[s] += workers[i].stats.rejected[s];
+        }
+        stats->passed += workers[i].stats.passed;
+    }
+
+    bool failed = job.failed || job.written != job.nblocks;
+    for (size_t b = 0; job.rows && b < job.nblocks; b++)
+    {
+        free(job.rows[b]);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    free(job.tiles);
+    free(job.rows);
+    free(job.left);
+    free(workers);
+    free(tids);
+
+    if (fclose(out) != 0)
+    {
+        failed = true;
+    }
+
+    long n = (long) c.n;
+    corpus_free(&c);
+
+    return failed ? -1 : n;
+}
@@ -16,136 +16,567 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <sys/stat.h>
+#include <sys/mman.h> // mmap
+#include <fcntl.h>    // open
+#include <unistd.h>   // ftruncate, write
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-#include "../include/list.h"
-#include "../include/endianness.h"
 #include "../include/util.h"
 #include "../include/apply.h"
 
 
-#define CMDSIZE 8
-
 char* SCRIPTEMPTY     = "ERROR: Script file is empty.               \n";
 char* CANTOPENMORE    = "ERROR: Can't open one or more files.       \n";
 char* INVALIDCORRUPTD = "ERROR: Script file is invalid or corrupted.\n";
 
 
-void apply_print_err(int err)
+/* text of err, NULL if it's not an apply error */
+static const char* apply_err_text(int err)
 {
     switch (err)
     {
         case EEMPTYSCRIPT:
+            return SCRIPTEMPTY;
+        case ECANTOPEN:
+            return CANTOPENMORE;
+        case ECORRUPTD:
+            return INVALIDCORRUPTD;
+
+        default:
+            return NULL;
+    }
+}
+
+
+void apply_print_err(int err)
+{
+    const char* text = apply_err_text(err);
+    if (text)
+    {
+        printf("%s", text);
+    }
+}
+
+
+/* where the output goes: a presized mapping when the
+ * output is a regular file, plain writes otherwise */
+typedef struct
+{
+    int fd;
+    char* map;
+    size_t size;
+    size_t off;
+    bool failed;
+} apply_out;
+
+
+static void out_put(apply_out* out, const char* p, size_t len)
+{
+    if (out->map)
+    {
+        memcpy(out->map + out->off, p, len);
+        out->off += len;
+        return;
+    }
+
+    while (len > 0 && !out->failed)
+    {
+        ssize_t w = write(out->fd, p, len);
+        if (w < 0 && errno != EINTR)
         {
-            printf("%s", SCRIPTEMPTY);
-            break;
+            out->failed = true;
         }
-        case ECANTOPEN:
+        else if (w > 0)
         {
-            printf("%s", CANTOPENMORE);
-            break;
+            p += w;
+            len -= w;
+            out->off += w;
         }
-        case ECORRUPTD:
+    }
+}
+
+
+/* Checks that the runs are in order and inside an input of
+ * insize bytes, and finds the size of the output */
+static int apply_check(const edit_script* script, size_t insize, size_t* outsize)
+{
+    size_t pos = 0;
+    size_t size = insize;
+
+    for (size_t i = 0; i < script->nruns; i++)
+    {
+        const edit_run* r = &script->runs[i];
+
+        if (r->position < pos || r->position > insize
+            || (r->operation != ADD && r->len > insize - r->position))
         {
-            printf("%s", INVALIDCORRUPTD);
-            break;
+            return -1;
         }
 
-        default:
-            return;
+        switch (r->operation)
+        {
+            case ADD:
+            {
+                size += r->len;
+                pos = r->position;
+                break;
+            }
+            case DEL:
+            {
+                size -= r->len;
+                pos = r->position + r->len;
+                break;
+            }
+            default:
+            {
+                pos = r->position + r->len;
+                break;
+            }
+        }
     }
+
+    *outsize = size;
+    return 0;
 }
 
 
-int apply_edit_script(const char* infilename, const char* scriptfilename, const char* outfilename)
+int apply_script(const edit_script* script, const char* infilename, const char* outfilename)
 {
-    if (infilename == NULL || scriptfilename == NULL || outfilename == NULL)
+    if (script == NULL || infilename == NULL || outfilename == NULL)
     {
         return -1;
     }
 
-    /* open infile and scriptfile read, open outfile write */
+    /* map infile */
 
-    FILE* infile     = fopen(infilename,     "r");
-    FILE* scriptfile = fopen(scriptfilename, "r");
-    FILE* outfile    = fopen(outfilename,    "w");
+    const char* in = NULL;
+    size_t insize = 0;
+    if (file_map(infilename, &in, &insize) != 0)
+    {
+        errno = ECANTOPEN;
+        return -1;
+    }
+    if (in)
+    {
+        madvise((void*) in, insize, MADV_SEQUENTIAL);
+    }
 
-    if (!infile || !scriptfile || !outfile)
+    size_t outsize = 0;
+    if (apply_check(script, insize, &outsize) != 0)
     {
+        file_unmap(in, insize);
+        errno = ECORRUPTD;
+        return -1;
+    }
+
+    /* refuse to truncate infile while it's being read */
+
+    struct stat sti;
+    struct stat sto;
+    if (stat(infilename, &sti) == 0 && stat(outfilename, &sto) == 0
+        && sti.st_dev == sto.st_dev && sti.st_ino == sto.st_ino)
+    {
+        file_unmap(in, insize);
+        errno = ECANTOPEN;
+        return -1;
+    }
+
+    /* presize outfile and map it, if it's a regular file */
+
+    apply_out out = {open(outfilename, O_RDWR | O_CREAT | O_TRUNC, 0666), NULL, outsize, 0, false};
+    if (out.fd == -1)
+    {
+        out.fd = open(outfilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (out.fd == -1)
+    {
+        file_unmap(in, insize);
         errno = ECANTOPEN;
         return -1;
     }
 
+    if (outsize > 0 && fstat(out.fd, &sto) == 0 && S_ISREG(sto.st_mode) && ftruncate(out.fd, (off_t) outsize) == 0)
+    {
+        void* p = mmap(NULL, outsize, PROT_READ | PROT_WRITE, MAP_SHARED, out.fd, 0);
+        out.map = p == MAP_FAILED ? NULL : (char*) p;
+    }
+
+    /* every byte of infile is read once, every byte of outfile written once */
+
+    size_t pos = 0;
+    for (size_t i = 0; i < script->nruns; i++)
+    {
+        const edit_run* r = &script->runs[i];
+
+        /* unchanged span up to the run */
+        out_put(&out, in + pos, r->position - pos);
+
+        if (r->operation != DEL)
+        {
+            out_put(&out, script->data + r->data, r->len);
+        }
+
+        pos = r->operation == ADD ? r->position : r->position + r->len;
+    }
+    out_put(&out, in + pos, insize - pos);
+
+    if (out.map)
+    {
+        munmap(out.map, outsize);
+    }
+    if (close(out.fd) != 0)
+    {
+        out.failed = true;
+    }
+    file_unmap(in, insize);
+
+    if (out.failed || out.off != outsize)
+    {
+        errno = ECANTOPEN;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* loads a v1 or v2 script as runs, sets errno on failure */
+static int apply_load(const char* scriptfilename, edit_script* script)
+{
     /* fail if script file size == 0 */
 
     struct stat st1;
-    stat(scriptfilename, &st1);
-    if (st1.st_size == 0)
+    if (stat(scriptfilename, &st1) == 0 && st1.st_size == 0)
     {
         errno = EEMPTYSCRIPT;
         return -1;
     }
 
-    /* ensure seeks are at a known value, begin */
+    int ret = script_load(scriptfilename, script);
+    if (ret != 0)
+    {
+        errno = ret == -2 ? ECORRUPTD : ECANTOPEN;
+        return -1;
+    }
 
-    rewind(infile);
-    rewind(scriptfile);
-    rewind(outfile);
+    return 0;
+}
 
-    char buf[CMDSIZE];
 
-    while (fread(&buf, CMDSIZE, 1, scriptfile) > 0)
+int apply_edit_script(const char* infilename, const char* scriptfilename, const char* outfilename)
+{
+    if (infilename == NULL || scriptfilename == NULL || outfilename == NULL)
     {
-        /* get command's position and char */
-        u_int32_t position = ntohl(bytes_to_uint32(&buf[3]));
-        char c = buf[CMDSIZE - 1];
+        return -1;
+    }
 
-        if (strncmp(buf, "ADD", 3) == 0)
+    edit_script script;
+    if (apply_load(scriptfilename, &script) != 0)
+    {
+        return -1;
+    }
+
+    int ret = apply_script(&script, infilename, outfilename);
+    script_free(&script);
+
+    return ret;
+}
+
+
+/* one line of the manifest */
+typedef struct
+{
+    char* input;
+    char* script;
+    char* output;
+    size_t line;
+    size_t sid;  /* index of the script among the distinct ones */
+    bool failed;
+    int err;
+} batch_job;
+
+
+/* a distinct script, loaded once */
+typedef struct
+{
+    const char* name;
+    edit_script script;
+    bool failed;
+    int err;
+} batch_script;
+
+
+typedef struct
+{
+    batch_job* jobs;
+    size_t njobs;
+    batch_script* scripts;
+    size_t nscripts;
+    atomic_size_t next;    /* next script to load, then next job to run */
+    bool loading;
+} batch;
+
+
+static void* batch_worker(void* arg)
+{
+    batch* b = (batch*) arg;
+
+    for (;;)
+    {
+        size_t i = atomic_fetch_add(&b->next, 1);
+
+        if (b->loading)
         {
-            /* copy from infile's seek to position + 1 */
-            file_copy_to(infile, outfile, position + 1);
-            fputc(c, outfile);
+            if (i >= b->nscripts)
+                break;
+
+            batch_script* bs = &b->scripts[i];
+            if (apply_load(bs->name, &bs->script) != 0)
+            {
+                bs->failed = true;
+                bs->err = errno;
+            }
         }
-        else if (strncmp(buf, "DEL", 3) == 0)
+        else
         {
-            file_copy_to(infile, outfile, position);
+            if (i >= b->njobs)
+                break;
 
-            /* advance infile's seek so to skip a char */
-            fseek(infile, 1, SEEK_CUR);
+            batch_job* job = &b->jobs[i];
+            batch_script* bs = &b->scripts[job->sid];
+            if (bs->failed)
+            {
+                job->failed = true;
+                job->err = bs->err;
+            }
+            else if (apply_script(&bs->script, job->input, job->output) != 0)
+            {
+                job->failed = true;
+                job->err = errno;
+            }
         }
-        else if (strncmp(buf, "SET", 3) == 0)
+    }
+
+    return NULL;
+}
+
+
+/* runs batch_worker on threads threads, this one included */
+static void batch_run(batch* b, int threads)
+{
+    atomic_store(&b->next, 0);
+
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    while (tids && started < threads - 1 && pthread_create(&tids[started], NULL, batch_worker, b) == 0)
+    {
+        started++;
+    }
+
+    batch_worker(b);
+
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+}
+
+
+static int cmp_job_script(const void* a, const void* b)
+{
+    const batch_job* j1 = *(const batch_job* const*) a;
+    const batch_job* j2 = *(const batch_job* const*) b;
+
+    return strcmp(j1->script, j2->script);
+}
+
+
+/* Splits a manifest line into at most 3 blank separated fields.
+ * Returns how many there are, -1 if there are more */
+static int batch_fields(char* line, char** fields)
+{
+    int n = 0;
+    char* save = NULL;
+
+    for (char* tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if (n == 3)
         {
-            /* copy from infile's seek to position + 1 */
-            file_copy_to(infile, outfile, position + 1);
+            return -1;
+        }
+        fields[n++] = tok;
+    }
+
+    return n;
+}
+
+
+static void batch_free(batch* b)
+{
+    for (size_t i = 0; i < b->njobs; i++)
+    {
+        free(b->jobs[i].input);
+        free(b->jobs[i].script);
+        free(b->jobs[i].output);
+    }
+    for (size_t i = 0; i < b->nscripts; i++)
+    {
+        script_free(&b->scripts[i].script);
+    }
+
+    free(b->jobs);
+    free(b->scripts);
+}
+
+
+/* reads the manifest into b->jobs, -1 on error */
+static int batch_read(batch* b, const char* manifest, const char* scriptfilename)
+{
+    FILE* f = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!f)
+    {
+        fprintf(stderr, "%s: %s", manifest, CANTOPENMORE);
+        return -1;
+    }
+
+    size_t cap = 0;
+    char* line = NULL;
+    size_t linecap = 0;
+    size_t lineno = 0;
+    int ret = 0;
 
-            /* step back one char in outfile */
-            fseek(outfile, -1, SEEK_CUR);
-            fputc(c, outfile);
+    while (ret == 0 && getline(&line, &linecap, f) != -1)
+    {
+        lineno++;
+
+        /* input script output, or input output with a single script */
+        char* fields[3];
+        int n = batch_fields(line, fields);
+        if (n == 0 || fields[0][0] == '#')
+        {
+            continue;
         }
-        else
+        if (n != (scriptfilename ? 2 : 3))
         {
-            errno = ECORRUPTD;
+            fprintf(stderr, "%s:%zu: ERROR: Expected %s.\n", manifest, lineno,
+                    scriptfilename ? "input output" : "input script output");
+            ret = -1;
+            break;
+        }
 
-            /* close files */
-            fclose(infile);
-            fclose(scriptfile);
-            fclose(outfile);
-    
-            return -1;
+        if (b->njobs == cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            batch_job* jobs = realloc(b->jobs, cap * sizeof(batch_job));
+            if (!jobs)
+            {
+                ret = -1;
+                break;
+            }
+            b->jobs = jobs;
+        }
+
+        batch_job* job = &b->jobs[b->njobs];
+        memset(job, 0, sizeof(batch_job));
+        job->line = lineno;
+        job->input = strdup(fields[0]);
+        job->script = strdup(scriptfilename ? scriptfilename : fields[1]);
+        job->output = strdup(fields[n - 1]);
+        b->njobs++;
+
+        if (!job->input || !job->script || !job->output)
+        {
+            ret = -1;
         }
     }
 
-    /* copy every other char */
-    file_copy(infile, outfile);
+    free(line);
+    if (f != stdin)
+    {
+        fclose(f);
+    }
+
+    return ret;
+}
+
 
-    fflush(outfile);
+/* gives every job the index of its script, loading each distinct script once */
+static int batch_index_scripts(batch* b)
+{
+    batch_job** order = malloc(b->njobs * sizeof(batch_job*));
+    b->scripts = calloc(b->njobs, sizeof(batch_script));
+    if (!order || !b->scripts)
+    {
+        free(order);
+        return -1;
+    }
 
-    /* close files */
-    fclose(infile);
-    fclose(scriptfile);
-    fclose(outfile);
+    for (size_t i = 0; i < b->njobs; i++)
+    {
+        order[i] = &b->jobs[i];
+    }
+    qsort(order, b->njobs, sizeof(batch_job*), cmp_job_script);
 
+    for (size_t i = 0; i < b->njobs; i++)
+    {
+        if (i == 0 || strcmp(order[i]->script, order[i - 1]->script) != 0)
+        {
+            b->scripts[b->nscripts++].name = order[i]->script;
+        }
+        order[i]->sid = b->nscripts - 1;
+    }
+
+    free(order);
     return 0;
-}
\ No newline at end of file
+}
+
+
+int apply_batch(const char* manifest, const char* scriptfilename, int threads)
+{
+    if (manifest == NULL)
+    {
+        return -1;
+    }
+
+    batch b;
+    memset(&b, 0, sizeof(batch));
+
+    if (batch_read(&b, manifest, scriptfilename) != 0 || (b.njobs > 0 && batch_index_scripts(&b) != 0))
+    {
+        batch_free(&b);
+        return -1;
+    }
+
+    threads = threads < 1 ? 1 : threads;
+
+    /* decode every script once, then apply */
+    b.loading = true;
+    batch_run(&b, threads);
+    b.loading = false;
+    batch_run(&b, threads);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < b.njobs; i++)
+    {
+        batch_job* job = &b.jobs[i];
+        if (job->failed)
+        {
+            const char* text = apply_err_text(job->err);
+            fprintf(stderr, "%s:%zu: %s", manifest, job->line, text ? text : CANTOPENMORE);
+            failed++;
+        }
+    }
+
+    printf("APPLIED: %zu, FAILED: %zu\n", b.njobs - failed, failed);
+
+    batch_free(&b);
+
+    return failed ? -1 : 0;
+}
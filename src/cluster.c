@@ -0,0 +1,454 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>  // uint32_t
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../include/cluster.h"
+#include "../include/corpus.h"
+
+
+/* a pair the filters didn't rule out, with how close they bound it */
+typedef struct
+{
+    long bound;
+    uint32_t i;
+    uint32_t j;
+} cluster_pair;
+
+
+/* a file with its length in units, to sort them by length */
+typedef struct
+{
+    size_t len;
+    uint32_t file;
+} cluster_file;
+
+
+struct cluster_job;
+
+
+/* the pairs one thread found, and what it counted */
+typedef struct
+{
+    struct cluster_job* job;
+    cluster_pair* pairs;
+    size_t n;
+    size_t cap;
+    filter_stats stats;
+} cluster_worker;
+
+
+/* First the threads take the files by length and find the pairs the
+ * filters let through, then they take those pairs closest bound first.
+ * The lock guards the union-find and the pairs skipped. */
+typedef struct cluster_job
+{
+    const corpus* c;
+    long threshold;
+    cluster_file* bylen;    /* the files, shortest first */
+    cluster_pair* pairs;    /* of all the workers, closest bound first */
+    size_t npairs;
+    atomic_size_t next;     /* first file, then first pair, not taken yet */
+    uint32_t* parent;
+    uint32_t* size;         /* of the cluster, for the roots */
+    unsigned long together;
+    pthread_mutex_t lock;
+    atomic_bool failed;
+} cluster_job;
+
+
+static uint32_t uf_find(uint32_t* parent, uint32_t x)
+{
+    /* path halving: each one looked at skips a level */
+    while (parent[x] != x)
+    {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+
+    return x;
+}
+
+
+/* the smaller cluster goes under the bigger one */
+static void uf_union(cluster_job* job, uint32_t a, uint32_t b)
+{
+    a = uf_find(job->parent, a);
+    b = uf_find(job->parent, b);
+    if (a == b)
+    {
+        return;
+    }
+
+    if (job->size[a] < job->size[b])
+    {
+        uint32_t t = a;
+        a = b;
+        b = t;
+    }
+
+    job->parent[b] = a;
+    job->size[a] += job->size[b];
+}
+
+
+static int pair_add(cluster_worker* w, long bound, uint32_t i, uint32_t j)
+{
+    if (w->n == w->cap)
+    {
+        size_t cap = w->cap ? w->cap * 2 : 256;
+        cluster_pair* pairs = realloc(w->pairs, cap * sizeof(cluster_pair));
+        if (!pairs)
+        {
+            return -1;
+        }
+
+        w->pairs = pairs;
+        w->cap = cap;
+    }
+
+    w->pairs[w->n++] = (cluster_pair) {bound, i, j};
+    return 0;
+}
+
+
+/* pairs each file with the longer ones the filters don't rule out */
+static void* cluster_filter(void* arg)
+{
+    cluster_worker* w = (cluster_worker*) arg;
+    cluster_job* job = w->job;
+    size_t n = job->c->n;
+
+    size_t a;
+    while (!job->failed && (a = atomic_fetch_add(&job->next, 1)) < n)
+    {
+        const cluster_file* x = &job->bylen[a];
+        for (size_t b = a + 1; b < n; b++)
+        {
+            const cluster_file* y = &job->bylen[b];
+
+            /* the ones after are even longer */
+            if (y->len - x->len > (size_t) job->threshold)
+            {
+                w->stats.rejected[FILTER_SIZE] += n - b;
+                break;
+            }
+
+            uint32_t i = x->file < y->file ? x->file : y->file;
+            uint32_t j = x->file < y->file ? y->file : x->file;
+            long bound = corpus_bound(job->c, i, j, job->threshold, &w->stats);
+            if (bound <= job->threshold && pair_add(w, bound, i, j) != 0)
+            {
+                job->failed = true;
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/* compares the pairs not in the same cluster yet, joining the close ones */
+static void* cluster_join(void* arg)
+{
+    cluster_worker* w = (cluster_worker*) arg;
+    cluster_job* job = w->job;
+
+    size_t p;
+    while (!job->failed && (p = atomic_fetch_add(&job->next, 1)) < job->npairs)
+    {
+        const cluster_pair* pair = &job->pairs[p];
+
+        pthread_mutex_lock(&job->lock);
+        bool together = uf_find(job->parent, pair->i) == uf_find(job->parent, pair->j);
+        if (together)
+        {
+            job->together++;
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        if (together)
+        {
+            continue;
+        }
+
+        filter_count(&w->stats, FILTER_STAGES);
+        long d = corpus_compare(job->c, pair->i, pair->j, job->threshold);
+        if (d < 0)
+        {
+            job->failed = true;
+            break;
+        }
+
+        if (d <= job->threshold)
+        {
+            pthread_mutex_lock(&job->lock);
+            uf_union(job, pair->i, pair->j);
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* runs f on each worker, the calling thread on the first one */
+static void workers_run(cluster_worker* workers, int nworkers, void* (*f)(void*))
+{
+    pthread_t* tids = malloc(nworkers * sizeof(pthread_t));
+    int started = 1;
+    while (tids && started < nworkers && pthread_create(&tids[started], NULL, f, &workers[started]) == 0)
+    {
+        started++;
+    }
+
+    f(&workers[0]);
+
+    for (int t = 1; tids && t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+}
+
+
+static int bylen_cmp(const void* a, const void* b)
+{
+    const cluster_file* f1 = (const cluster_file*) a;
+    const cluster_file* f2 = (const cluster_file*) b;
+
+    if (f1->len != f2->len)
+    {
+        return f1->len < f2->len ? -1 : 1;
+    }
+
+    return f1->file < f2->file ? -1 : f1->file > f2->file;
+}
+
+
+static int pair_cmp(const void* a, const void* b)
+{
+    const cluster_pair* p1 = (const cluster_pair*) a;
+    const cluster_pair* p2 = (const cluster_pair*) b;
+
+    if (p1->bound != p2->bound)
+    {
+        return p1->bound < p2->bound ? -1 : 1;
+    }
+    if (p1->i != p2->i)
+    {
+        return p1->i < p2->i ? -1 : 1;
+    }
+
+    return p1->j < p2->j ? -1 : p1->j > p2->j;
+}
+
+
+/* prints the clusters of 2 files or more in the order of their first file */
+static int cluster_print(cluster_job* job, cluster_stats* cstats)
+{
+    const corpus* c = job->c;
+    size_t n = c->n;
+
+    /* each root gets the number of its cluster, then the clusters their place */
+    uint32_t* group = malloc((n ? n : 1) * sizeof(uint32_t));
+    size_t* start = calloc(n + 1, sizeof(size_t));
+    uint32_t* members = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (!group || !start || !members)
+    {
+        free(group);
+        free(start);
+        free(members);
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        group[i] = UINT32_MAX;
+    }
+
+    size_t ngroups = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t r = uf_find(job->parent, (uint32_t) i);
+        if (group[r] == UINT32_MAX)
+        {
+            group[r] = (uint32_t) ngroups++;
+        }
+        start[group[r] + 1]++;
+    }
+    for (size_t g = 0; g < ngroups; g++)
+    {
+        start[g + 1] += start[g];
+    }
+
+    size_t* fill = calloc(ngroups ? ngroups : 1, sizeof(size_t));
+    if (!fill)
+    {
+        free(group);
+        free(start);
+        free(members);
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t g = group[uf_find(job->parent, (uint32_t) i)];
+        members[start[g] + fill[g]++] = (uint32_t) i;
+    }
+
+    cstats->files = n;
+    cstats->clusters = 0;
+    for (size_t g = 0; g < ngroups; g++)
+    {
+        if (start[g + 1] - start[g] < 2)
+        {
+            continue;
+        }
+
+        if (cstats->clusters++ > 0)
+        {
+            printf("\n");
+        }
+        for (size_t m = start[g]; m < start[g + 1]; m++)
+        {
+            printf("%s/%s\n", c->root, c->names[members[m]]);
+        }
+    }
+
+    free(fill);
+    free(group);
+    free(start);
+    free(members);
+
+    return 0;
+}
+
+
+int cluster_run(const char* dir, long threshold, unit_t unit, int threads, filter_stats* stats,
+                cluster_stats* cstats)
+{
+    memset(stats, 0, sizeof(filter_stats));
+    memset(cstats, 0, sizeof(cluster_stats));
+    if (threshold < 0)
+    {
+        return -1;
+    }
+
+    corpus c;
+    if (corpus_load(&c, dir, unit, unit == UNIT_BYTE, threads) != 0)
+    {
+        return -1;
+    }
+    if (c.n >= UINT32_MAX)
+    {
+        corpus_free(&c);
+        return -1;
+    }
+
+    size_t n = c.n;
+    int nworkers = threads < 1 ? 1 : threads;
+
+    cluster_job job;
+    memset(&job, 0, sizeof(job));
+    job.c = &c;
+    job.threshold = threshold;
+    job.bylen = malloc((n ? n : 1) * sizeof(cluster_file));
+    job.parent = malloc((n ? n : 1) * sizeof(uint32_t));
+    job.size = malloc((n ? n : 1) * sizeof(uint32_t));
+    cluster_worker* workers = calloc(nworkers, sizeof(cluster_worker));
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, !job.bylen || !job.parent || !job.size || !workers);
+    pthread_mutex_init(&job.lock, NULL);
+
+    for (size_t i = 0; !job.failed && i < n; i++)
+    {
+        job.bylen[i] = (cluster_file) {c.tokens ? c.ntokens[i] : c.lens[i], (uint32_t) i};
+        job.parent[i] = (uint32_t) i;
+        job.size[i] = 1;
+    }
+
+    /* the pairs within reach of each other */
+    if (!job.failed)
+    {
+        qsort(job.bylen, n, sizeof(cluster_file), bylen_cmp);
+
+        for (int t = 0; t < nworkers; t++)
+        {
+            workers[t].job = &job;
+        }
+        workers_run(workers, nworkers, cluster_filter);
+    }
+
+    for (int t = 0; !job.failed && t < nworkers; t++)
+    {
+        job.npairs += workers[t].n;
+    }
+    job.pairs = job.failed ? NULL : malloc((job.npairs ? job.npairs : 1) * sizeof(cluster_pair));
+    if (!job.pairs)
+    {
+        job.failed = true;
+    }
+
+    size_t p = 0;
+    for (int t = 0; workers && t < nworkers; t++)
+    {
+        if (job.pairs)
+        {
+            memcpy(job.pairs + p, workers[t].pairs, workers[t].n * sizeof(cluster_pair));
+            p += workers[t].n;
+        }
+        free(workers[t].pairs);
+        workers[t].pairs = NULL;
+    }
+
+    /* the closest first: the clusters grow early, and the pairs
+     * of the same cluster met later are skipped */
+    if (!job.failed)
+    {
+        qsort(job.pairs, job.npairs, sizeof(cluster_pair), pair_cmp);
+        atomic_store(&job.next, 0);
+        workers_run(workers, nworkers, cluster_join);
+    }
+
+    for (int t = 0; workers && t < nworkers; t++)
+    {
+        for (int s = 0; s < FILTER_STAGES; s++)
+        {
+            stats->rejected[s] += workers[t].stats.rejected[s];
+        }
+        stats->passed += workers[t].stats.passed;
+    }
+    cstats->together = job.together;
+
+    int res = job.failed ? -1 : cluster_print(&job, cstats);
+
+    pthread_mutex_destroy(&job.lock);
+    free(job.bylen);
+    free(job.parent);
+    free(job.size);
+    free(job.pairs);
+    free(workers);
+    corpus_free(&c);
+
+    return res;
+}
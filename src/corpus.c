@@ -0,0 +1,242 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>   // snprintf
+#include <string.h>
+#include <limits.h>  // PATH_MAX
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../include/corpus.h"
+#include "../include/distance.h"
+#include "../include/util.h"
+#include "../include/walk.h"
+
+
+/* the files of the corpus, loaded by the threads in turn */
+typedef struct
+{
+    corpus* c;
+    atomic_size_t next;   /* first file not taken by a loader yet */
+    atomic_bool failed;
+} corpus_job;
+
+
+static void* corpus_loader(void* arg)
+{
+    corpus_job* job = (corpus_job*) arg;
+    corpus* c = job->c;
+    char path[PATH_MAX];
+
+    size_t i;
+    while (!job->failed && (i = atomic_fetch_add(&job->next, 1)) < c->n)
+    {
+        if ((size_t) snprintf(path, sizeof(path), "%s/%s", c->root, c->names[i]) >= sizeof(path)
+            || file_map(path, &c->bufs[i], &c->lens[i]) != 0)
+        {
+            job->failed = true;
+            break;
+        }
+
+        if (c->sigs)
+        {
+            signature_compute(c->bufs[i], c->lens[i], &c->sigs[i]);
+        }
+    }
+
+    return NULL;
+}
+
+
+int corpus_load(corpus* c, const char* dir, unit_t unit, bool signatures, int threads)
+{
+    memset(c, 0, sizeof(corpus));
+    c->unit = unit;
+    c->root = realpath(dir, NULL);
+    if (!c->root)
+    {
+        return -1;
+    }
+
+    /* the files, in name order */
+    int nthreads = threads < 1 ? 1 : threads;
+    walk_file* found = NULL;
+    size_t n = 0;
+    if (walk_collect(c->root, nthreads, &found, &n) != 0)
+    {
+        corpus_free(c);
+        return -1;
+    }
+
+    c->names = malloc((n ? n : 1) * sizeof(char*));
+    for (size_t i = 0; i < n; i++)
+    {
+        if (c->names)
+            c->names[c->n++] = found[i].name;
+        else
+            free(found[i].name);
+    }
+    free(found);
+
+    c->bufs = calloc(n ? n : 1, sizeof(char*));
+    c->lens = calloc(n ? n : 1, sizeof(size_t));
+    c->sigs = signatures ? malloc((n ? n : 1) * sizeof(signature)) : NULL;
+    if (unit != UNIT_BYTE)
+    {
+        c->tokens = calloc(1, sizeof(token_table));
+        c->ids = calloc(n ? n : 1, sizeof(uint32_t*));
+        c->ntokens = calloc(n ? n : 1, sizeof(size_t));
+    }
+    if (!c->names || !c->bufs || !c->lens || (signatures && !c->sigs)
+        || (unit != UNIT_BYTE && (!c->tokens || !c->ids || !c->ntokens
+                                  || tokens_intern(NULL, 0, unit, c->tokens) != 0)))
+    {
+        corpus_free(c);
+        return -1;
+    }
+
+    corpus_job job;
+    job.c = c;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, false);
+
+    /* the calling thread loads too */
+    pthread_t* tids = malloc(nthreads * sizeof(pthread_t));
+    int started = 1;
+    while (tids && started < nthreads && pthread_create(&tids[started], NULL, corpus_loader, &job) == 0)
+    {
+        started++;
+    }
+
+    corpus_loader(&job);
+
+    for (int t = 1; tids && t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+
+    /* one file after the other: the same files get the same ids */
+    for (size_t i = 0; !job.failed && c->tokens && i < c->n; i++)
+    {
+        if (tokens_add(c->tokens, c->bufs[i], c->lens[i], &c->ids[i], &c->ntokens[i]) != 0)
+        {
+            job.failed = true;
+        }
+    }
+
+    if (job.failed)
+    {
+        corpus_free(c);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+long corpus_bound(const corpus* c, size_t i, size_t j, long k, filter_stats* stats)
+{
+    /* in units: the tokens when counting lines or words */
+    size_t n1 = c->tokens ? c->ntokens[i] : c->lens[i];
+    size_t n2 = c->tokens ? c->ntokens[j] : c->lens[j];
+    size_t diff = n1 < n2 ? n2 - n1 : n1 - n2;
+    if (k < 0 || diff > (size_t) k)
+    {
+        filter_count(stats, FILTER_SIZE);
+        return k + 1;
+    }
+
+    long bound = (long) diff;
+    if (c->sigs)
+    {
+        long b = filter_histogram_bound(&c->sigs[i], &c->sigs[j]);
+        if (b > k)
+        {
+            filter_count(stats, FILTER_HISTOGRAM);
+            return k + 1;
+        }
+        bound = b > bound ? b : bound;
+
+        b = filter_qgram_bound(&c->sigs[i], &c->sigs[j]);
+        if (b > k)
+        {
+            filter_count(stats, FILTER_QGRAM);
+            return k + 1;
+        }
+        bound = b > bound ? b : bound;
+    }
+
+    return bound;
+}
+
+
+long corpus_compare(const corpus* c, size_t i, size_t j, long k)
+{
+    if (!c->tokens)
+    {
+        return distance_string_bounded(c->bufs[i], c->lens[i], c->bufs[j], c->lens[j], k);
+    }
+
+    return distance_ids_bounded(c->ids[i], c->ntokens[i], c->ids[j], c->ntokens[j], c->tokens->nids, k);
+}
+
+
+long corpus_distance(const corpus* c, size_t i, size_t j, long k, filter_stats* stats)
+{
+    if (corpus_bound(c, i, j, k, stats) > k)
+    {
+        return k + 1;
+    }
+
+    filter_count(stats, FILTER_STAGES);
+
+    return corpus_compare(c, i, j, k);
+}
+
+
+void corpus_free(corpus* c)
+{
+    for (size_t i = 0; i < c->n; i++)
+    {
+        if (c->bufs && c->lens)
+        {
+            file_unmap(c->bufs[i], c->lens[i]);
+        }
+        if (c->ids)
+        {
+            free(c->ids[i]);
+        }
+        free(c->names[i]);
+    }
+
+    if (c->tokens)
+    {
+        tokens_free(c->tokens);
+    }
+
+    free(c->names);
+    free(c->bufs);
+    free(c->lens);
+    free(c->sigs);
+    free(c->tokens);
+    free(c->ids);
+    free(c->ntokens);
+    free(c->root);
+    memset(c, 0, sizeof(corpus));
+}
@@ -0,0 +1,244 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/dedup.h"
+
+
+/* state of an entry */
+#define STATE_PENDING 0
+#define STATE_DONE 1
+#define STATE_ALIAS 2
+
+
+static inline uint64_t key_hash(dedup_kind kind, uint64_t a, uint64_t b)
+{
+    uint64_t h = (a * 0x9e3779b97f4a7c15ULL) ^ (b + kind) * 0xc2b2ae3d27d4eb4fULL;
+    return h ^ (h >> 31);
+}
+
+
+/* slot of the key in the stripe, or the free slot where it would go */
+static size_t stripe_find(const dedup_stripe* s, dedup_kind kind, uint64_t a, uint64_t b, uint64_t h)
+{
+    size_t mask = s->nslots - 1;
+
+    for (size_t i = (h / DEDUP_STRIPES) & mask;; i = (i + 1) & mask)
+    {
+        const dedup_entry* e = s->slots[i];
+        if (!e || (e->kind == kind && e->a == a && e->b == b))
+        {
+            return i;
+        }
+    }
+}
+
+
+/* doubles the slots of the stripe */
+static int stripe_grow(dedup_stripe* s)
+{
+    size_t nslots = s->nslots * 2;
+    dedup_entry** slots = calloc(nslots, sizeof(dedup_entry*));
+    if (!slots)
+    {
+        return -1;
+    }
+
+    dedup_entry** old = s->slots;
+    size_t nold = s->nslots;
+    s->slots = slots;
+    s->nslots = nslots;
+
+    for (size_t i = 0; i < nold; i++)
+    {
+        dedup_entry* e = old[i];
+        if (e)
+        {
+            s->slots[stripe_find(s, e->kind, e->a, e->b, key_hash(e->kind, e->a, e->b))] = e;
+        }
+    }
+    free(old);
+
+    return 0;
+}
+
+
+/* a new entry of the stripe, NULL if out of memory */
+static dedup_entry* stripe_new(dedup_stripe* s)
+{
+    if (!s->blocks || s->blocks->used == DEDUP_BLOCK)
+    {
+        dedup_block* b = malloc(sizeof(dedup_block));
+        if (!b)
+        {
+            return NULL;
+        }
+
+        b->next = s->blocks;
+        b->used = 0;
+        s->blocks = b;
+    }
+
+    return &s->blocks->entries[s->blocks->used++];
+}
+
+
+int dedup_init(dedup_table* t)
+{
+    memset(t, 0, sizeof(dedup_table));
+
+    for (int i = 0; i < DEDUP_STRIPES; i++)
+    {
+        dedup_stripe* s = &t->stripes[i];
+        s->nslots = 64;
+        s->slots = calloc(s->nslots, sizeof(dedup_entry*));
+        if (!s->slots)
+        {
+            dedup_free(t);
+            return -1;
+        }
+        pthread_mutex_init(&s->lock, NULL);
+    }
+
+    return 0;
+}
+
+
+/* the claim of an entry found, under the lock of its stripe */
+static int entry_claim(const dedup_entry* e, long* value)
+{
+    if (e->state == STATE_DONE)
+    {
+        *value = e->value;
+        return DEDUP_DONE;
+    }
+
+    return DEDUP_PENDING;
+}
+
+
+int dedup_claim(dedup_table* t, dedup_kind kind, uint64_t a, uint64_t b, dedup_entry** e, long* value)
+{
+    uint64_t h = key_hash(kind, a, b);
+    dedup_stripe* s = &t->stripes[h % DEDUP_STRIPES];
+
+    pthread_mutex_lock(&s->lock);
+
+    /* at most half full */
+    if (2 * (s->n + 1) > s->nslots && stripe_grow(s) != 0)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+
+    size_t i = stripe_find(s, kind, a, b, h);
+    dedup_entry* found = s->slots[i];
+    if (!found)
+    {
+        found = stripe_new(s);
+        if (!found)
+        {
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+
+        *found = (dedup_entry) {a, b, kind, STATE_PENDING, -1, NULL, (unsigned) (h % DEDUP_STRIPES)};
+        s->slots[i] = found;
+        s->n++;
+
+        pthread_mutex_unlock(&s->lock);
+        *e = found;
+        return DEDUP_OWNER;
+    }
+
+    int claim = entry_claim(found, value);
+    dedup_entry* alias = found->state == STATE_ALIAS ? found->alias : NULL;
+    pthread_mutex_unlock(&s->lock);
+
+    /* the contents' entry has a lock of its own */
+    if (alias)
+    {
+        dedup_stripe* as = &t->stripes[alias->stripe];
+        pthread_mutex_lock(&as->lock);
+        claim = entry_claim(alias, value);
+        pthread_mutex_unlock(&as->lock);
+        found = alias;
+    }
+
+    *e = found;
+    return claim;
+}
+
+
+void dedup_publish(dedup_table* t, dedup_entry* e, long value)
+{
+    dedup_stripe* s = &t->stripes[e->stripe];
+
+    pthread_mutex_lock(&s->lock);
+    e->value = value;
+    e->state = STATE_DONE;
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+void dedup_alias(dedup_table* t, dedup_entry* e, dedup_entry* contents)
+{
+    dedup_stripe* s = &t->stripes[e->stripe];
+
+    pthread_mutex_lock(&s->lock);
+    e->alias = contents;
+    e->state = STATE_ALIAS;
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+long dedup_value(const dedup_entry* e)
+{
+    if (e->state == STATE_ALIAS)
+    {
+        e = e->alias;
+    }
+
+    return e->state == STATE_DONE ? e->value : -1;
+}
+
+
+void dedup_free(dedup_table* t)
+{
+    for (int i = 0; i < DEDUP_STRIPES; i++)
+    {
+        dedup_stripe* s = &t->stripes[i];
+        if (!s->slots)
+        {
+            continue;
+        }
+
+        while (s->blocks)
+        {
+            dedup_block* b = s->blocks;
+            s->blocks = b->next;
+            free(b);
+        }
+
+        free(s->slots);
+        pthread_mutex_destroy(&s->lock);
+    }
+
+    memset(t, 0, sizeof(dedup_table));
+}
@@ -17,157 +17,1249 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h> // stat
-#ifdef MMAP
-    #include <fcntl.h>    // open
-    #include <unistd.h>   // close
-    #include <sys/mman.h> // MMAP
-#endif
+#include <stdint.h>   // uint64_t
+#include <stdbool.h>
+#include <sys/stat.h> // fstat
+#include <fcntl.h>    // open
+#include <unistd.h>   // close, sysconf
+#include <sys/mman.h> // mmap
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>   // LONG_MAX
 
 #include "../include/util.h" // min, minmin
+#include "../include/distance_simd.h"
+#include "../include/distcache.h"
+
+
+/* bits per Myers block */
+#define WORD_BITS 64
+
+/* pattern equality masks, one row of blocks per byte value */
+#define ALPHABET_SIZE 256
+
+/* Long patterns are processed a stripe of blocks at a time, so that the
+ * masks of a stripe (256 * 8 bytes per block) stay in cache. The text is
+ * streamed through each stripe a window at a time. */
+#define STRIPE_BLOCKS 1024
+#define WINDOW_BYTES  ((size_t) 16 << 20)
+
+/* smallest stripes and windows when splitting among threads */
+#define STRIPE_MIN_BLOCKS 64
+#define WINDOW_MIN_BYTES  ((size_t) 4096)
+
+typedef uint64_t word_t;
+
+/* no threshold on distance_file_k */
+#define UNBOUNDED (-1)
+
+
+/* below this many blocks the scalar loop is as fast as the wavefront */
+#define WAVEFRONT_MIN_BLOCKS 4
+
+/* wavefront kernel for this cpu, NULL if none */
+static myers_kernel_f myers_wavefront = NULL;
+
+
+/* picks the widest wavefront kernel the cpu supports, once at startup */
+__attribute__((constructor))
+static void distance_select_kernel(void)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        myers_wavefront = distance_myers_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        myers_wavefront = distance_myers_avx2;
+    }
+    else if (__builtin_cpu_supports("sse4.1"))
+    {
+        myers_wavefront = distance_myers_sse41;
+    }
+#endif
+}
+
+
+/* Contents to stream through the kernels: a buffer already in
+ * memory, or a file that is mapped a window at a time */
+typedef struct
+{
+    const char* buf;
+    int fd;
+    size_t len;
+} source;
+
+
+/* Returns a pointer to len bytes at off of src, NULL on failure.
+ * *map and *maplen receive what source_unmap has to release */
+static const char* source_map(const source* src, size_t off, size_t len, void** map, size_t* maplen)
+{
+    *map = NULL;
+    *maplen = 0;
+
+    if (src->buf)
+    {
+        return src->buf + off;
+    }
+
+    /* mmap offsets must be page aligned */
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = off - off % page;
+
+    void* p = mmap(NULL, len + (off - start), PROT_READ, MAP_PRIVATE, src->fd, (off_t) start);
+    if (p == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    *map = p;
+    *maplen = len + (off - start);
+    madvise(p, *maplen, MADV_SEQUENTIAL);
+
+    return (const char*) p + (off - start);
+}
+
+
+static void source_unmap(void* map, size_t maplen)
+{
+    if (map)
+    {
+        munmap(map, maplen);
+    }
+}
+
+
+/* Advances one 64-row block of the Myers/Hyyro bit-vector algorithm by one
+ * text column. pv/mv hold the positive/negative vertical deltas of the
+ * block, eq the positions matching the current text char, hin the
+ * horizontal delta entering from the block above.
+ * Returns the horizontal delta at row hbit of the block. */
+static inline int myers_advance_block(word_t* pv, word_t* mv, word_t eq, int hin, word_t hbit)
+{
+    word_t Pv = *pv;
+    word_t Mv = *mv;
+    word_t hinneg = (word_t) (hin < 0);
+    word_t hinpos = (word_t) (hin > 0);
+
+    word_t Xv = eq | Mv;
+    eq |= hinneg;
+    word_t Xh = (((eq & Pv) + Pv) ^ Pv) | eq;
+
+    word_t Ph = Mv | ~(Xh | Pv);
+    word_t Mh = Pv & Xh;
+
+    int hout = (int) ((Ph & hbit) != 0) - (int) ((Mh & hbit) != 0);
+
+    Ph = (Ph << 1) | hinpos;
+    Mh = (Mh << 1) | hinneg;
+
+    *pv = Mh | ~(Xv | Ph);
+    *mv = Ph & Xv;
+
+    return hout;
+}
+
+
+/* Wagner-Fischer, two rows. Kept as fallback when the Myers bitmasks
+ * can't be allocated. Generated for each width of symbols and cells:
+ * cells hold distances up to the longer length, so the narrowest cells
+ * that can hold it keep the rows small */
+#define DEFINE_DISTANCE_WF(NAME, SYM_T, CELL_T)                                 \
+static long NAME(const SYM_T* str1, size_t len1, const SYM_T* str2, size_t len2) \
+{                                                                               \
+    /* allocate prev and curr rows */                                           \
+    CELL_T* prev = malloc((len2 + 1) * sizeof(CELL_T));                         \
+    CELL_T* curr = malloc((len2 + 1) * sizeof(CELL_T));                         \
+    if (!curr || !prev)                                                         \
+    {                                                                           \
+        free(curr);                                                             \
+        free(prev);                                                             \
+        return -1;                                                              \
+    }                                                                           \
+                                                                                \
+    for (size_t j = 0; j <= len2; j++)                                          \
+    {                                                                           \
+        prev[j] = (CELL_T) j;                                                   \
+    }                                                                           \
+                                                                                \
+    for (size_t i = 1; i <= len1; i++)                                          \
+    {                                                                           \
+        curr[0] = (CELL_T) i;                                                   \
+                                                                                \
+        for (size_t j = 1; j <= len2; j++)                                      \
+        {                                                                       \
+            /* keep best cost */                                                \
+            if (str1[i - 1] != str2[j - 1])                                     \
+            {                                                                   \
+                CELL_T k = prev[j - 1];                                         \
+                if (curr[j - 1] < k)                                            \
+                    k = curr[j - 1];                                            \
+                if (prev[j] < k)                                                \
+                    k = prev[j];                                                \
+                curr[j] = (CELL_T) (k + 1);                                     \
+            }                                                                   \
+            else                                                                \
+            {                                                                   \
+                curr[j] = prev[j - 1];                                          \
+            }                                                                   \
+        }                                                                       \
+                                                                                \
+        /* swap rows */                                                         \
+        CELL_T* tmp = prev;                                                     \
+        prev = curr;                                                            \
+        curr = tmp;                                                             \
+    }                                                                           \
+                                                                                \
+    long distance = (long) prev[len2];                                          \
+                                                                                \
+    free(curr);                                                                 \
+    free(prev);                                                                 \
+                                                                                \
+    return distance;                                                            \
+}
+
+DEFINE_DISTANCE_WF(distance_wf_u8_c16,  char,     uint16_t)
+DEFINE_DISTANCE_WF(distance_wf_u8_c32,  char,     uint32_t)
+DEFINE_DISTANCE_WF(distance_wf_u8_c64,  char,     uint64_t)
+DEFINE_DISTANCE_WF(distance_wf_u32_c16, uint32_t, uint16_t)
+DEFINE_DISTANCE_WF(distance_wf_u32_c32, uint32_t, uint32_t)
+DEFINE_DISTANCE_WF(distance_wf_u32_c64, uint32_t, uint64_t)
+
+
+/* the narrowest cells holding distances up to len */
+#define CELLS_FIT(len, CELL_T) ((len) < (size_t) (CELL_T) -1)
+
+
+static long distance_string_wf(const char* str1, size_t len1, const char* str2, size_t len2)
+{
+    size_t len = len1 > len2 ? len1 : len2;
+
+    if (CELLS_FIT(len, uint16_t))
+        return distance_wf_u8_c16(str1, len1, str2, len2);
+    if (CELLS_FIT(len, uint32_t))
+        return distance_wf_u8_c32(str1, len1, str2, len2);
+
+    return distance_wf_u8_c64(str1, len1, str2, len2);
+}
+
+
+static long distance_ids_wf(const uint32_t* ids1, size_t len1, const uint32_t* ids2, size_t len2)
+{
+    size_t len = len1 > len2 ? len1 : len2;
+
+    if (CELLS_FIT(len, uint16_t))
+        return distance_wf_u32_c16(ids1, len1, ids2, len2);
+    if (CELLS_FIT(len, uint32_t))
+        return distance_wf_u32_c32(ids1, len1, ids2, len2);
+
+    return distance_wf_u32_c64(ids1, len1, ids2, len2);
+}
+
+
+/* Myers/Hyyro bit-parallel distance, pattern fits one word */
+static long distance_string_myers64(const char* pat, size_t m, const char* txt, size_t n)
+{
+    word_t peq[ALPHABET_SIZE] = {0};
+
+    for (size_t i = 0; i < m; i++)
+    {
+        peq[(unsigned char) pat[i]] |= (word_t) 1 << i;
+    }
+
+    word_t pv = ~(word_t) 0;
+    word_t mv = 0;
+    word_t hbit = (word_t) 1 << (m - 1);
+    long score = (long) m;
+
+    for (size_t j = 0; j < n; j++)
+    {
+        score += myers_advance_block(&pv, &mv, peq[(unsigned char) txt[j]], 1, hbit);
+    }
+
+    return score;
+}
+
+
+/* Advances the blocks of a stripe over n text columns, carrying the
+ * horizontal delta from one block to the next. hb[j] enters the top of
+ * the stripe at column j and is replaced by the delta leaving its last
+ * block at row lastbit. Returns the sum of the deltas leaving. */
+static long myers_stripe_scalar(const uint64_t* peq, size_t nblocks, uint64_t lastbit,
+                                uint64_t* pv, uint64_t* mv, const char* txt, size_t n, int8_t* hb)
+{
+    word_t highbit = (word_t) 1 << (WORD_BITS - 1);
+    size_t last = nblocks - 1;
+    long sum = 0;
+
+    for (size_t j = 0; j < n; j++)
+    {
+        const word_t* eq = peq + (unsigned char) txt[j] * nblocks;
+
+        int h = hb[j];
+        for (size_t b = 0; b < last; b++)
+        {
+            h = myers_advance_block(&pv[b], &mv[b], eq[b], h, highbit);
+        }
+        h = myers_advance_block(&pv[last], &mv[last], eq[last], h, lastbit);
+
+        hb[j] = (int8_t) h;
+        sum += h;
+    }
+
+    return sum;
+}
+
+
+/* deltas at the bottom of a stripe, 2 bits per text column */
+static void boundary_unpack(const word_t* bp, const word_t* bm, size_t off, int8_t* hb, size_t n)
+{
+    for (size_t j = 0; j < n; j++)
+    {
+        size_t c = off + j;
+        hb[j] = (int8_t) ((bp[c / WORD_BITS] >> (c % WORD_BITS)) & 1)
+              - (int8_t) ((bm[c / WORD_BITS] >> (c % WORD_BITS)) & 1);
+    }
+}
+
+
+static void boundary_pack(word_t* bp, word_t* bm, size_t off, const int8_t* hb, size_t n)
+{
+    for (size_t j = 0; j < n; j++)
+    {
+        size_t c = off + j;
+        word_t bit = (word_t) 1 << (c % WORD_BITS);
+        bp[c / WORD_BITS] = hb[j] > 0 ? bp[c / WORD_BITS] | bit : bp[c / WORD_BITS] & ~bit;
+        bm[c / WORD_BITS] = hb[j] < 0 ? bm[c / WORD_BITS] | bit : bm[c / WORD_BITS] & ~bit;
+    }
+}
+
+
+/* Work shared by the threads going through the stripes of one pattern.
+ * Stripe s can advance over a window of text once stripe s - 1 has left
+ * its deltas there, so with several threads the stripes form a pipeline:
+ * thread t takes stripes t, t + nthreads, ... in order. */
+typedef struct
+{
+    const source* pat;
+    const source* txt;
+    size_t nblocks;
+    size_t sblocks;  /* blocks per stripe */
+    size_t nstripes;
+    size_t wlen;     /* columns per window, a multiple of 64 */
+    int nthreads;
+    word_t* bp;      /* deltas at the bottom of the stripes, 2 bits per column */
+    word_t* bm;
+    long* col;       /* vertical deltas of the last column, if wanted */
+    long score;      /* sum of the deltas leaving the last stripe */
+    atomic_bool failed;
+    size_t* done;    /* columns each stripe is through */
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+} myers_job;
+
+
+typedef struct
+{
+    myers_job* job;
+    int index;
+} myers_thread;
+
+
+/* publishes that stripe s is through column c */
+static void myers_stripe_done(myers_job* job, size_t s, size_t c)
+{
+    pthread_mutex_lock(&job->lock);
+    job->done[s] = c;
+    pthread_cond_broadcast(&job->progress);
+    pthread_mutex_unlock(&job->lock);
+}
+
+
+/* waits for stripe s to be through column c */
+static void myers_stripe_wait(myers_job* job, size_t s, size_t c)
+{
+    pthread_mutex_lock(&job->lock);
+    while (job->done[s] < c)
+    {
+        pthread_cond_wait(&job->progress, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+
+/* Advances stripe s over the whole text, a window at a time */
+static void myers_run_stripe(myers_job* job, size_t s, word_t* peq, word_t* pv, word_t* mv, int8_t* hb)
+{
+    size_t m = job->pat->len;
+    size_t n = job->txt->len;
+    size_t b0 = s * job->sblocks;
+    size_t nb = job->nblocks - b0 < job->sblocks ? job->nblocks - b0 : job->sblocks;
+    size_t r0 = b0 * WORD_BITS;
+    size_t rows = m - r0 < nb * WORD_BITS ? m - r0 : nb * WORD_BITS;
+    bool first_stripe = s == 0;
+    bool last_stripe = s == job->nstripes - 1;
+
+    /* masks of the stripe's rows */
+    void* map;
+    size_t maplen;
+    const char* p = job->failed ? NULL : source_map(job->pat, r0, rows, &map, &maplen);
+    if (!p)
+    {
+        job->failed = true;
+        myers_stripe_done(job, s, n);
+        return;
+    }
+
+    memset(peq, 0, ALPHABET_SIZE * nb * sizeof(word_t));
+    for (size_t i = 0; i < rows; i++)
+    {
+        peq[(unsigned char) p[i] * nb + i / WORD_BITS] |= (word_t) 1 << (i % WORD_BITS);
+    }
+    source_unmap(map, maplen);
+
+    /* column 0: D[i][0] = i, every vertical delta is +1 */
+    for (size_t b = 0; b < nb; b++)
+    {
+        pv[b] = ~(word_t) 0;
+        mv[b] = 0;
+    }
+
+    word_t lastbit = last_stripe ? (word_t) 1 << ((m - 1) % WORD_BITS)
+                                 : (word_t) 1 << (WORD_BITS - 1);
+
+    myers_kernel_f kernel = (myers_wavefront && nb >= WAVEFRONT_MIN_BLOCKS) ? myers_wavefront
+                                                                           : myers_stripe_scalar;
+
+    long score = 0;
+
+    for (size_t w0 = 0; w0 < n; w0 += job->wlen)
+    {
+        size_t len = n - w0 < job->wlen ? n - w0 : job->wlen;
+
+        if (!first_stripe)
+        {
+            myers_stripe_wait(job, s - 1, w0 + len);
+        }
+
+        const char* t = job->failed ? NULL : source_map(job->txt, w0, len, &map, &maplen);
+        if (!t)
+        {
+            job->failed = true;
+            myers_stripe_done(job, s, n);
+            return;
+        }
+
+        /* row 0: D[0][j] = j, delta entering the first stripe is +1 */
+        if (first_stripe)
+        {
+            memset(hb, 1, len);
+        }
+        else
+        {
+            boundary_unpack(job->bp, job->bm, w0, hb, len);
+        }
+
+        long sum = kernel(peq, nb, lastbit, pv, mv, t, len, hb);
+        source_unmap(map, maplen);
+
+        /* the last stripe reports the deltas at row m */
+        if (last_stripe)
+        {
+            score += sum;
+        }
+        else
+        {
+            boundary_pack(job->bp, job->bm, w0, hb, len);
+        }
+
+        myers_stripe_done(job, s, w0 + len);
+    }
+
+    if (last_stripe)
+    {
+        job->score = score;
+    }
+
+    /* vertical deltas of the stripe's rows at the last column */
+    for (size_t i = 0; job->col && i < rows; i++)
+    {
+        word_t bit = (word_t) 1 << (i % WORD_BITS);
+        job->col[r0 + i + 1] = ((pv[i / WORD_BITS] & bit) != 0) - ((mv[i / WORD_BITS] & bit) != 0);
+    }
+}
+
+
+static void* myers_worker(void* arg)
+{
+    myers_thread* self = (myers_thread*) arg;
+    myers_job* job = self->job;
 
+    word_t* peq = malloc(ALPHABET_SIZE * job->sblocks * sizeof(word_t));
+    word_t* pv  = malloc(job->sblocks * sizeof(word_t));
+    word_t* mv  = malloc(job->sblocks * sizeof(word_t));
+    int8_t* hb  = malloc(job->wlen);
 
-int distance_string(const char* str1, size_t len1, const char* str2, size_t len2)
+    if (!peq || !pv || !mv || !hb)
+    {
+        job->failed = true;
+    }
+
+    /* a failed stripe still lets the next ones through */
+    for (size_t s = (size_t) self->index; s < job->nstripes; s += (size_t) job->nthreads)
+    {
+        if (job->failed)
+        {
+            myers_stripe_done(job, s, job->txt->len);
+            continue;
+        }
+        myers_run_stripe(job, s, peq, pv, mv, hb);
+    }
+
+    free(peq);
+    free(pv);
+    free(mv);
+    free(hb);
+
+    return NULL;
+}
+
+
+/* Myers/Hyyro bit-parallel distance of pattern pat (the shorter one) and
+ * text txt. The pattern is split in stripes of 64-row blocks, the text
+ * is streamed through each stripe in windows. Between two stripes only
+ * the horizontal deltas at the bottom of the first one are kept.
+ * If col is not NULL it receives the last column, col[i] being the
+ * distance of the first i bytes of the pattern and the whole text.
+ * Up to threads threads go through the stripes. */
+static long distance_source_myers(const source* pat, const source* txt, long* col, int threads)
+{
+    size_t m = pat->len;
+    size_t n = txt->len;
+
+    myers_job job = {.pat = pat, .txt = txt, .col = col};
+
+    job.nblocks = (m + WORD_BITS - 1) / WORD_BITS;
+    job.sblocks = job.nblocks < STRIPE_BLOCKS ? job.nblocks : STRIPE_BLOCKS;
+    job.wlen = n < WINDOW_BYTES ? n : WINDOW_BYTES;
+
+    /* with more threads the stripes get thinner and the windows
+     * shorter, so that every thread has a stripe and the pipeline
+     * fills up quickly */
+    if (threads > 1)
+    {
+        size_t sblocks = (job.nblocks + threads - 1) / threads;
+        job.sblocks = sblocks < STRIPE_MIN_BLOCKS ? STRIPE_MIN_BLOCKS : sblocks;
+        job.sblocks = job.sblocks < STRIPE_BLOCKS ? job.sblocks : STRIPE_BLOCKS;
+        job.sblocks = job.sblocks < job.nblocks ? job.sblocks : job.nblocks;
+
+        size_t wlen = (n / (4 * (size_t) threads) + WORD_BITS - 1) / WORD_BITS * WORD_BITS;
+        wlen = wlen < WINDOW_MIN_BYTES ? WINDOW_MIN_BYTES : wlen;
+        job.wlen = wlen < job.wlen ? wlen : job.wlen;
+    }
+
+    job.nstripes = (job.nblocks + job.sblocks - 1) / job.sblocks;
+    job.nthreads = threads < 1 ? 1 : threads;
+    if ((size_t) job.nthreads > job.nstripes)
+    {
+        job.nthreads = (int) job.nstripes;
+    }
+
+    /* only needed between stripes */
+    if (job.nstripes > 1)
+    {
+        job.bp = malloc((n / WORD_BITS + 1) * sizeof(word_t));
+        job.bm = malloc((n / WORD_BITS + 1) * sizeof(word_t));
+    }
+    job.done = calloc(job.nstripes, sizeof(size_t));
+
+    myers_thread* self = malloc(job.nthreads * sizeof(myers_thread));
+    pthread_t* tids = malloc(job.nthreads * sizeof(pthread_t));
+
+    if (!job.done || !self || !tids || (job.nstripes > 1 && (!job.bp || !job.bm)))
+    {
+        free(job.bp);
+        free(job.bm);
+        free(job.done);
+        free(self);
+        free(tids);
+        return -1;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.progress, NULL);
+
+    /* the calling thread is worker 0; a worker that can't be
+     * started has its stripes taken by the ones before it */
+    int started = 1;
+    for (int t = 1; t < job.nthreads; t++)
+    {
+        self[t] = (myers_thread) {&job, t};
+        if (pthread_create(&tids[t], NULL, myers_worker, &self[t]) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+
+    if (started < job.nthreads)
+    {
+        /* stripes are dealt by thread count: let the started ones
+         * run dry and start over with as many threads as could run */
+        job.failed = true;
+        for (size_t s = 0; s < job.nstripes; s++)
+        {
+            if (s % job.nthreads >= (size_t) started)
+            {
+                myers_stripe_done(&job, s, n);
+            }
+        }
+    }
+
+    self[0] = (myers_thread) {&job, 0};
+    myers_worker(&self[0]);
+
+    for (int t = 1; t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.progress);
+
+    free(job.bp);
+    free(job.bm);
+    free(job.done);
+    free(self);
+    free(tids);
+
+    if (job.failed)
+    {
+        return started < job.nthreads ? distance_source_myers(pat, txt, col, started) : -1;
+    }
+
+    if (col)
+    {
+        col[0] = (long) n;
+        for (size_t i = 1; i <= m; i++)
+        {
+            col[i] += col[i - 1];
+        }
+    }
+
+    return (long) m + job.score;
+}
+
+
+/* Enters block b of the band ring: builds the masks of its rows and
+ * takes all its vertical deltas at +1 below the bottom of block b - 1 */
+static void band_enter_block(const char* pat, size_t m, size_t b, size_t ring,
+                             word_t* peq, word_t* pv, word_t* mv, long* score)
+{
+    size_t s = b % ring;
+    word_t* eq = peq + s * ALPHABET_SIZE;
+    size_t rows = m - b * WORD_BITS < WORD_BITS ? m - b * WORD_BITS : WORD_BITS;
+
+    memset(eq, 0, ALPHABET_SIZE * sizeof(word_t));
+    for (size_t i = 0; i < rows; i++)
+    {
+        eq[(unsigned char) pat[b * WORD_BITS + i]] |= (word_t) 1 << i;
+    }
+
+    pv[s] = ~(word_t) 0;
+    mv[s] = 0;
+    score[s] = (b == 0 ? 0 : score[(b - 1) % ring]) + (long) rows;
+}
+
+
+/* Myers/Hyyro restricted to the Ukkonen band. With d = n - m, a path
+ * reaching (m, n) within k only visits the diagonals j - i in
+ * [-(k - d) / 2, (k + d) / 2], so each column only advances the blocks
+ * overlapping that band. Rows above the first computed block and a block
+ * entering at the bottom are taken at their largest possible value: every
+ * computed cell is then >= its true value, and exact for the cells on a
+ * path within k.
+ * The band spans at most k / 64 + 3 blocks, their masks and state are
+ * kept in a ring and the masks of a block are built when it enters. */
+static long distance_string_myers_band(const char* pat, size_t m, const char* txt, size_t n, long k)
+{
+    size_t nblocks = (m + WORD_BITS - 1) / WORD_BITS;
+    size_t ring = (size_t) k / WORD_BITS + 4;
+    if (ring > nblocks)
+    {
+        ring = nblocks;
+    }
+
+    word_t* peq   = malloc(ALPHABET_SIZE * ring * sizeof(word_t));
+    word_t* pv    = malloc(ring * sizeof(word_t));
+    word_t* mv    = malloc(ring * sizeof(word_t));
+    long*   score = malloc(ring * sizeof(long));
+    if (!peq || !pv || !mv || !score)
+    {
+        free(peq);
+        free(pv);
+        free(mv);
+        free(score);
+        return -1;
+    }
+
+    long below = (k + (long) (n - m)) / 2; /* band extends below row j */
+    long above = (k - (long) (n - m)) / 2; /* and above it */
+
+    word_t highbit = (word_t) 1 << (WORD_BITS - 1);
+    word_t lastbit = (word_t) 1 << ((m - 1) % WORD_BITS);
+    size_t final = nblocks - 1;
+
+    /* score[b % ring] is the value at the bottom row of block b (row m
+     * for the final one), first/last the blocks currently advanced */
+    size_t first = 0;
+    size_t last = 0;
+
+    long distance = k + 1;
+
+    band_enter_block(pat, m, 0, ring, peq, pv, mv, score);
+
+    for (size_t j = 1; j <= n; j++)
+    {
+        /* extend down to the block holding row j + above */
+        long hirow = (long) j + above;
+        size_t want = (size_t) ((hirow < (long) m ? hirow : (long) m) - 1) / WORD_BITS;
+        while (last < want)
+        {
+            band_enter_block(pat, m, ++last, ring, peq, pv, mv, score);
+        }
+
+        unsigned char c = (unsigned char) txt[j - 1];
+
+        int h = 1;
+        bool alive = (long) j <= k; /* row 0 holds j */
+        for (size_t b = first; b <= last; b++)
+        {
+            size_t s = b % ring;
+            h = myers_advance_block(&pv[s], &mv[s], peq[s * ALPHABET_SIZE + c], h, b == final ? lastbit : highbit);
+            score[s] += h;
+
+            /* a block's cells are >= its bottom value - 63 */
+            if (score[s] < k + WORD_BITS)
+            {
+                alive = true;
+            }
+        }
+
+        /* every cell of the column is past k */
+        if (!alive)
+        {
+            goto done;
+        }
+
+        /* drop blocks that are above the band of the next column
+         * or have no cell left within k */
+        long lorow = (long) j + 1 - below;
+        while (first < last && ((long) ((first + 1) * WORD_BITS) < lorow || score[first % ring] >= k + WORD_BITS))
+        {
+            first++;
+        }
+    }
+
+    if (last == final && score[final % ring] <= k)
+    {
+        distance = score[final % ring];
+    }
+
+done:
+    free(peq);
+    free(pv);
+    free(mv);
+    free(score);
+
+    return distance;
+}
+
+
+/* distance of two sources, any of them possibly empty */
+static long distance_source(const source* s1, const source* s2)
+{
+    if (s1->len < s2->len)
+    {
+        return distance_source(s2, s1);
+    }
+
+    if (s2->len == 0)
+    {
+        return (long) s1->len;
+    }
+
+    /* the shorter one is the pattern, the longer one is streamed through */
+    long distance = distance_source_myers(s2, s1, NULL, 1);
+    if (distance < 0 && s1->buf && s2->buf)
+    {
+        /* no memory for the bitmasks */
+        distance = distance_string_wf(s1->buf, s1->len, s2->buf, s2->len);
+    }
+
+    return distance;
+}
+
+
+long distance_string(const char* str1, size_t len1, const char* str2, size_t len2)
 {
     if (len1 == 0)
-        return len2;
+        return (long) len2;
 
     if (len2 == 0)
-        return len1;
+        return (long) len1;
 
     if (len1 < len2)
     {
         return distance_string(str2, len2, str1, len1);
     }
 
-    int distance = 0;
+    /* the shorter string is the pattern, its bitmasks
+     * cover len2 rows; the longer one is streamed through */
+    if (len2 <= WORD_BITS)
+    {
+        return distance_string_myers64(str2, len2, str1, len1);
+    }
+
+    source s1 = {str1, -1, len1};
+    source s2 = {str2, -1, len2};
+
+    return distance_source(&s1, &s2);
+}
+
+
+int distance_prefixes(const char* str1, size_t len1, const char* str2, size_t len2, long* col, int threads)
+{
+    if (len1 == 0 || len2 == 0)
+    {
+        for (size_t i = 0; i <= len1; i++)
+        {
+            col[i] = (long) (i + len2);
+        }
+        return 0;
+    }
+
+    /* str1 is the pattern whatever the lengths, its rows are the ones wanted */
+    source pat = {str1, -1, len1};
+    source txt = {str2, -1, len2};
+
+    return distance_source_myers(&pat, &txt, col, threads) < 0 ? -1 : 0;
+}
+
+
+long distance_string_bounded(const char* str1, size_t len1, const char* str2, size_t len2, long k)
+{
+    if (len1 < len2)
+    {
+        return distance_string_bounded(str2, len2, str1, len1, k);
+    }
 
-    /* allocate prev and curr rows */
-    int* prev = calloc((len2 + 1), sizeof(int));
-    int* curr = calloc((len2 + 1), sizeof(int));
-    if (!curr || !prev)
+    /* distance is at least the difference in length */
+    if (k < 0 || len1 - len2 > (size_t) k)
+    {
+        return k + 1;
+    }
+
+    /* band covers the whole matrix */
+    if (len2 == 0 || (size_t) k >= len1)
+    {
+        long distance = distance_string(str1, len1, str2, len2);
+        return distance > k ? k + 1 : distance;
+    }
+
+    long distance = distance_string_myers_band(str2, len2, str1, len1, k);
+    if (distance < 0)
+    {
+        /* no memory for the bitmasks */
+        distance = distance_string_wf(str1, len1, str2, len2);
+        return distance > k ? k + 1 : distance;
+    }
+
+    return distance;
+}
+
+
+/* Myers/Hyyro distance of sequences of symbols wider than a byte. The
+ * pattern is cut in stripes of whole blocks holding at most 255 distinct
+ * symbols: within a stripe they get one byte codes, 0 standing for every
+ * symbol not in the stripe, and the text translated to these codes goes
+ * through the byte kernels. The deltas leaving a stripe enter the next. */
+static long distance_ids_myers(const uint32_t* pat, size_t m, const uint32_t* txt, size_t n, uint32_t nsyms)
+{
+    size_t nblocks = (m + WORD_BITS - 1) / WORD_BITS;
+    size_t sblocks = nblocks < STRIPE_BLOCKS ? nblocks : STRIPE_BLOCKS;
+
+    unsigned char* code = calloc(nsyms, 1);
+    char* t = malloc(n);
+    int8_t* hb = malloc(n);
+    word_t* peq = malloc(ALPHABET_SIZE * sblocks * sizeof(word_t));
+    word_t* pv = malloc(sblocks * sizeof(word_t));
+    word_t* mv = malloc(sblocks * sizeof(word_t));
+
+    if (!code || !t || !hb || !peq || !pv || !mv)
+    {
+        free(code);
+        free(t);
+        free(hb);
+        free(peq);
+        free(pv);
+        free(mv);
         return -1;
+    }
 
-    int* tmp = NULL;
+    /* row 0: D[0][j] = j */
+    memset(hb, 1, n);
+    long score = 0;
 
-    for (int i = 0; i <= len2; i++)
+    for (size_t b0 = 0; b0 < nblocks;)
     {
-        prev[i] = i;
+        size_t r0 = b0 * WORD_BITS;
+
+        /* take blocks while their symbols fit in the codes */
+        unsigned ncodes = 0;
+        size_t nb = 0;
+        while (b0 + nb < nblocks && nb < sblocks)
+        {
+            size_t r = r0 + nb * WORD_BITS;
+            size_t rend = m - r < WORD_BITS ? m : r + WORD_BITS;
+            uint32_t fresh[WORD_BITS];
+            unsigned nfresh = 0;
+
+            for (size_t i = r; i < rend; i++)
+            {
+                if (code[pat[i]] == 0)
+                {
+                    fresh[nfresh++] = pat[i];
+                    code[pat[i]] = (unsigned char) (ncodes + nfresh < 256 ? ncodes + nfresh : 255);
+                }
+            }
+
+            if (ncodes + nfresh > 255)
+            {
+                for (unsigned f = 0; f < nfresh; f++)
+                {
+                    code[fresh[f]] = 0;
+                }
+                break;
+            }
+
+            ncodes += nfresh;
+            nb++;
+        }
+
+        size_t rows = m - r0 < nb * WORD_BITS ? m - r0 : nb * WORD_BITS;
+        bool last_stripe = b0 + nb == nblocks;
+
+        memset(peq, 0, ALPHABET_SIZE * nb * sizeof(word_t));
+        for (size_t i = 0; i < rows; i++)
+        {
+            peq[code[pat[r0 + i]] * nb + i / WORD_BITS] |= (word_t) 1 << (i % WORD_BITS);
+        }
+        for (size_t j = 0; j < n; j++)
+        {
+            t[j] = (char) code[txt[j]];
+        }
+
+        /* column 0: D[i][0] = i */
+        for (size_t b = 0; b < nb; b++)
+        {
+            pv[b] = ~(word_t) 0;
+            mv[b] = 0;
+        }
+
+        word_t lastbit = last_stripe ? (word_t) 1 << ((m - 1) % WORD_BITS)
+                                     : (word_t) 1 << (WORD_BITS - 1);
+
+        myers_kernel_f kernel = (myers_wavefront && nb >= WAVEFRONT_MIN_BLOCKS) ? myers_wavefront
+                                                                               : myers_stripe_scalar;
+        long sum = kernel(peq, nb, lastbit, pv, mv, t, n, hb);
+        if (last_stripe)
+        {
+            score = (long) m + sum;
+        }
+
+        for (size_t i = 0; i < rows; i++)
+        {
+            code[pat[r0 + i]] = 0;
+        }
+        b0 += nb;
+    }
+
+    free(code);
+    free(t);
+    free(hb);
+    free(peq);
+    free(pv);
+    free(mv);
+
+    return score;
+}
+
+
+long distance_ids(const uint32_t* ids1, size_t len1, const uint32_t* ids2, size_t len2, uint32_t nsyms)
+{
+    if (len1 < len2)
+    {
+        return distance_ids(ids2, len2, ids1, len1, nsyms);
     }
 
-    for (int i = 1; i <= len1; i++)
+    if (len2 == 0)
     {
-        curr[0] = i;
+        return (long) len1;
+    }
 
-        for (int j = 1; j <= len2; j++)
+    /* the shorter sequence is the pattern */
+    long distance = distance_ids_myers(ids2, len2, ids1, len1, nsyms);
+    if (distance < 0)
+    {
+        /* no memory for the bitmasks */
+        distance = distance_ids_wf(ids1, len1, ids2, len2);
+    }
+
+    return distance;
+}
+
+
+/* The Ukkonen band of sequences of symbols, cell by cell: with d = n - m
+ * a path reaching (m, n) within k only visits the diagonals j - i in
+ * [-(k - d) / 2, (k + d) / 2]. Row i holds the cells of those diagonals,
+ * the ones off the band or past k taken at k + 1: every cell is then >= its
+ * true value, and exact for the cells on a path within k. The rows stop
+ * as soon as one has no cell within k, no path goes around it. */
+static long distance_ids_band(const uint32_t* pat, size_t m, const uint32_t* txt, size_t n, long k)
+{
+    long above = (k - (long) (n - m)) / 2; /* diagonals below the main one */
+    long below = (k + (long) (n - m)) / 2; /* and above it */
+    size_t width = (size_t) (above + below) + 1;
+
+    /* cell (i, j) at j - i + above + 1, a cell past k at both ends */
+    long* prev = malloc((width + 2) * sizeof(long));
+    long* cur = malloc((width + 2) * sizeof(long));
+    if (!prev || !cur)
+    {
+        free(prev);
+        free(cur);
+        return -1;
+    }
+
+    /* row 0: D[0][j] = j */
+    prev[0] = k + 1;
+    prev[width + 1] = k + 1;
+    for (size_t c = 0; c < width; c++)
+    {
+        long j = (long) c - above;
+        prev[c + 1] = j < 0 || j > k ? k + 1 : j;
+    }
+    cur[0] = k + 1;
+    cur[width + 1] = k + 1;
+
+    long distance = k + 1;
+
+    for (size_t i = 1; i <= m; i++)
+    {
+        long least = k + 1;
+        for (size_t c = 0; c < width; c++)
         {
-            /* Wagner-Fischer, keeping best cost */
-            if (str1[i - 1] != str2[j - 1])
+            long j = (long) i - above + (long) c;
+            long v;
+            if (j < 0 || j > (long) n)
+            {
+                v = k + 1;
+            }
+            else if (j == 0)
             {
-                int k = minmin(curr[j - 1],
-                               prev[j - 1],
-                                  prev[j]);
-                curr[j] = k + 1;
+                /* column 0: D[i][0] = i */
+                v = (long) i;
             }
             else
             {
-                curr[j] = prev[j - 1];
+                v = prev[c + 1] + (pat[i - 1] != txt[j - 1]);
+                v = prev[c + 2] + 1 < v ? prev[c + 2] + 1 : v;
+                v = cur[c] + 1 < v ? cur[c] + 1 : v;
             }
+
+            cur[c + 1] = v > k ? k + 1 : v;
+            least = cur[c + 1] < least ? cur[c + 1] : least;
         }
 
-        /* swap arrays */
-        tmp = prev;
-        prev = curr;
-        curr = tmp;
+        /* every cell of the row is past k */
+        if (least > k)
+        {
+            goto done;
+        }
 
-        /* reset curr */
-        memset((void*) curr, 0, sizeof(int) * (len2 + 1));
+        long* t = prev;
+        prev = cur;
+        cur = t;
     }
 
-    distance = prev[len2];
+    /* (m, n) is on diagonal d */
+    distance = prev[(n - m) + (size_t) above + 1];
 
-    /* free & avoid double free */
-    free(curr);
+done:
     free(prev);
-    curr = NULL;
-    prev = NULL;
+    free(cur);
 
     return distance;
 }
 
-int distance_file(const char* file1, const char* file2)
+
+long distance_ids_bounded(const uint32_t* ids1, size_t len1, const uint32_t* ids2, size_t len2,
+                          uint32_t nsyms, long k)
 {
-    char* buf1 = NULL;
-    char* buf2 = NULL;
+    if (len1 < len2)
+    {
+        return distance_ids_bounded(ids2, len2, ids1, len1, nsyms, k);
+    }
 
-    if (file1 == NULL || file2 == NULL)
+    /* distance is at least the difference in length */
+    if (k < 0 || len1 - len2 > (size_t) k)
     {
-        return -1;
+        return k + 1;
     }
 
-    int dist = 0;
+    /* band covers the whole matrix */
+    if (len2 == 0 || (size_t) k >= len1)
+    {
+        long distance = distance_ids(ids1, len1, ids2, len2, nsyms);
+        return distance > k ? k + 1 : distance;
+    }
 
-    /* get size of files */
+    /* the shorter sequence down the rows, the band is narrower than them */
+    long distance = distance_ids_band(ids2, len2, ids1, len1, k);
+    if (distance < 0)
+    {
+        /* no memory for the band */
+        distance = distance_ids(ids1, len1, ids2, len2, nsyms);
+        return distance > k ? k + 1 : distance;
+    }
 
-    struct stat st1;
-    stat(file1, &st1);
-    int size1 = st1.st_size;
+    return distance;
+}
 
-    struct stat st2;
-    stat(file2, &st2);
-    int size2 = st2.st_size;
 
-#ifdef MMAP
+/* hash of the whole source, for the cache. false if it can't be mapped */
+static bool source_hash(const source* src, uint64_t* hash)
+{
+    if (src->len == 0)
+    {
+        *hash = hash_bytes(NULL, 0);
+        return true;
+    }
+
+    void* map;
+    size_t maplen;
+    const char* buf = source_map(src, 0, src->len, &map, &maplen);
+    if (!buf)
+    {
+        return false;
+    }
+
+    *hash = hash_bytes(buf, src->len);
+    source_unmap(map, maplen);
+
+    return true;
+}
+
+
+/* distance of file1 and file2, capped at k + 1 unless k is UNBOUNDED */
+static long distance_file_k(const char* file1, const char* file2, long k)
+{
+    if (file1 == NULL || file2 == NULL)
+    {
+        return -1;
+    }
+
     /* open files read only */
     int f1 = open(file1, O_RDONLY);
     int f2 = open(file2, O_RDONLY);
 
-    if (f1 != -1 && f2 != -1)
+    struct stat st1;
+    struct stat st2;
+
+    if (f1 == -1 || f2 == -1 || fstat(f1, &st1) != 0 || fstat(f2, &st2) != 0)
     {
-        /* memory-map files */
-        buf1 = mmap(NULL, size1, PROT_READ, MAP_PRIVATE, f1,0);
-        buf2 = mmap(NULL, size2, PROT_READ, MAP_PRIVATE, f2,0);
+        if (f1 != -1)
+            close(f1);
+        if (f2 != -1)
+            close(f2);
+        return -1;
+    }
+
+    source s1 = {NULL, f1, (size_t) st1.st_size};
+    source s2 = {NULL, f2, (size_t) st2.st_size};
 
-        /* give kernel some hints on usage pattern */
-        madvise(buf1, size1, MADV_SEQUENTIAL);
-        madvise(buf2, size2, MADV_SEQUENTIAL);
+    long dist = -1;
 
-        /* find distance */
-        dist = distance_string(buf1, size1, buf2, size2);
+    /* the same contents asked before, under any name */
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    long bound = k == UNBOUNDED ? LONG_MAX : k;
+    bool cached = distcache_enabled() && source_hash(&s1, &h1) && source_hash(&s2, &h2);
+    if (cached && distcache_get(h1, s1.len, h2, s2.len, UNIT_BYTE, bound, &dist))
+    {
+        close(f1);
+        close(f2);
+        return dist;
+    }
+
+    if (k == UNBOUNDED || s1.len == 0 || s2.len == 0)
+    {
+        /* files are mapped a window at a time */
+        dist = distance_source(&s1, &s2);
+        if (k != UNBOUNDED && dist > k)
+        {
+            dist = k + 1;
+        }
     }
     else
     {
-        return -1;
+        /* the band goes through both files once, from the start:
+         * map them whole and let the kernel page them in */
+        void* map1;
+        void* map2;
+        size_t maplen1;
+        size_t maplen2;
+
+        const char* buf1 = source_map(&s1, 0, s1.len, &map1, &maplen1);
+        const char* buf2 = source_map(&s2, 0, s2.len, &map2, &maplen2);
+
+        if (buf1 && buf2)
+        {
+            dist = distance_string_bounded(buf1, s1.len, buf2, s2.len, k);
+        }
+
+        source_unmap(map1, maplen1);
+        source_unmap(map2, maplen2);
     }
 
-    /* unmap files */
-    munmap(buf1, size1);
-    munmap(buf2, size2);
+    if (cached)
+    {
+        distcache_put(h1, s1.len, h2, s2.len, UNIT_BYTE, bound, dist);
+    }
 
     close(f1);
     close(f2);
 
     return dist;
-#else
+}
 
-    /* load files to buffers and find distance */
 
-    if (file_load(file1, &buf1) && file_load(file2, &buf2))
-    {
-        dist = distance_string(buf1, size1, buf2, size2);
+long distance_file(const char* file1, const char* file2)
+{
+    return distance_file_k(file1, file2, UNBOUNDED);
+}
 
-        /* free buffers */
-        free(buf1);
-        free(buf2);
-        buf1 = NULL;
-        buf2 = NULL;
 
-        return dist;
-    }
-    else
+long distance_file_bounded(const char* file1, const char* file2, long k)
+{
+    if (k < 0)
     {
-        return -1;
+        return k + 1;
     }
 
-#endif
-}
\ No newline at end of file
+    return distance_file_k(file1, file2, k);
+}
@@ -0,0 +1,464 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "../include/distance_simd.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+/* Every kernel is compiled for its own instruction set only, the
+ * caller checks the cpu before calling it. The steps at the two ends
+ * of a group's sweep have some lanes outside of the text: there the
+ * new state is blended with the old one so these lanes don't move. */
+
+#define HIGHBIT ((uint64_t) 1 << 63)
+
+
+/* ---------------------------------------------------------------- SSE4.1 */
+
+__attribute__((target("sse4.1")))
+static inline __m128i sse41_step(__m128i* pv, __m128i* mv, __m128i* hp, __m128i* hm,
+                                 __m128i eq, __m128i hbit, __m128i active)
+{
+    const __m128i ones = _mm_set1_epi64x(-1);
+    const __m128i one  = _mm_set1_epi64x(1);
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i Pv = *pv;
+    __m128i Mv = *mv;
+
+    __m128i Xv = _mm_or_si128(eq, Mv);
+    eq = _mm_or_si128(eq, *hm);
+    __m128i Xh = _mm_or_si128(_mm_xor_si128(_mm_add_epi64(_mm_and_si128(eq, Pv), Pv), Pv), eq);
+
+    __m128i Ph = _mm_or_si128(Mv, _mm_xor_si128(_mm_or_si128(Xh, Pv), ones));
+    __m128i Mh = _mm_and_si128(Pv, Xh);
+
+    __m128i op = _mm_andnot_si128(_mm_cmpeq_epi64(_mm_and_si128(Ph, hbit), zero), one);
+    __m128i om = _mm_andnot_si128(_mm_cmpeq_epi64(_mm_and_si128(Mh, hbit), zero), one);
+
+    Ph = _mm_or_si128(_mm_slli_epi64(Ph, 1), *hp);
+    Mh = _mm_or_si128(_mm_slli_epi64(Mh, 1), *hm);
+
+    __m128i nPv = _mm_or_si128(Mh, _mm_xor_si128(_mm_or_si128(Xv, Ph), ones));
+    __m128i nMv = _mm_and_si128(Ph, Xv);
+
+    *pv = _mm_blendv_epi8(Pv, nPv, active);
+    *mv = _mm_blendv_epi8(Mv, nMv, active);
+    *hp = _mm_and_si128(op, active);
+    *hm = _mm_and_si128(om, active);
+
+    return _mm_sub_epi64(*hp, *hm);
+}
+
+
+/* moves every lane one up, lane 0 gets v */
+__attribute__((target("sse4.1")))
+static inline __m128i sse41_shift_in(__m128i x, int64_t v)
+{
+    return _mm_alignr_epi8(x, _mm_set1_epi64x(v), 8);
+}
+
+
+__attribute__((target("sse4.1")))
+long distance_myers_sse41(const uint64_t* peq, size_t nblocks, uint64_t lastbit,
+                          uint64_t* pvs, uint64_t* mvs, const char* txt, size_t n, int8_t* hb)
+{
+    enum { LANES = 2 };
+
+    size_t final = nblocks - 1;
+    long sum = 0;
+
+    for (size_t b0 = 0; b0 < nblocks; b0 += LANES)
+    {
+        /* lanes past the last block repeat it, their results are unused */
+        size_t blk[LANES];
+        int64_t hbits[LANES];
+        int64_t pvl[LANES];
+        int64_t mvl[LANES];
+        for (int l = 0; l < LANES; l++)
+        {
+            blk[l] = b0 + l < nblocks ? b0 + l : final;
+            hbits[l] = (int64_t) (b0 + l == final ? lastbit : HIGHBIT);
+            pvl[l] = (int64_t) pvs[blk[l]];
+            mvl[l] = (int64_t) mvs[blk[l]];
+        }
+
+        /* lane of the bottom block of the group */
+        size_t lb = final - b0 < LANES - 1 ? final - b0 : LANES - 1;
+
+        __m128i hbit = _mm_loadu_si128((const __m128i*) hbits);
+        __m128i pv = _mm_loadu_si128((const __m128i*) pvl);
+        __m128i mv = _mm_loadu_si128((const __m128i*) mvl);
+        __m128i hp = _mm_setzero_si128();
+        __m128i hm = _mm_setzero_si128();
+        __m128i all = _mm_set1_epi64x(-1);
+
+        bool last_group = b0 + LANES >= nblocks;
+
+        for (size_t s = 0; s < n + lb; s++)
+        {
+            /* lane 0 enters column s with the delta from the group above */
+            int8_t h0 = s < n ? hb[s] : 0;
+            hp = sse41_shift_in(hp, h0 > 0);
+            hm = sse41_shift_in(hm, h0 < 0);
+
+            __m128i eq;
+            __m128i active;
+            if (s >= LANES - 1 && s < n)
+            {
+                eq = _mm_set_epi64x((int64_t) peq[(unsigned char) txt[s - 1] * nblocks + blk[1]],
+                                    (int64_t) peq[(unsigned char) txt[s]     * nblocks + blk[0]]);
+                active = all;
+            }
+            else
+            {
+                int64_t e[LANES] = {0};
+                int64_t a[LANES] = {0};
+                for (int l = 0; l < LANES; l++)
+                {
+                    if (s >= (size_t) l && s - l < n)
+                    {
+                        e[l] = (int64_t) peq[(unsigned char) txt[s - l] * nblocks + blk[l]];
+                        a[l] = -1;
+                    }
+                }
+                eq = _mm_loadu_si128((const __m128i*) e);
+                active = _mm_loadu_si128((const __m128i*) a);
+            }
+
+            __m128i h = sse41_step(&pv, &mv, &hp, &hm, eq, hbit, active);
+
+            /* the bottom lane leaves column s - lb */
+            if (s >= lb)
+            {
+                int64_t hs[LANES];
+                _mm_storeu_si128((__m128i*) hs, h);
+                hb[s - lb] = (int8_t) hs[lb];
+                if (last_group)
+                {
+                    sum += hs[lb];
+                }
+            }
+        }
+
+        _mm_storeu_si128((__m128i*) pvl, pv);
+        _mm_storeu_si128((__m128i*) mvl, mv);
+        for (size_t l = 0; l <= lb; l++)
+        {
+            pvs[b0 + l] = (uint64_t) pvl[l];
+            mvs[b0 + l] = (uint64_t) mvl[l];
+        }
+    }
+
+    return sum;
+}
+
+
+/* ------------------------------------------------------------------ AVX2 */
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_step(__m256i* pv, __m256i* mv, __m256i* hp, __m256i* hm,
+                                __m256i eq, __m256i hbit, __m256i active)
+{
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    const __m256i one  = _mm256_set1_epi64x(1);
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i Pv = *pv;
+    __m256i Mv = *mv;
+
+    __m256i Xv = _mm256_or_si256(eq, Mv);
+    eq = _mm256_or_si256(eq, *hm);
+    __m256i Xh = _mm256_or_si256(_mm256_xor_si256(_mm256_add_epi64(_mm256_and_si256(eq, Pv), Pv), Pv), eq);
+
+    __m256i Ph = _mm256_or_si256(Mv, _mm256_xor_si256(_mm256_or_si256(Xh, Pv), ones));
+    __m256i Mh = _mm256_and_si256(Pv, Xh);
+
+    __m256i op = _mm256_andnot_si256(_mm256_cmpeq_epi64(_mm256_and_si256(Ph, hbit), zero), one);
+    __m256i om = _mm256_andnot_si256(_mm256_cmpeq_epi64(_mm256_and_si256(Mh, hbit), zero), one);
+
+    Ph = _mm256_or_si256(_mm256_slli_epi64(Ph, 1), *hp);
+    Mh = _mm256_or_si256(_mm256_slli_epi64(Mh, 1), *hm);
+
+    __m256i nPv = _mm256_or_si256(Mh, _mm256_xor_si256(_mm256_or_si256(Xv, Ph), ones));
+    __m256i nMv = _mm256_and_si256(Ph, Xv);
+
+    *pv = _mm256_blendv_epi8(Pv, nPv, active);
+    *mv = _mm256_blendv_epi8(Mv, nMv, active);
+    *hp = _mm256_and_si256(op, active);
+    *hm = _mm256_and_si256(om, active);
+
+    return _mm256_sub_epi64(*hp, *hm);
+}
+
+
+/* moves every lane one up, lane 0 gets v */
+__attribute__((target("avx2")))
+static inline __m256i avx2_shift_in(__m256i x, int64_t v)
+{
+    __m256i up = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(2, 1, 0, 0));
+    return _mm256_blend_epi32(up, _mm256_set1_epi64x(v), 0x03);
+}
+
+
+__attribute__((target("avx2")))
+long distance_myers_avx2(const uint64_t* peq, size_t nblocks, uint64_t lastbit,
+                         uint64_t* pvs, uint64_t* mvs, const char* txt, size_t n, int8_t* hb)
+{
+    enum { LANES = 4 };
+
+    size_t final = nblocks - 1;
+    long sum = 0;
+
+    for (size_t b0 = 0; b0 < nblocks; b0 += LANES)
+    {
+        /* lanes past the last block repeat it, their results are unused */
+        size_t blk[LANES];
+        int64_t hbits[LANES];
+        int64_t pvl[LANES];
+        int64_t mvl[LANES];
+        for (int l = 0; l < LANES; l++)
+        {
+            blk[l] = b0 + l < nblocks ? b0 + l : final;
+            hbits[l] = (int64_t) (b0 + l == final ? lastbit : HIGHBIT);
+            pvl[l] = (int64_t) pvs[blk[l]];
+            mvl[l] = (int64_t) mvs[blk[l]];
+        }
+
+        /* lane of the bottom block of the group */
+        size_t lb = final - b0 < LANES - 1 ? final - b0 : LANES - 1;
+
+        __m256i hbit = _mm256_loadu_si256((const __m256i*) hbits);
+        __m256i pv = _mm256_loadu_si256((const __m256i*) pvl);
+        __m256i mv = _mm256_loadu_si256((const __m256i*) mvl);
+        __m256i hp = _mm256_setzero_si256();
+        __m256i hm = _mm256_setzero_si256();
+        __m256i all = _mm256_set1_epi64x(-1);
+
+        bool last_group = b0 + LANES >= nblocks;
+
+        for (size_t s = 0; s < n + lb; s++)
+        {
+            /* lane 0 enters column s with the delta from the group above */
+            int8_t h0 = s < n ? hb[s] : 0;
+            hp = avx2_shift_in(hp, h0 > 0);
+            hm = avx2_shift_in(hm, h0 < 0);
+
+            __m256i eq;
+            __m256i active;
+            if (s >= LANES - 1 && s < n)
+            {
+                eq = _mm256_set_epi64x((int64_t) peq[(unsigned char) txt[s - 3] * nblocks + blk[3]],
+                                       (int64_t) peq[(unsigned char) txt[s - 2] * nblocks + blk[2]],
+                                       (int64_t) peq[(unsigned char) txt[s - 1] * nblocks + blk[1]],
+                                       (int64_t) peq[(unsigned char) txt[s]     * nblocks + blk[0]]);
+                active = all;
+            }
+            else
+            {
+                int64_t e[LANES] = {0};
+                int64_t a[LANES] = {0};
+                for (int l = 0; l < LANES; l++)
+                {
+                    if (s >= (size_t) l && s - l < n)
+                    {
+                        e[l] = (int64_t) peq[(unsigned char) txt[s - l] * nblocks + blk[l]];
+                        a[l] = -1;
+                    }
+                }
+                eq = _mm256_loadu_si256((const __m256i*) e);
+                active = _mm256_loadu_si256((const __m256i*) a);
+            }
+
+            __m256i h = avx2_step(&pv, &mv, &hp, &hm, eq, hbit, active);
+
+            /* the bottom lane leaves column s - lb */
+            if (s >= lb)
+            {
+                int64_t hs[LANES];
+                _mm256_storeu_si256((__m256i*) hs, h);
+                hb[s - lb] = (int8_t) hs[lb];
+                if (last_group)
+                {
+                    sum += hs[lb];
+                }
+            }
+        }
+
+        _mm256_storeu_si256((__m256i*) pvl, pv);
+        _mm256_storeu_si256((__m256i*) mvl, mv);
+        for (size_t l = 0; l <= lb; l++)
+        {
+            pvs[b0 + l] = (uint64_t) pvl[l];
+            mvs[b0 + l] = (uint64_t) mvl[l];
+        }
+    }
+
+    return sum;
+}
+
+
+/* --------------------------------------------------------------- AVX-512 */
+
+__attribute__((target("avx512f")))
+static inline __m512i avx512_step(__m512i* pv, __m512i* mv, __m512i* hp, __m512i* hm,
+                                  __m512i eq, __m512i hbit, __mmask8 active)
+{
+    const __m512i one = _mm512_set1_epi64(1);
+
+    __m512i Pv = *pv;
+    __m512i Mv = *mv;
+
+    __m512i Xv = _mm512_or_si512(eq, Mv);
+    eq = _mm512_or_si512(eq, *hm);
+    __m512i Xh = _mm512_or_si512(_mm512_xor_si512(_mm512_add_epi64(_mm512_and_si512(eq, Pv), Pv), Pv), eq);
+
+    /* Mv | ~(Xh | Pv) */
+    __m512i Ph = _mm512_ternarylogic_epi64(Mv, Xh, Pv, 0xF1);
+    __m512i Mh = _mm512_and_si512(Pv, Xh);
+
+    __mmask8 op = _mm512_test_epi64_mask(Ph, hbit) & active;
+    __mmask8 om = _mm512_test_epi64_mask(Mh, hbit) & active;
+
+    Ph = _mm512_or_si512(_mm512_slli_epi64(Ph, 1), *hp);
+    Mh = _mm512_or_si512(_mm512_slli_epi64(Mh, 1), *hm);
+
+    /* Mh | ~(Xv | Ph) */
+    *pv = _mm512_mask_mov_epi64(Pv, active, _mm512_ternarylogic_epi64(Mh, Xv, Ph, 0xF1));
+    *mv = _mm512_mask_mov_epi64(Mv, active, _mm512_and_si512(Ph, Xv));
+    *hp = _mm512_maskz_mov_epi64(op, one);
+    *hm = _mm512_maskz_mov_epi64(om, one);
+
+    return _mm512_sub_epi64(*hp, *hm);
+}
+
+
+/* moves every lane one up, lane 0 gets v */
+__attribute__((target("avx512f")))
+static inline __m512i avx512_shift_in(__m512i x, int64_t v)
+{
+    return _mm512_alignr_epi64(x, _mm512_set1_epi64(v), 7);
+}
+
+
+__attribute__((target("avx512f")))
+long distance_myers_avx512(const uint64_t* peq, size_t nblocks, uint64_t lastbit,
+                           uint64_t* pvs, uint64_t* mvs, const char* txt, size_t n, int8_t* hb)
+{
+    enum { LANES = 8 };
+
+    size_t final = nblocks - 1;
+    long sum = 0;
+
+    for (size_t b0 = 0; b0 < nblocks; b0 += LANES)
+    {
+        /* lanes past the last block repeat it, their results are unused */
+        size_t blk[LANES];
+        int64_t hbits[LANES];
+        int64_t pvl[LANES];
+        int64_t mvl[LANES];
+        for (int l = 0; l < LANES; l++)
+        {
+            blk[l] = b0 + l < nblocks ? b0 + l : final;
+            hbits[l] = (int64_t) (b0 + l == final ? lastbit : HIGHBIT);
+            pvl[l] = (int64_t) pvs[blk[l]];
+            mvl[l] = (int64_t) mvs[blk[l]];
+        }
+
+        /* lane of the bottom block of the group */
+        size_t lb = final - b0 < LANES - 1 ? final - b0 : LANES - 1;
+
+        __m512i hbit = _mm512_loadu_si512(hbits);
+        __m512i pv = _mm512_loadu_si512(pvl);
+        __m512i mv = _mm512_loadu_si512(mvl);
+        __m512i hp = _mm512_setzero_si512();
+        __m512i hm = _mm512_setzero_si512();
+
+        bool last_group = b0 + LANES >= nblocks;
+
+        for (size_t s = 0; s < n + lb; s++)
+        {
+            /* lane 0 enters column s with the delta from the group above */
+            int8_t h0 = s < n ? hb[s] : 0;
+            hp = avx512_shift_in(hp, h0 > 0);
+            hm = avx512_shift_in(hm, h0 < 0);
+
+            /* lane l reads block blk[l] of the masks of txt[s - l] */
+            __m512i eq;
+            __mmask8 active = 0xFF;
+            if (s >= LANES - 1 && s < n)
+            {
+                eq = _mm512_set_epi64((int64_t) peq[(unsigned char) txt[s - 7] * nblocks + blk[7]],
+                                      (int64_t) peq[(unsigned char) txt[s - 6] * nblocks + blk[6]],
+                                      (int64_t) peq[(unsigned char) txt[s - 5] * nblocks + blk[5]],
+                                      (int64_t) peq[(unsigned char) txt[s - 4] * nblocks + blk[4]],
+                                      (int64_t) peq[(unsigned char) txt[s - 3] * nblocks + blk[3]],
+                                      (int64_t) peq[(unsigned char) txt[s - 2] * nblocks + blk[2]],
+                                      (int64_t) peq[(unsigned char) txt[s - 1] * nblocks + blk[1]],
+                                      (int64_t) peq[(unsigned char) txt[s]     * nblocks + blk[0]]);
+            }
+            else
+            {
+                int64_t e[LANES] = {0};
+                for (int l = 0; l < LANES; l++)
+                {
+                    if (s >= (size_t) l && s - l < n)
+                    {
+                        e[l] = (int64_t) peq[(unsigned char) txt[s - l] * nblocks + blk[l]];
+                    }
+                    else
+                    {
+                        active &= (__mmask8) ~(1u << l);
+                    }
+                }
+                eq = _mm512_loadu_si512(e);
+            }
+
+            __m512i h = avx512_step(&pv, &mv, &hp, &hm, eq, hbit, active);
+
+            /* the bottom lane leaves column s - lb */
+            if (s >= lb)
+            {
+                int64_t hs[LANES];
+                _mm512_storeu_si512(hs, h);
+                hb[s - lb] = (int8_t) hs[lb];
+                if (last_group)
+                {
+                    sum += hs[lb];
+                }
+            }
+        }
+
+        _mm512_storeu_si512(pvl, pv);
+        _mm512_storeu_si512(mvl, mv);
+        for (size_t l = 0; l <= lb; l++)
+        {
+            pvs[b0 + l] = (uint64_t) pvl[l];
+            mvs[b0 + l] = (uint64_t) mvl[l];
+        }
+    }
+
+    return sum;
+}
+
+#endif // __x86_64__
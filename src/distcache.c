@@ -0,0 +1,327 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>   // LONG_MAX
+#include <fcntl.h>    // open
+#include <unistd.h>   // close, ftruncate
+#include <sys/stat.h>
+#include <sys/mman.h> // mmap
+#include <sys/file.h> // flock
+#include <stdatomic.h>
+
+#include "../include/distcache.h"
+#include "../include/util.h"
+
+
+/* info of a slot: the unit in the low bits */
+#define INFO_UNIT  0xFFu
+#define INFO_EXACT (1u << 8)  /* value is the distance, not a lower bound */
+#define INFO_USED  (1u << 9)
+
+
+typedef struct
+{
+    char magic[DISTCACHE_MAGIC_LEN];
+    uint32_t slotsize;
+    uint64_t nsets;
+    atomic_uint_least64_t clock; /* stamps of the uses */
+} cache_header;
+
+
+/* what a slot holds, hash1 and size1 being the lesser of the pair */
+typedef struct
+{
+    uint64_t hash1;
+    uint64_t hash2;
+    uint64_t size1;
+    uint64_t size2;
+    int64_t value;
+    uint32_t info;
+    uint32_t check; /* of the fields above */
+} cache_entry;
+
+
+typedef struct
+{
+    cache_entry e;
+    atomic_uint_least64_t stamp; /* last use, outside the check */
+    uint64_t pad;
+} cache_slot;
+
+
+static char* cacheMap = NULL;
+static size_t cacheSize = 0;
+
+
+static inline cache_header* cache_head(void)
+{
+    return (cache_header*) cacheMap;
+}
+
+
+static inline uint32_t entry_check(const cache_entry* e)
+{
+    return (uint32_t) hash_bytes((const char*) e, offsetof(cache_entry, check));
+}
+
+
+/* the key of the pair, the lesser content first. Value and check are left to 0 */
+static cache_entry entry_key(uint64_t hash1, size_t size1, uint64_t hash2, size_t size2, unit_t unit)
+{
+    cache_entry e;
+    memset(&e, 0, sizeof(e));
+
+    if (hash1 > hash2 || (hash1 == hash2 && size1 > size2))
+    {
+        uint64_t h = hash1;
+        hash1 = hash2;
+        hash2 = h;
+
+        size_t s = size1;
+        size1 = size2;
+        size2 = s;
+    }
+
+    e.hash1 = hash1;
+    e.hash2 = hash2;
+    e.size1 = size1;
+    e.size2 = size2;
+    e.info = (uint32_t) unit;
+
+    return e;
+}
+
+
+static inline bool entry_same(const cache_entry* a, const cache_entry* key)
+{
+    return (a->info & INFO_USED) && a->check == entry_check(a) && a->hash1 == key->hash1
+           && a->hash2 == key->hash2 && a->size1 == key->size1 && a->size2 == key->size2
+           && (a->info & INFO_UNIT) == key->info;
+}
+
+
+/* first slot of the set of key */
+static cache_slot* set_of(const cache_entry* key)
+{
+    uint64_t h = hash_bytes((const char*) key, offsetof(cache_entry, value)) ^ key->info;
+    uint64_t nsets = cache_head()->nsets;
+    cache_slot* slots = (cache_slot*) (cacheMap + DISTCACHE_HEADER);
+
+    return &slots[(h % nsets) * DISTCACHE_WAYS];
+}
+
+
+/* the slot of key in set, NULL if it's not there. e receives its contents */
+static cache_slot* set_find(cache_slot* set, const cache_entry* key, cache_entry* e)
+{
+    for (int i = 0; i < DISTCACHE_WAYS; i++)
+    {
+        /* copied before checking, another process may be writing it */
+        memcpy(e, &set[i].e, sizeof(cache_entry));
+        if (entry_same(e, key))
+        {
+            return &set[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static inline void slot_touch(cache_slot* s)
+{
+    uint64_t now = atomic_fetch_add_explicit(&cache_head()->clock, 1, memory_order_relaxed);
+    atomic_store_explicit(&s->stamp, now, memory_order_relaxed);
+}
+
+
+int distcache_open(const char* file, size_t bytes)
+{
+    distcache_close();
+
+    int fd = open(file, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    /* one process at a time sets a new cache up */
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    bool created = st.st_size == 0;
+    size_t size = st.st_size;
+    if (created)
+    {
+        size_t set = DISTCACHE_WAYS * sizeof(cache_slot);
+        size_t nsets = bytes > DISTCACHE_HEADER + set ? (bytes - DISTCACHE_HEADER) / set : 1;
+        size = DISTCACHE_HEADER + nsets * set;
+
+        if (ftruncate(fd, (off_t) size) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    void* p = size >= DISTCACHE_HEADER ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (p == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    cacheMap = (char*) p;
+    cacheSize = size;
+
+    cache_header* h = cache_head();
+    if (created)
+    {
+        memcpy(h->magic, DISTCACHE_MAGIC, DISTCACHE_MAGIC_LEN);
+        h->slotsize = sizeof(cache_slot);
+        h->nsets = (size - DISTCACHE_HEADER) / (DISTCACHE_WAYS * sizeof(cache_slot));
+        atomic_init(&h->clock, 1);
+    }
+
+    /* not a cache, or not one of this build: leave it alone */
+    if (memcmp(h->magic, DISTCACHE_MAGIC, DISTCACHE_MAGIC_LEN) != 0 || h->slotsize != sizeof(cache_slot)
+        || h->nsets == 0 || size != DISTCACHE_HEADER + h->nsets * DISTCACHE_WAYS * sizeof(cache_slot))
+    {
+        distcache_close();
+        close(fd);
+        return -1;
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    return 0;
+}
+
+
+bool distcache_enabled(void)
+{
+    return cacheMap != NULL;
+}
+
+
+bool distcache_get(uint64_t hash1, size_t size1, uint64_t hash2, size_t size2, unit_t unit, long k,
+                   long* distance)
+{
+    if (!cacheMap)
+    {
+        return false;
+    }
+
+    cache_entry key = entry_key(hash1, size1, hash2, size2, unit);
+    cache_entry e;
+    cache_slot* s = set_find(set_of(&key), &key, &e);
+    if (!s)
+    {
+        return false;
+    }
+
+    if (e.info & INFO_EXACT)
+    {
+        *distance = e.value <= k ? (long) e.value : k + 1;
+    }
+    else if (e.value > k)
+    {
+        /* the distance is at least value */
+        *distance = k + 1;
+    }
+    else
+    {
+        return false;
+    }
+
+    slot_touch(s);
+    return true;
+}
+
+
+void distcache_put(uint64_t hash1, size_t size1, uint64_t hash2, size_t size2, unit_t unit, long k,
+                   long distance)
+{
+    if (!cacheMap || distance < 0)
+    {
+        return;
+    }
+
+    cache_entry key = entry_key(hash1, size1, hash2, size2, unit);
+    bool exact = distance <= k;
+    int64_t value = exact ? distance : (int64_t) k + 1;
+
+    cache_slot* set = set_of(&key);
+    cache_entry e;
+    cache_slot* s = set_find(set, &key, &e);
+
+    /* already known as well or better */
+    if (s && ((e.info & INFO_EXACT) || (!exact && e.value >= value)))
+    {
+        slot_touch(s);
+        return;
+    }
+
+    /* a free slot, a torn one or the least recently used */
+    for (int i = 0; !s && i < DISTCACHE_WAYS; i++)
+    {
+        memcpy(&e, &set[i].e, sizeof(cache_entry));
+        if (!(e.info & INFO_USED) || e.check != entry_check(&e))
+        {
+            s = &set[i];
+        }
+    }
+    if (!s)
+    {
+        s = &set[0];
+        for (int i = 1; i < DISTCACHE_WAYS; i++)
+        {
+            if (atomic_load_explicit(&set[i].stamp, memory_order_relaxed)
+                < atomic_load_explicit(&s->stamp, memory_order_relaxed))
+            {
+                s = &set[i];
+            }
+        }
+    }
+
+    key.value = value;
+    key.info |= INFO_USED | (exact ? INFO_EXACT : 0);
+    key.check = entry_check(&key);
+
+    memcpy(&s->e, &key, sizeof(cache_entry));
+    slot_touch(s);
+}
+
+
+void distcache_close(void)
+{
+    if (cacheMap)
+    {
+        munmap(cacheMap, cacheSize);
+    }
+    cacheMap = NULL;
+    cacheSize = 0;
+}
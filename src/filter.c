@@ -0,0 +1,161 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "../include/filter.h"
+
+
+/* Each bound counts what one string has in excess (p) and what it lacks (n)
+ * with respect to the other. An edit removes at most one item in excess
+ * and adds at most one missing item, so the distance is >= max(p, n).
+ * Merging q-grams into buckets can only cancel out some of the counts,
+ * which keeps the bound valid. */
+
+static long excess_bound(const uint32_t* a, const uint32_t* b, size_t len)
+{
+    long p = 0;
+    long n = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        long d = (long) a[i] - (long) b[i];
+        if (d > 0)
+        {
+            p += d;
+        }
+        else
+        {
+            n -= d;
+        }
+    }
+
+    return p > n ? p : n;
+}
+
+
+void signature_histogram(const char* buf, size_t len, signature* sig)
+{
+    sig->size = len;
+    memset(sig->hist, 0, sizeof(sig->hist));
+
+    for (size_t i = 0; i < len; i++)
+    {
+        sig->hist[(unsigned char) buf[i]]++;
+    }
+}
+
+
+void signature_qgrams(const char* buf, size_t len, signature* sig)
+{
+    memset(sig->qgram, 0, sizeof(sig->qgram));
+
+    if (len < QGRAM_Q)
+    {
+        return;
+    }
+
+    /* rolling q-gram, the top bits of its multiplicative hash pick the bucket */
+    uint32_t g = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        g = (g << 8) | (unsigned char) buf[i];
+        if (i + 1 >= QGRAM_Q)
+        {
+            uint32_t key = g & (uint32_t) ((1ull << (8 * QGRAM_Q)) - 1);
+            sig->qgram[(key * 2654435761u) >> (32 - QGRAM_BITS)]++;
+        }
+    }
+}
+
+
+void signature_compute(const char* buf, size_t len, signature* sig)
+{
+    signature_histogram(buf, len, sig);
+    signature_qgrams(buf, len, sig);
+}
+
+
+long filter_size_bound(const signature* a, const signature* b)
+{
+    return a->size > b->size ? (long) (a->size - b->size) : (long) (b->size - a->size);
+}
+
+
+/* the counters are 32 bits: past that they wrap, and bound nothing */
+static inline bool counts_fit(const signature* a, const signature* b)
+{
+    return a->size <= UINT32_MAX && b->size <= UINT32_MAX;
+}
+
+
+long filter_histogram_bound(const signature* a, const signature* b)
+{
+    if (!counts_fit(a, b))
+    {
+        return 0;
+    }
+
+    return excess_bound(a->hist, b->hist, 256);
+}
+
+
+long filter_qgram_bound(const signature* a, const signature* b)
+{
+    if (!counts_fit(a, b))
+    {
+        return 0;
+    }
+
+    /* an edit changes up to QGRAM_Q q-grams */
+    return (excess_bound(a->qgram, b->qgram, QGRAM_BUCKETS) + QGRAM_Q - 1) / QGRAM_Q;
+}
+
+
+void filter_count(filter_stats* stats, filter_stage stage)
+{
+    if (stage < FILTER_STAGES)
+    {
+        stats->rejected[stage]++;
+    }
+    else
+    {
+        stats->passed++;
+    }
+}
+
+
+void filter_print_stats(const filter_stats* stats, FILE* out)
+{
+    fprintf(out, "REJECTED: size %lu, histogram %lu, q-grams %lu. COMPARED: %lu",
+            stats->rejected[FILTER_SIZE],
+            stats->rejected[FILTER_HISTOGRAM],
+            stats->rejected[FILTER_QGRAM],
+            stats->passed);
+
+    /* only with a cache */
+    if (stats->cached > 0)
+    {
+        fprintf(out, ". CACHED: %lu", stats->cached);
+    }
+    if (stats->duplicates > 0)
+    {
+        fprintf(out, ". DUPLICATES: %lu", stats->duplicates);
+    }
+    fprintf(out, "\n");
+}
@@ -17,7 +17,7 @@
 
 #include <stdlib.h>
 #include <errno.h>
-#include <limits.h> // INT_MAX
+#include <limits.h> // LONG_MAX
 
 #include "../include/list.h"
 #include "../include/list_namedistance.h"
@@ -40,7 +40,7 @@ int list_namedistance_save_to_array(node* list, name_distance** arr)
             {
                 /* get payload struct */
                 name_distance* nd = (name_distance*) (curr->data);
-                int dist = nd->distance;
+                long dist = nd->distance;
 
                 /* alloc arr[i] */
                 char* entry = malloc(sizeof(nd->filename));
@@ -76,9 +76,9 @@ int list_namedistance_save_to_array(node* list, name_distance** arr)
 }
 
 
-int list_namedistance_min(node* list)
+long list_namedistance_min(node* list)
 {
-    int min = INT_MAX;
+    long min = LONG_MAX;
 
     while (list != NULL)
     {
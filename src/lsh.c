@@ -0,0 +1,480 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>  // PATH_MAX
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../include/lsh.h"
+#include "../include/util.h"
+#include "../include/walk.h"
+
+
+/* the top bits of a shingle's hash pick its bin */
+#define BIN_BITS 6
+#define VALUE_MASK ((1ULL << (64 - BIN_BITS)) - 1)
+
+/* an empty bin borrows from the next full one, shifted by this much per bin */
+#define DENSIFY_STEP (1ULL << (64 - BIN_BITS - 8))
+
+_Static_assert(LSH_HASHES == 1 << BIN_BITS, "a bin per hash");
+
+
+typedef struct
+{
+    char magic[LSH_MAGIC_LEN];
+    uint32_t bands;
+    uint64_t n;
+    uint64_t namesize;
+} lsh_header;
+
+
+/* a file of the band, its key first */
+typedef struct
+{
+    uint32_t key;
+    uint32_t file;
+} lsh_pair;
+
+
+typedef struct
+{
+    uint64_t name;
+    uint64_t len;
+} lsh_name;
+
+
+/* a file read by the build */
+typedef struct
+{
+    char* name;      /* NULL if it couldn't be read after all */
+    lsh_keys keys;
+} lsh_file;
+
+
+/* the files of the build, read by the threads in turn */
+typedef struct
+{
+    const char* root;
+    lsh_file* files;
+    size_t n;
+    atomic_size_t next;   /* first file not taken yet */
+} lsh_job;
+
+
+static inline uint64_t shingle_hash(uint64_t w)
+{
+    w ^= w >> 33;
+    w *= 0xff51afd7ed558ccdULL;
+    w ^= w >> 33;
+    w *= 0xc4ceb9fe1a85ec53ULL;
+    w ^= w >> 33;
+    return w;
+}
+
+
+static inline void bin_add(uint64_t* mins, uint64_t h)
+{
+    uint64_t v = h & VALUE_MASK;
+    size_t bin = h >> (64 - BIN_BITS);
+    if (v < mins[bin])
+    {
+        mins[bin] = v;
+    }
+}
+
+
+void lsh_compute(const char* buf, size_t len, lsh_keys* keys)
+{
+    uint64_t mins[LSH_HASHES];
+    for (int i = 0; i < LSH_HASHES; i++)
+    {
+        mins[i] = UINT64_MAX;
+    }
+
+    if (len >= LSH_SHINGLE)
+    {
+        for (size_t i = 0; i + LSH_SHINGLE <= len; i++)
+        {
+            uint64_t w;
+            memcpy(&w, buf + i, LSH_SHINGLE);
+            bin_add(mins, shingle_hash(w));
+        }
+    }
+    else
+    {
+        /* too short for a shingle: it's one as a whole */
+        bin_add(mins, shingle_hash(hash_bytes(buf, len)));
+    }
+
+    /* small files leave bins empty: each one takes
+     * the value of the next full one, shifted */
+    uint64_t dense[LSH_HASHES];
+    for (int i = 0; i < LSH_HASHES; i++)
+    {
+        int d = 0;
+        while (mins[(i + d) % LSH_HASHES] == UINT64_MAX)
+        {
+            d++;
+        }
+        dense[i] = mins[(i + d) % LSH_HASHES] + (uint64_t) d * DENSIFY_STEP;
+    }
+
+    for (int b = 0; b < LSH_BANDS; b++)
+    {
+        keys->band[b] = (uint32_t) hash_bytes((const char*) &dense[b * LSH_ROWS], LSH_ROWS * sizeof(uint64_t));
+    }
+}
+
+
+static void* lsh_reader(void* arg)
+{
+    lsh_job* job = (lsh_job*) arg;
+    char path[PATH_MAX];
+
+    size_t i;
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->n)
+    {
+        lsh_file* f = &job->files[i];
+        const char* buf = NULL;
+        size_t size = 0;
+
+        /* gone since the walk: left out */
+        if ((size_t) snprintf(path, sizeof(path), "%s/%s", job->root, f->name) >= sizeof(path)
+            || file_map(path, &buf, &size) != 0)
+        {
+            free(f->name);
+            f->name = NULL;
+            continue;
+        }
+
+        lsh_compute(buf, size, &f->keys);
+        file_unmap(buf, size);
+    }
+
+    return NULL;
+}
+
+
+static int pair_cmp(const void* a, const void* b)
+{
+    const lsh_pair* p1 = (const lsh_pair*) a;
+    const lsh_pair* p2 = (const lsh_pair*) b;
+
+    if (p1->key != p2->key)
+    {
+        return p1->key < p2->key ? -1 : 1;
+    }
+
+    return p1->file < p2->file ? -1 : p1->file > p2->file;
+}
+
+
+/* writes the index of the files to file */
+static int lsh_write(const char* file, const lsh_file* files, size_t n)
+{
+    lsh_pair* pairs = malloc((n ? n : 1) * sizeof(lsh_pair));
+    if (!pairs)
+    {
+        return -1;
+    }
+
+    char tmp[PATH_MAX];
+    FILE* f = file_replace_open(file, tmp);
+    if (!f)
+    {
+        free(pairs);
+        return -1;
+    }
+
+    lsh_header h;
+    memcpy(h.magic, LSH_MAGIC, LSH_MAGIC_LEN);
+    h.bands = LSH_BANDS;
+    h.n = n;
+    h.namesize = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        h.namesize += strlen(files[i].name);
+    }
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    /* the bands, each sorted by key */
+    for (int b = 0; ok && b < LSH_BANDS; b++)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            pairs[i] = (lsh_pair) {files[i].keys.band[b], (uint32_t) i};
+        }
+        qsort(pairs, n, sizeof(lsh_pair), pair_cmp);
+        ok = fwrite(pairs, sizeof(lsh_pair), n, f) == n;
+    }
+
+    /* then where the names are, and the names */
+    uint64_t off = 0;
+    for (size_t i = 0; ok && i < n; i++)
+    {
+        lsh_name nm = {off, strlen(files[i].name)};
+        off += nm.len;
+        ok = fwrite(&nm, sizeof(nm), 1, f) == 1;
+    }
+    for (size_t i = 0; ok && i < n; i++)
+    {
+        size_t len = strlen(files[i].name);
+        ok = fwrite(files[i].name, 1, len, f) == len;
+    }
+
+    free(pairs);
+
+    return file_replace_commit(f, tmp, file, ok);
+}
+
+
+long lsh_build(const char* dir, int threads)
+{
+    char* root = realpath(dir, NULL);
+    char file[PATH_MAX];
+    if (!root || (size_t) snprintf(file, sizeof(file), "%s/%s", root, LSH_NAME) >= sizeof(file))
+    {
+        free(root);
+        return -1;
+    }
+
+    int nthreads = threads < 1 ? 1 : threads;
+    walk_file* found = NULL;
+    size_t n = 0;
+    int res = walk_collect(root, nthreads, &found, &n);
+
+    lsh_job job;
+    job.root = root;
+    job.files = res == 0 ? malloc((n ? n : 1) * sizeof(lsh_file)) : NULL;
+    job.n = job.files ? n : 0;
+    atomic_init(&job.next, 0);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (job.files)
+            job.files[i].name = found[i].name;
+        else
+            free(found[i].name);
+    }
+    free(found);
+
+    /* the calling thread reads too */
+    pthread_t* tids = job.files ? malloc(nthreads * sizeof(pthread_t)) : NULL;
+    int started = 1;
+    while (tids && started < nthreads && pthread_create(&tids[started], NULL, lsh_reader, &job) == 0)
+    {
+        started++;
+    }
+
+    if (job.files)
+    {
+        lsh_reader(&job);
+    }
+
+    for (int t = 1; tids && t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+    free(root);
+
+    /* the files read, still in name order */
+    n = 0;
+    for (size_t i = 0; i < job.n; i++)
+    {
+        if (job.files[i].name)
+        {
+            job.files[n++] = job.files[i];
+        }
+    }
+
+    if (!job.files || n >= UINT32_MAX || lsh_write(file, job.files, n) != 0)
+    {
+        res = -1;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        free(job.files[i].name);
+    }
+    free(job.files);
+
+    return res == 0 ? (long) n : -1;
+}
+
+
+/* first pair of the band with a key >= key */
+static size_t band_lower(const lsh_pair* band, size_t n, uint32_t key)
+{
+    size_t lo = 0;
+    size_t hi = n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (band[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+
+static int id_cmp(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+
+int lsh_query(const char* dir, const char* buf, size_t len, char*** paths, size_t* n)
+{
+    *paths = NULL;
+    *n = 0;
+
+    char* root = realpath(dir, NULL);
+    char file[PATH_MAX];
+    if (!root || (size_t) snprintf(file, sizeof(file), "%s/%s", root, LSH_NAME) >= sizeof(file))
+    {
+        free(root);
+        return -1;
+    }
+
+    const char* map = NULL;
+    size_t size = 0;
+    if (file_map(file, &map, &size) != 0)
+    {
+        free(root);
+        return -1;
+    }
+
+    /* a whole index of this build */
+    lsh_header h;
+    bool valid = size >= sizeof(h);
+    if (valid)
+    {
+        memcpy(&h, map, sizeof(h));
+        valid = memcmp(h.magic, LSH_MAGIC, LSH_MAGIC_LEN) == 0 && h.bands == LSH_BANDS && h.n < UINT32_MAX
+                && h.n <= (size - sizeof(h)) / (LSH_BANDS * sizeof(lsh_pair) + sizeof(lsh_name))
+                && h.namesize == size - sizeof(h) - h.n * (LSH_BANDS * sizeof(lsh_pair) + sizeof(lsh_name));
+    }
+    if (!valid)
+    {
+        file_unmap(map, size);
+        free(root);
+        return -1;
+    }
+
+    const lsh_pair* bands = (const lsh_pair*) (map + sizeof(h));
+    const lsh_name* names = (const lsh_name*) (bands + LSH_BANDS * h.n);
+    const char* chars = (const char*) (names + h.n);
+
+    lsh_keys keys;
+    lsh_compute(buf, len, &keys);
+
+    /* the files matching a band, with repeats */
+    uint32_t* ids = NULL;
+    size_t nids = 0;
+    size_t cap = 0;
+    int res = 0;
+    for (int b = 0; res == 0 && b < LSH_BANDS; b++)
+    {
+        const lsh_pair* band = bands + b * h.n;
+        for (size_t i = band_lower(band, h.n, keys.band[b]); i < h.n && band[i].key == keys.band[b]; i++)
+        {
+            if (nids == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                uint32_t* p = realloc(ids, cap * sizeof(uint32_t));
+                if (!p)
+                {
+                    res = -1;
+                    break;
+                }
+                ids = p;
+            }
+            ids[nids++] = band[i].file;
+        }
+    }
+
+    qsort(ids, nids, sizeof(uint32_t), id_cmp);
+
+    char** found = malloc((nids ? nids : 1) * sizeof(char*));
+    if (!found)
+    {
+        res = -1;
+    }
+
+    size_t rootlen = strlen(root);
+    for (size_t i = 0; res == 0 && i < nids; i++)
+    {
+        if ((i > 0 && ids[i] == ids[i - 1]) || ids[i] >= h.n)
+        {
+            continue;
+        }
+
+        const lsh_name* nm = &names[ids[i]];
+        if (nm->name > h.namesize || nm->len > h.namesize - nm->name)
+        {
+            continue;
+        }
+
+        char* p = malloc(rootlen + 1 + nm->len + 1);
+        if (!p)
+        {
+            res = -1;
+            break;
+        }
+        memcpy(p, root, rootlen);
+        p[rootlen] = '/';
+        memcpy(p + rootlen + 1, chars + nm->name, nm->len);
+        p[rootlen + 1 + nm->len] = '\0';
+        found[(*n)++] = p;
+    }
+
+    free(ids);
+    file_unmap(map, size);
+    free(root);
+
+    if (res != 0)
+    {
+        lsh_free_paths(found, *n);
+        *n = 0;
+        return -1;
+    }
+
+    *paths = found;
+
+    return 0;
+}
+
+
+void lsh_free_paths(char** paths, size_t n)
+{
+    for (size_t i = 0; paths && i < n; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+}
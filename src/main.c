@@ -28,7 +28,15 @@
 #include "../include/distance.h"
 #include "../include/script.h"
 #include "../include/apply.h"
+#include "../include/script_ops.h"
 #include "../include/search.h"
+#include "../include/tokens.h"
+#include "../include/distcache.h"
+#include "../include/lsh.h"
+#include "../include/vptree.h"
+#include "../include/allpairs.h"
+#include "../include/cluster.h"
+#include "../include/util.h"
 
 
 char* NUMARGS  = "ERROR: Wrong number of arguments.      \n";
@@ -36,15 +44,44 @@ char* CANTSAVE = "ERROR: Can't save the output file.     \n";
 char* CANTOPEN = "ERROR: Can't open the file(s).         \n";
 char* ONEARG   = "ERROR: Expected at least one argument  \n";
 char* NODIGIT  = "ERROR: No digits were found.           \n";
+char* CORRUPTD = "ERROR: Script(s) invalid or corrupted. \n";
+char* BADUNIT  = "ERROR: Unit must be byte, line or word.\n";
+char* UNITBYTE = "ERROR: Edit scripts work on bytes only.\n";
+char* BADK     = "ERROR: k must be at least 1.           \n";
+char* NOCACHE  = "WARNING: Can't open the cache, ignored.\n";
 char* NOTVALID = "ERROR: Command %s not valid.         \n\n";
 char* DIDUMEAN = "Command not correct, did you mean '%s'?\n";
 char* ABORT    = "\nSIGINT received. Stop.               \n";
 
 
 void parse_int_or_fail(const char* str, long* v);
+void parse_options(int* argc, char** argv);
 bool hint_didumean(const char* command);
 
 
+/* --threads, one per cpu granted to us if not given */
+long threads = 0;
+
+/* --script, for apply-batch */
+char* batchScript = NULL;
+
+/* --unit, for distances and searches */
+unit_t unit = UNIT_BYTE;
+
+/* --index, --lsh, --exact and --tree, for searches */
+bool useIndex = false;
+bool useLsh = false;
+bool exact = false;
+bool useTree = false;
+
+/* --sparse, for allpairs */
+bool sparse = false;
+
+/* --cache and --cache-size in MB, for distances and searches */
+char* cacheFile = NULL;
+long cacheMB = 0;
+
+
 void abort_handler()
 {
     /* it's not advisable to call printf inside an interrupt handler */
@@ -69,10 +106,36 @@ void print_usage()
     printf("                                                             \n");
     printf("Usage: filedistance distance file1 file2 [output]            \n");
     printf("       filedistance apply inputfile filem outputfile         \n");
+    printf("       filedistance apply-batch [--script filem] manifest    \n");
+    printf("       filedistance compose filem1 filem2 [...] outputfile   \n");
+    printf("       filedistance invert inputfile filem outputfile        \n");
     printf("       filedistance search inputfile dir                     \n");
     printf("       filedistance searchall inputfile dir limit            \n");
+    printf("       filedistance searchk inputfile dir k                  \n");
+    printf("       filedistance lsh-index dir                            \n");
+    printf("       filedistance build-index dir                          \n");
+    printf("       filedistance allpairs dir output [limit]              \n");
+    printf("       filedistance cluster dir threshold                    \n");
     printf("       filedistance help                                     \n");
     printf("                                                             \n");
+    printf("Options: --threads n  threads for edit scripts, apply-batch  \n");
+    printf("                      and searches (default: one per cpu)    \n");
+    printf("         --unit u     byte, line or word: what distance and  \n");
+    printf("                      searches count (default: byte)         \n");
+    printf("         --index      searches keep the files' signatures in \n");
+    printf("                      dir/.filedistance.idx, read next time  \n");
+    printf("         --lsh        searches compare the near duplicates   \n");
+    printf("                      found by dir's lsh-index only          \n");
+    printf("         --exact      with --lsh: they only bound the search \n");
+    printf("                      of all the files                       \n");
+    printf("         --tree       searches answer from dir's build-index,\n");
+    printf("                      comparing only the files it can't skip \n");
+    printf("         --sparse     allpairs writes the pairs within the   \n");
+    printf("                      limit only                             \n");
+    printf("         --cache f    keep the distances computed in f, for  \n");
+    printf("                      any file with the same contents        \n");
+    printf("         --cache-size n  MB of a new cache (default: 64)     \n");
+    printf("                                                             \n");
 }
 
 
@@ -83,6 +146,26 @@ int main(int argc, char** argv)
     /* handle SIGINT */
     signal(SIGINT, abort_handler);
 
+    parse_options(&argc, argv);
+    if (threads <= 0)
+    {
+        threads = cpu_count();
+    }
+
+    /* the distances go without it if it can't be opened */
+    if (cacheFile)
+    {
+        size_t bytes = cacheMB > 0 ? (size_t) cacheMB << 20 : DISTCACHE_DEFAULT_BYTES;
+        if (distcache_open(cacheFile, bytes) == 0)
+        {
+            atexit(distcache_close);
+        }
+        else
+        {
+            fprintf(stderr, "%s", NOCACHE);
+        }
+    }
+
     if (argc < 2)
     {
         printf("%s", ONEARG);
@@ -90,13 +173,15 @@ int main(int argc, char** argv)
         return -1;
     }
 
+    search_opts opts = {unit, (int) threads, useIndex, useLsh, exact, useTree};
+
     if (strcmp(argv[1], "distance") == 0)
     {
         /* distance file1 file2 */
         if (argc == 4)
         {
             clock_t begin = clock();
-                int result = distance_file(argv[2], argv[3]);
+                long result = tokens_file_distance(argv[2], argv[3], unit);
             clock_t end = clock();
 
             if (result < 0)
@@ -105,7 +190,7 @@ int main(int argc, char** argv)
                 return -1;
             }
 
-            printf("EDIT DISTANCE: %d\n", result);
+            printf("EDIT DISTANCE: %ld\n", result);
             printf("TIME: %f\n", ((double)(end - begin)) / CLOCKS_PER_SEC);
             return 0;
         }
@@ -113,13 +198,19 @@ int main(int argc, char** argv)
         /* distance file1 file2 output */
         else if (argc == 5)
         {
-            int ret = script_file_distance(argv[2], argv[3], argv[4]);
+            if (unit != UNIT_BYTE)
+            {
+                printf("%s", UNITBYTE);
+                return -1;
+            }
+
+            long ret = script_file_distance(argv[2], argv[3], argv[4], (int) threads);
             if (ret < 0)
             {
                 printf("%s", CANTSAVE);
                 return -1;
             }
-            printf("DISTANCE: %d\n", ret);
+            printf("DISTANCE: %ld\n", ret);
             printf("Edit script saved successfully: %s\n", argv[4]);
             return 0;
         }
@@ -154,12 +245,91 @@ int main(int argc, char** argv)
         }
     }
 
+    else if (strcmp(argv[1], "apply-batch") == 0)
+    {
+        /* apply-batch manifest */
+        if (argc == 3)
+        {
+            return apply_batch(argv[2], batchScript, (int) threads) == 0 ? 0 : -1;
+        }
+        else
+        {
+            printf("%s", NUMARGS);
+            print_usage();
+            return -1;
+        }
+    }
+
+    else if (strcmp(argv[1], "compose") == 0)
+    {
+        /* compose filem1 filem2 [...] outputfile */
+        if (argc >= 5)
+        {
+            int ret = script_compose_files(argv + 2, argc - 3, argv[argc - 1]);
+            if (ret == -1)
+            {
+                printf("%s", CANTOPEN);
+                return -1;
+            }
+            else if (ret == -2)
+            {
+                printf("%s", CORRUPTD);
+                return -1;
+            }
+            else if (ret == -3)
+            {
+                printf("%s", CANTSAVE);
+                return -1;
+            }
+            printf("Edit script saved successfully: %s\n", argv[argc - 1]);
+            return 0;
+        }
+        else
+        {
+            printf("%s", NUMARGS);
+            print_usage();
+            return -1;
+        }
+    }
+
+    else if (strcmp(argv[1], "invert") == 0)
+    {
+        /* invert inputfile filem outputfile */
+        if (argc == 5)
+        {
+            int ret = script_invert_file(argv[2], argv[3], argv[4]);
+            if (ret == -1)
+            {
+                printf("%s", CANTOPEN);
+                return -1;
+            }
+            else if (ret == -2)
+            {
+                printf("%s", CORRUPTD);
+                return -1;
+            }
+            else if (ret == -3)
+            {
+                printf("%s", CANTSAVE);
+                return -1;
+            }
+            printf("Edit script saved successfully: %s\n", argv[4]);
+            return 0;
+        }
+        else
+        {
+            printf("%s", NUMARGS);
+            print_usage();
+            return -1;
+        }
+    }
+
     else if (strcmp(argv[1], "search") == 0)
     {
         /* search inputfile dir */
         if (argc == 4)
         {
-            search_min(argv[2], argv[3]);
+            search_min(argv[2], argv[3], &opts);
             return 0;
         }
         else
@@ -177,7 +347,135 @@ int main(int argc, char** argv)
         {
             long limit = 0;
             parse_int_or_fail(argv[4], &limit);
-            search_all(argv[2], argv[3], limit);
+            search_all(argv[2], argv[3], limit, &opts);
+            return 0;
+        }
+        else
+        {
+            printf("%s", NUMARGS);
+            print_usage();
+            return -1;
+        }
+    }
+
+    else if (strcmp(argv[1], "searchk") == 0)
+    {
+        /* searchk inputfile dir k */
+        if (argc == 5)
+        {
+            long k = 0;
+            parse_int_or_fail(argv[4], &k);
+            if (k < 1)
+            {
+                fprintf(stderr, "%s", BADK);
+                return -1;
+            }
+            search_k(argv[2], argv[3], k, &opts);
+            return 0;
+        }
+        else
+        {
+            printf("%s", NUMARGS);
+            print_usage();
+            return -1;
+        }
+    }
+
+    else if (strcmp(argv[1], "lsh-index") == 0)
+    {
+        /* lsh-index dir */
+        if (argc == 3)
+        {
+            long n = lsh_build(argv[2], (int) threads);
+            if (n < 0)
+            {
+                printf("%s", CANTSAVE);
+                return -1;
+            }
+            printf("LSH index saved: %ld files\n", n);
+            return 0;
+        }
+        else
+        {
+            printf("%s", NUMARGS);
+            print_usage();
+            return -1;
+        }
+    }
+
+    else if (strcmp(argv[1], "build-index") == 0)
+    {
+        /* build-index dir */
+        if (argc == 3)
+        {
+            long n = vptree_build(argv[2], unit, (int) threads);
+            if (n < 0)
+            {
+                printf("%s", CANTSAVE);
+                return -1;
+            }
+            printf("Tree index saved: %ld files\n", n);
+            return 0;
+        }
+        else
+        {
+            printf("%s", NUMARGS);
+            print_usage();
+            return -1;
+        }
+    }
+
+    else if (strcmp(argv[1], "allpairs") == 0)
+    {
+        /* allpairs dir output [limit] */
+        if (argc == 4 || argc == 5)
+        {
+            long limit = -1;
+            if (argc == 5)
+            {
+                parse_int_or_fail(argv[4], &limit);
+            }
+
+            filter_stats stats;
+            long n = allpairs_run(argv[2], argv[3], unit, limit, sparse, (int) threads, &stats);
+
+            if (n < 0)
+            {
+                printf("%s", CANTSAVE);
+                return -1;
+            }
+
+            printf("Matrix saved: %ld files\n", n);
+            filter_print_stats(&stats, stderr);
+            return 0;
+        }
+        else
+        {
+            printf("%s", NUMARGS);
+            print_usage();
+            return -1;
+        }
+    }
+
+    else if (strcmp(argv[1], "cluster") == 0)
+    {
+        /* cluster dir threshold */
+        if (argc == 4)
+        {
+            long threshold = 0;
+            parse_int_or_fail(argv[3], &threshold);
+
+            filter_stats stats;
+            cluster_stats cstats;
+            if (cluster_run(argv[2], threshold, unit, (int) threads, &stats, &cstats) != 0)
+            {
+                printf("%s", CANTOPEN);
+                return -1;
+            }
+
+            fprintf(stderr, "CLUSTERS: %zu of %zu files. TOGETHER: %lu pairs skipped\n", cstats.clusters,
+                    cstats.files, cstats.together);
+            filter_print_stats(&stats, stderr);
             return 0;
         }
         else
@@ -217,10 +515,11 @@ bool hint_didumean(const char* command)
     size_t lencmd = strlen(command);
     if (lencmd != 0)
     {
-        char cmds[][9] = {"distance", "search", "apply", "searchall"};
-        for (int i = 0; i < 4; i++)
+        char cmds[][12] = {"distance", "search", "apply", "searchall", "apply-batch", "compose", "invert", "searchk",
+                           "lsh-index", "build-index", "allpairs", "cluster"};
+        for (int i = 0; i < 12; i++)
         {
-            int dist = distance_string(cmds[i], strlen(cmds[i]), command, lencmd);
+            long dist = distance_string(cmds[i], strlen(cmds[i]), command, lencmd);
             if (dist > 0 && dist <= 2)
             {
                 printf(DIDUMEAN, cmds[i]);
@@ -252,4 +551,82 @@ void parse_int_or_fail(const char* str, long* v)
     }
 
     *v = val;
-}
\ No newline at end of file
+}
+
+
+void parse_options(int* argc, char** argv)
+{
+    /* options can be anywhere, they are taken
+     * out of argv leaving the command and its arguments */
+    int k = 1;
+    for (int i = 1; i < *argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < *argc)
+        {
+            parse_int_or_fail(argv[++i], &threads);
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            parse_int_or_fail(argv[i] + 10, &threads);
+        }
+        else if (strcmp(argv[i], "--script") == 0 && i + 1 < *argc)
+        {
+            batchScript = argv[++i];
+        }
+        else if (strncmp(argv[i], "--script=", 9) == 0)
+        {
+            batchScript = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "--index") == 0)
+        {
+            useIndex = true;
+        }
+        else if (strcmp(argv[i], "--lsh") == 0)
+        {
+            useLsh = true;
+        }
+        else if (strcmp(argv[i], "--exact") == 0)
+        {
+            exact = true;
+        }
+        else if (strcmp(argv[i], "--tree") == 0)
+        {
+            useTree = true;
+        }
+        else if (strcmp(argv[i], "--sparse") == 0)
+        {
+            sparse = true;
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < *argc)
+        {
+            cacheFile = argv[++i];
+        }
+        else if (strncmp(argv[i], "--cache=", 8) == 0)
+        {
+            cacheFile = argv[i] + 8;
+        }
+        else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < *argc)
+        {
+            parse_int_or_fail(argv[++i], &cacheMB);
+        }
+        else if (strncmp(argv[i], "--cache-size=", 13) == 0)
+        {
+            parse_int_or_fail(argv[i] + 13, &cacheMB);
+        }
+        else if ((strcmp(argv[i], "--unit") == 0 && i + 1 < *argc) || strncmp(argv[i], "--unit=", 7) == 0)
+        {
+            const char* name = argv[i][6] == '=' ? argv[i] + 7 : argv[++i];
+            if (unit_parse(name, &unit) != 0)
+            {
+                fprintf(stderr, "%s", BADUNIT);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else
+        {
+            argv[k++] = argv[i];
+        }
+    }
+
+    *argc = k;
+}
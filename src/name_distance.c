@@ -22,5 +22,5 @@
 
 void namedistance_print(name_distance* nd)
 {
-    printf("%d %s\n", nd->distance, nd->filename);
+    printf("%ld %s\n", nd->distance, nd->filename);
 }
\ No newline at end of file
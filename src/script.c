@@ -17,296 +17,417 @@
 
 #include <stdlib.h> // malloc, free
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>  // uint16_t, uint32_t
+#include <pthread.h>
 
 #include "../include/script.h"
+#include "../include/script_io.h"
 #include "../include/util.h"
-#include "../include/endianness.h"
 
 
-void script_print_edit(const edit* e, FILE* outfile)
+/* below this many cells the matrix is filled whole */
+#define SCRIPT_MATRIX_CELLS (1 << 16)
+
+/* below this many cells a split isn't worth a thread */
+#define SCRIPT_SERIAL_CELLS ((size_t) 1 << 26)
+
+
+/* edits found so far, in input order */
+typedef struct
+{
+    edit* edits;
+    size_t len;
+    size_t cap;
+} edit_buf;
+
+
+/* the two strings and their reversed copies */
+typedef struct
 {
-    switch (e->operation)
+    const char* s1;
+    const char* s2;
+    char* r1;
+    char* r2;
+    size_t len1;
+    size_t len2;
+} script_ctx;
+
+
+static int edit_push(edit_buf* buf, op_type op, size_t position, char c)
+{
+    if (buf->len == buf->cap)
     {
-        case ADD:
-        {
-            const char op[] = "ADD";
-            unsigned int n = htonl(e->position);
-            char b = e->c;
-            fwrite(op, sizeof(char), sizeof(op) - 1, outfile);
-            fwrite(&n, sizeof(unsigned int), 1, outfile);
-            fwrite(&b, 1, 1, outfile);
-            break;
-        }
-        case DEL:
+        size_t cap = buf->cap ? buf->cap * 2 : 64;
+        edit* edits = realloc(buf->edits, cap * sizeof(edit));
+        if (!edits)
         {
-            const char op[] = "DEL";
-            unsigned int n = htonl(e->position);
-            char b = ' ';
-            fwrite(op, sizeof(char), sizeof(op) - 1, outfile);
-            fwrite(&n, sizeof(unsigned int), 1, outfile);
-            fwrite(&b, 1, 1, outfile);
-            break;
-        }
-        case SET:
-        {
-            const char op[] = "SET";
-            unsigned int n = htonl(e->position);
-            char b = e->c;
-            fwrite(op, sizeof(char), sizeof(op) - 1, outfile);
-            fwrite(&n, sizeof(unsigned int), 1, outfile);
-            fwrite(&b, 1, 1, outfile);
-            break;
+            return -1;
         }
 
-        default:
-            return;
+        buf->edits = edits;
+        buf->cap = cap;
     }
+
+    edit* e = &buf->edits[buf->len++];
+    e->operation = op;
+    e->position = position;
+    e->c = c;
+
+    return 0;
+}
+
+
+/* Textbook Wagner-Fischer with full dynamic-programming matrix,
+ * for the pieces small enough (or thin enough) to afford it.
+ * s1 starts at byte i0 of the input, the edits are appended to out.
+ * Generated for cells of each width, the narrowest one holding the
+ * longer length is used: small pieces then fit in the cache. */
+#define DEFINE_SCRIPT_MATRIX(NAME, CELL_T)                                                                    \
+static int NAME(const char* s1, size_t m, const char* s2, size_t n, size_t i0, edit_buf* out)                 \
+{                                                                                                             \
+    size_t w = n + 1;                                                                                         \
+    CELL_T* d = malloc((m + 1) * w * sizeof(CELL_T));                                                         \
+    if (!d)                                                                                                   \
+    {                                                                                                         \
+        return -1;                                                                                            \
+    }                                                                                                         \
+                                                                                                              \
+    for (size_t i = 0; i <= m; i++)                                                                           \
+    {                                                                                                         \
+        d[i * w] = (CELL_T) i;                                                                                \
+    }                                                                                                         \
+    for (size_t j = 0; j <= n; j++)                                                                           \
+    {                                                                                                         \
+        d[j] = (CELL_T) j;                                                                                    \
+    }                                                                                                         \
+                                                                                                              \
+    for (size_t i = 1; i <= m; i++)                                                                           \
+    {                                                                                                         \
+        for (size_t j = 1; j <= n; j++)                                                                       \
+        {                                                                                                     \
+            CELL_T add = (CELL_T) (d[i * w + j - 1] + 1);                                                     \
+            CELL_T del = (CELL_T) (d[(i - 1) * w + j] + 1);                                                   \
+            CELL_T set = (CELL_T) (d[(i - 1) * w + j - 1] + (s1[i - 1] != s2[j - 1]));                        \
+                                                                                                              \
+            d[i * w + j] = add < del ? (add < set ? add : set) : (del < set ? del : set);                     \
+        }                                                                                                     \
+    }                                                                                                         \
+                                                                                                              \
+    /* walk back from the end preferring DEL, then ADD, then SET/NOP,                                         \
+     * but keeping on with the last edit while it is among the best ones                                      \
+     * so that edits come in runs; edits come out reversed */                                                 \
+    size_t start = out->len;                                                                                  \
+    size_t i = m;                                                                                             \
+    size_t j = n;                                                                                             \
+    op_type last = NOP;                                                                                       \
+                                                                                                              \
+    while (i > 0 || j > 0)                                                                                    \
+    {                                                                                                         \
+        CELL_T best = d[i * w + j];                                                                           \
+                                                                                                              \
+        bool del = i > 0 && (CELL_T) (d[(i - 1) * w + j] + 1) == best;                                        \
+        bool add = j > 0 && (i == 0 || (CELL_T) (d[i * w + j - 1] + 1) == best);                              \
+        bool set = i > 0 && j > 0 && s1[i - 1] != s2[j - 1] && (CELL_T) (d[(i - 1) * w + j - 1] + 1) == best; \
+                                                                                                              \
+        op_type op;                                                                                           \
+        if ((last == ADD && add) || (last == SET && set))                                                     \
+            op = last;                                                                                        \
+        else if (del)                                                                                         \
+            op = DEL;                                                                                         \
+        else if (add)                                                                                         \
+            op = ADD;                                                                                         \
+        else                                                                                                  \
+            op = set ? SET : NOP;                                                                             \
+                                                                                                              \
+        if (op == DEL)                                                                                        \
+        {                                                                                                     \
+            if (edit_push(out, DEL, i0 + i - 1, ' ') != 0)                                                    \
+                break;                                                                                        \
+            i--;                                                                                              \
+        }                                                                                                     \
+        else if (op == ADD)                                                                                   \
+        {                                                                                                     \
+            if (edit_push(out, ADD, i0 + i - 1, s2[j - 1]) != 0)                                              \
+                break;                                                                                        \
+            j--;                                                                                              \
+        }                                                                                                     \
+        else                                                                                                  \
+        {                                                                                                     \
+            if (op == SET && edit_push(out, SET, i0 + i - 1, s2[j - 1]) != 0)                                 \
+                break;                                                                                        \
+            i--;                                                                                              \
+            j--;                                                                                              \
+        }                                                                                                     \
+                                                                                                              \
+        last = op;                                                                                            \
+    }                                                                                                         \
+                                                                                                              \
+    free(d);                                                                                                  \
+                                                                                                              \
+    if (i > 0 || j > 0)                                                                                       \
+    {                                                                                                         \
+        return -1;                                                                                            \
+    }                                                                                                         \
+                                                                                                              \
+    /* back to input order */                                                                                 \
+    for (size_t l = start, r = out->len; l + 1 < r; l++, r--)                                                 \
+    {                                                                                                         \
+        edit tmp = out->edits[l];                                                                             \
+        out->edits[l] = out->edits[r - 1];                                                                    \
+        out->edits[r - 1] = tmp;                                                                              \
+    }                                                                                                         \
+                                                                                                              \
+    return 0;                                                                                                 \
 }
 
+DEFINE_SCRIPT_MATRIX(script_matrix_c16, uint16_t)
+DEFINE_SCRIPT_MATRIX(script_matrix_c32, uint32_t)
+DEFINE_SCRIPT_MATRIX(script_matrix_c64, uint64_t)
+
 
-unsigned int levenshtein_fill_matrix(edit** matrix, const char* s1, size_t m, const char* s2, size_t n)
+static int script_matrix(const char* s1, size_t m, const char* s2, size_t n, size_t i0, edit_buf* out)
 {
-    /* textbook Wagner-Fischer algorithm with full
-     * dynamic-programming matrix.
-     * Operations are set inside the matrix for clarity.
-     * Instead of saving the costs only,
-     * an edit struct is saved per cell, making it easier
-     * to retrieve the information later. */
-
-    for (int j = 1; j <= n; j++)
-    {
-        for (int i = 1; i <= m; i++)
-        {
-            int set_cost;
-            int add = 0, del = 0, set = 0;
-            int best = 0;
-
-            if (s1[i - 1] == s2[j - 1])
-            {
-                set_cost = 0;
-            }
-            else
-            {
-                set_cost = 1;
-            }
-
-            add = matrix[i][j - 1].score + 1;
-            del = matrix[i - 1][j].score + 1;
-            set = matrix[i - 1][j - 1].score + set_cost;
-
-            best = minmin(add, del, set);
-
-            matrix[i][j].score = best;
-            matrix[i][j].position = i - 1;
-            matrix[i][j].c = s2[j - 1];
-
-            if (best == del)
-            {
-                matrix[i][j].operation = DEL;
-            }
-            else if (best == add)
-            {
-                matrix[i][j].operation = ADD;
-            }
-            else
-            {
-                if (set_cost > 0)
-                {
-                    matrix[i][j].operation = SET;
-                }
-                else
-                {
-                    matrix[i][j].operation = NOP;
-                }
-            }
-        }
-    }
+    size_t len = m > n ? m : n;
+
+    if (len < UINT16_MAX)
+        return script_matrix_c16(s1, m, s2, n, i0, out);
+    if (len < UINT32_MAX)
+        return script_matrix_c32(s1, m, s2, n, i0, out);
 
-    return matrix[m][n].score;
+    return script_matrix_c64(s1, m, s2, n, i0, out);
 }
 
 
-edit** levenshtein_create_matrix(size_t l1, size_t l2)
+/* bwd column of a split, computed next to the fwd one */
+typedef struct
 {
-    edit** matrix = malloc((l1 + 1) * sizeof(edit*));
-    if (matrix == NULL)
-    {
-        return NULL;
-    }
+    const char* s1;
+    size_t len1;
+    const char* s2;
+    size_t len2;
+    long* col;
+    int threads;
+    int ret;
+} prefix_task;
+
+
+/* second half of a split, solved next to the first one */
+typedef struct
+{
+    const script_ctx* ctx;
+    size_t i0;
+    size_t i1;
+    size_t j0;
+    size_t j1;
+    int threads;
+    edit_buf out;
+    int ret;
+} half_task;
 
-    for (int i = 0; i <= l1; i++)
-    {
-        matrix[i] = malloc((l2 + 1) * sizeof(edit));
-        if (matrix[i] == NULL)
-        {
-            for (int j = 0; j < i; j++)
-            {
-                free(matrix[j]);
-            }
 
-            free(matrix);
-            matrix = NULL;
+static int script_hirschberg(const script_ctx* ctx, size_t i0, size_t i1, size_t j0, size_t j1,
+                             int threads, edit_buf* out);
 
-            return NULL;
-        }
-    }
 
-    for (int i = 0; i <= l1; i++)
-    {
-        matrix[i][0].score = i;
-        matrix[i][0].c = 0;
-    }
+static void* prefix_task_run(void* arg)
+{
+    prefix_task* t = (prefix_task*) arg;
+    t->ret = distance_prefixes(t->s1, t->len1, t->s2, t->len2, t->col, t->threads);
+    return NULL;
+}
+
+
+static void* half_task_run(void* arg)
+{
+    half_task* t = (half_task*) arg;
+    t->ret = script_hirschberg(t->ctx, t->i0, t->i1, t->j0, t->j1, t->threads, &t->out);
+    return NULL;
+}
+
 
-    for (int j = 0; j <= l2; j++)
+/* runs f(arg) on a new thread if threads allow, on this one otherwise.
+ * Returns true if a thread was started and has to be joined */
+static bool script_spawn(pthread_t* tid, void* (*f)(void*), void* arg, int threads)
+{
+    if (threads > 0 && pthread_create(tid, NULL, f, arg) == 0)
     {
-        matrix[0][j].score = j;
-        matrix[0][j].c = 0;
+        return true;
     }
 
-    return matrix;
+    f(arg);
+    return false;
 }
 
 
-int script_string_distance(const char* str1, size_t len1, const char* str2, size_t len2, edit** script)
+/* Hirschberg's divide and conquer on s1[i0, i1) and s2[j0, j1): the
+ * distances from the start to the middle column and from the end back
+ * to it tell which row an optimal path crosses it at, the two halves
+ * are then solved on their own. Only two columns are kept at a time.
+ * Above SCRIPT_SERIAL_CELLS the two columns, and then the two halves,
+ * are computed side by side, threads being shared among them; the
+ * splits, and so the script, are the same as with one thread. */
+static int script_hirschberg(const script_ctx* ctx, size_t i0, size_t i1, size_t j0, size_t j1,
+                             int threads, edit_buf* out)
 {
-    unsigned int dist;
+    size_t m = i1 - i0;
+    size_t n = j1 - j0;
 
-    if (len1 == 0)
+    if (m <= 1 || n <= 1 || (m + 1) * (n + 1) <= SCRIPT_MATRIX_CELLS)
     {
-        return len2;
+        return script_matrix(ctx->s1 + i0, m, ctx->s2 + j0, n, i0, out);
     }
-    if (len2 == 0)
+
+    if (m * n < SCRIPT_SERIAL_CELLS)
     {
-        return len1;
+        threads = 1;
     }
 
-    edit** matrix = levenshtein_create_matrix(len1, len2);
-    if (!matrix)
+    size_t jm = j0 + n / 2;
+
+    long* fwd = malloc((m + 1) * sizeof(long));
+    long* bwd = malloc((m + 1) * sizeof(long));
+    if (!fwd || !bwd)
     {
-        *script = NULL;
-        return 0;
+        free(fwd);
+        free(bwd);
+        return -1;
     }
 
-    dist = levenshtein_fill_matrix(matrix, str1, len1, str2, len2);
+    /* fwd[i]: s1[i0, i0 + i) to s2[j0, jm),
+     * bwd[i]: s1[i1 - i, i1) to s2[jm, j1), on the reversed strings */
+    prefix_task bt = {ctx->r1 + (ctx->len1 - i1), m, ctx->r2 + (ctx->len2 - j1), j1 - jm, bwd, threads / 2, 0};
 
-    *script = malloc(dist * sizeof(edit));
-    if (!(*script))
+    pthread_t tid;
+    bool joined = script_spawn(&tid, prefix_task_run, &bt, threads / 2);
+    int ret = distance_prefixes(ctx->s1 + i0, m, ctx->s2 + j0, jm - j0, fwd, threads - threads / 2);
+    if (joined)
     {
-        dist = 0;
+        pthread_join(tid, NULL);
     }
-    else
+
+    if (ret != 0 || bt.ret != 0)
     {
-        unsigned int p = dist - 1;
-        int i = len1;
-        int j = len2;
-        edit* curr = &matrix[i][j];
-        while (i >= 0 || j >= 0)
+        free(fwd);
+        free(bwd);
+        return -1;
+    }
+
+    size_t im = 0;
+    long best = fwd[0] + bwd[m];
+    for (size_t i = 1; i <= m; i++)
+    {
+        if (fwd[i] + bwd[m - i] < best)
         {
-            switch (curr->operation)
-            {
-                case ADD:
-                {
-                    memcpy(*script + p, curr, sizeof(edit));
-                    p--;
-
-                    curr = &matrix[i][--j];
-                    break;
-                }
-                case DEL:
-                {
-                    memcpy(*script + p, curr, sizeof(edit));
-                    p--;
-
-                    curr = &matrix[--i][j];
-                    break;
-                }
-                default:
-                {
-                    if (curr->operation == NOP)
-                    {
-                        curr = &matrix[--i][--j];
-                        continue;
-                    }
-                    memcpy(*script + p, curr, sizeof(edit));
-                    p--;
-
-                    curr = &matrix[--i][--j];
-                    break;
-                }
-            }
+            best = fwd[i] + bwd[m - i];
+            im = i;
         }
     }
 
-    /* free matrix's inner arrays */
-    for (int i = 0; i <= len1; i++)
+    free(fwd);
+    free(bwd);
+
+    /* threads go to the halves in proportion to their cells */
+    int tr = (int) ((double) threads * (double) ((m - im) * (j1 - jm)) / (double) (m * n));
+    tr = tr < 1 ? 1 : tr;
+    tr = tr > threads - 1 ? threads - 1 : tr;
+
+    half_task right = {ctx, i0 + im, i1, jm, j1, tr, {NULL, 0, 0}, 0};
+
+    joined = script_spawn(&tid, half_task_run, &right, threads > 1 ? tr : 0);
+    ret = script_hirschberg(ctx, i0, i0 + im, j0, jm, threads > 1 ? threads - tr : 1, out);
+    if (joined)
     {
-        free(matrix[i]);
+        pthread_join(tid, NULL);
     }
 
-    /* free matrix */
-    free(matrix);
-    matrix = NULL;
+    /* the right half's edits follow the left one's */
+    for (size_t e = 0; ret == 0 && right.ret == 0 && e < right.out.len; e++)
+    {
+        edit* r = &right.out.edits[e];
+        ret = edit_push(out, r->operation, r->position, r->c);
+    }
+    free(right.out.edits);
 
-    return dist;
+    return ret == 0 && right.ret == 0 ? 0 : -1;
 }
 
 
-int append_script_file(const char* file, edit* script, size_t len)
+static char* reversed(const char* str, size_t len)
 {
-    FILE* f = fopen(file, "w");
-    if (f)
+    char* r = malloc(len + 1);
+    if (r)
     {
-        for (int i = 0; i < len; i++)
+        for (size_t i = 0; i < len; i++)
         {
-            script_print_edit(&script[i], f);
+            r[i] = str[len - 1 - i];
         }
-        return 0;
+    }
+
+    return r;
+}
+
+
+long script_string_distance(const char* str1, size_t len1, const char* str2, size_t len2, edit** script, int threads)
+{
+    *script = NULL;
+
+    script_ctx ctx = {str1, str2, reversed(str1, len1), reversed(str2, len2), len1, len2};
+    edit_buf out = {NULL, 0, 0};
+
+    long dist = -1;
+
+    if (ctx.r1 && ctx.r2 && script_hirschberg(&ctx, 0, len1, 0, len2, threads < 1 ? 1 : threads, &out) == 0)
+    {
+        *script = out.edits;
+        dist = (long) out.len;
     }
     else
     {
-        return -1;
+        free(out.edits);
     }
+
+    free(ctx.r1);
+    free(ctx.r2);
+
+    return dist;
 }
 
 
-int script_file_distance(const char* file1, const char* file2, const char* outfile)
+long script_file_distance(const char* file1, const char* file2, const char* outfile, int threads)
 {
     if (file1 == NULL || file2 == NULL)
     {
         return -1;
     }
 
-    char* buf1 = NULL;
-    char* buf2 = NULL;
-
-    int distance = 0;
-
-    edit* script = NULL;
+    const char* buf1 = NULL;
+    const char* buf2 = NULL;
+    size_t len1 = 0;
+    size_t len2 = 0;
 
-    if (file_load(file1, &buf1) && file_load(file2, &buf2))
-    {
-        //if (strlen(buf1) < strlen(buf2))
-        //{
-        //     distance = script_string_distance(buf2, strlen(buf2), buf1, strlen(buf1), &script);
-        //}
-        distance = script_string_distance(buf1, strlen(buf1), buf2, strlen(buf2), &script);
-    }
-    else
+    if (file_map(file1, &buf1, &len1) != 0 || file_map(file2, &buf2, &len2) != 0)
     {
+        file_unmap(buf1, len1);
         return -1;
     }
 
-    if (append_script_file(outfile, script, distance) < 0)
-    {
-        free(script);
-        script = NULL;
+    edit* script = NULL;
+    long distance = script_string_distance(buf1, len1, buf2, len2, &script, threads);
 
-        return -1;
+    file_unmap(buf1, len1);
+    file_unmap(buf2, len2);
+
+    /* saved as runs */
+    edit_script runs = {0};
+    if (distance < 0 || script_from_edits(script, distance, &runs) != 0 || script_save(&runs, outfile) != 0)
+    {
+        distance = -1;
     }
 
+    script_free(&runs);
     free(script);
     script = NULL;
 
     return distance;
-
-}
\ No newline at end of file
+}
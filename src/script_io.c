@@ -0,0 +1,394 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../include/script_io.h"
+#include "../include/util.h"
+#include "../include/endianness.h"
+
+
+/* v1 record: op, position, byte */
+#define V1_RECORD 8
+
+/* tag of a v2 record */
+#define TAG_OP_BITS 2
+#define TAG_LEN_MAX 63
+
+/* encoder buffer */
+#define WRITER_BUF (1 << 16)
+
+
+/* buffered encoder, every write of a script goes through it */
+typedef struct
+{
+    FILE* f;
+    size_t len;
+    bool failed;
+    unsigned char buf[WRITER_BUF];
+} script_writer;
+
+
+static void writer_flush(script_writer* w)
+{
+    if (w->len > 0 && fwrite(w->buf, 1, w->len, w->f) != w->len)
+    {
+        w->failed = true;
+    }
+    w->len = 0;
+}
+
+
+static void writer_bytes(script_writer* w, const void* p, size_t n)
+{
+    /* long runs go straight to the file */
+    if (n > WRITER_BUF - w->len)
+    {
+        writer_flush(w);
+        if (n >= WRITER_BUF)
+        {
+            if (fwrite(p, 1, n, w->f) != n)
+            {
+                w->failed = true;
+            }
+            return;
+        }
+    }
+
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+}
+
+
+static void writer_varint(script_writer* w, uint64_t v)
+{
+    unsigned char b[10];
+    size_t n = 0;
+
+    do
+    {
+        b[n] = (unsigned char) (v & 0x7F);
+        v >>= 7;
+        if (v)
+        {
+            b[n] |= 0x80;
+        }
+        n++;
+    }
+    while (v);
+
+    writer_bytes(w, b, n);
+}
+
+
+/* reads a varint at *p, not past end. Returns false if it's truncated or too long */
+static bool read_varint(const unsigned char** p, const unsigned char* end, uint64_t* v)
+{
+    *v = 0;
+
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (*p == end)
+        {
+            return false;
+        }
+
+        unsigned char b = *(*p)++;
+        *v |= (uint64_t) (b & 0x7F) << shift;
+        if (!(b & 0x80))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+int script_push(edit_script* s, op_type op, size_t position, const char* bytes, size_t len)
+{
+    /* payload first, runs may point to it */
+    if (op != DEL)
+    {
+        if (s->ndata + len > s->datacap)
+        {
+            size_t cap = s->datacap ? s->datacap : 256;
+            while (cap < s->ndata + len)
+            {
+                cap *= 2;
+            }
+
+            char* data = realloc(s->data, cap);
+            if (!data)
+            {
+                return -1;
+            }
+
+            s->data = data;
+            s->datacap = cap;
+        }
+
+        memcpy(s->data + s->ndata, bytes, len);
+    }
+
+    /* contiguous with the last run: ADDs at the same position,
+     * DELs and SETs right after it */
+    edit_run* last = s->nruns ? &s->runs[s->nruns - 1] : NULL;
+    if (last && last->operation == op
+        && ((op == ADD && position == last->position)
+            || (op != ADD && position == last->position + last->len))
+        && (op == DEL || last->data + last->len == s->ndata))
+    {
+        last->len += len;
+        s->ndata += op == DEL ? 0 : len;
+        return 0;
+    }
+
+    if (s->nruns == s->runcap)
+    {
+        size_t cap = s->runcap ? s->runcap * 2 : 64;
+        edit_run* runs = realloc(s->runs, cap * sizeof(edit_run));
+        if (!runs)
+        {
+            return -1;
+        }
+
+        s->runs = runs;
+        s->runcap = cap;
+    }
+
+    edit_run* r = &s->runs[s->nruns++];
+    r->operation = op;
+    r->position = position;
+    r->len = len;
+    r->data = s->ndata;
+    s->ndata += op == DEL ? 0 : len;
+
+    return 0;
+}
+
+
+int script_from_edits(const edit* edits, size_t len, edit_script* s)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        /* edits insert after their position, runs before it */
+        size_t position = edits[i].operation == ADD ? edits[i].position + 1 : edits[i].position;
+
+        if (script_push(s, edits[i].operation, position, &edits[i].c, 1) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int script_save(const edit_script* s, const char* file)
+{
+    script_writer* w = malloc(sizeof(script_writer));
+    if (!w)
+    {
+        return -1;
+    }
+
+    w->f = fopen(file, "w");
+    w->len = 0;
+    w->failed = false;
+    if (!w->f)
+    {
+        free(w);
+        return -1;
+    }
+
+    writer_bytes(w, SCRIPT_MAGIC, SCRIPT_MAGIC_LEN);
+
+    size_t end = 0;
+    for (size_t i = 0; i < s->nruns; i++)
+    {
+        const edit_run* r = &s->runs[i];
+
+        size_t lencode = r->len < TAG_LEN_MAX ? r->len : TAG_LEN_MAX;
+        unsigned char tag = (unsigned char) ((lencode << TAG_OP_BITS) | r->operation);
+
+        writer_bytes(w, &tag, 1);
+        writer_varint(w, r->position - end);
+        if (lencode == TAG_LEN_MAX)
+        {
+            writer_varint(w, r->len - TAG_LEN_MAX);
+        }
+        if (r->operation != DEL)
+        {
+            writer_bytes(w, s->data + r->data, r->len);
+        }
+
+        end = r->operation == ADD ? r->position : r->position + r->len;
+    }
+
+    writer_flush(w);
+
+    int ret = (fclose(w->f) == 0 && !w->failed) ? 0 : -1;
+    free(w);
+
+    return ret;
+}
+
+
+static int script_decode_v1(const unsigned char* p, size_t size, edit_script* s)
+{
+    if (size % V1_RECORD != 0)
+    {
+        return -2;
+    }
+
+    for (const unsigned char* rec = p; rec < p + size; rec += V1_RECORD)
+    {
+        u_int32_t position = ntohl(bytes_to_uint32((const char*) rec + 3));
+        char c = (char) rec[V1_RECORD - 1];
+        int ret;
+
+        if (memcmp(rec, "ADD", 3) == 0)
+        {
+            /* after position, -1 being before the first byte */
+            ret = script_push(s, ADD, (u_int32_t) (position + 1), &c, 1);
+        }
+        else if (memcmp(rec, "DEL", 3) == 0)
+        {
+            ret = script_push(s, DEL, position, NULL, 1);
+        }
+        else if (memcmp(rec, "SET", 3) == 0)
+        {
+            ret = script_push(s, SET, position, &c, 1);
+        }
+        else
+        {
+            return -2;
+        }
+
+        if (ret != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int script_decode_v2(const unsigned char* p, size_t size, edit_script* s)
+{
+    const unsigned char* end = p + size;
+    size_t pos = 0;
+
+    p += SCRIPT_MAGIC_LEN;
+
+    while (p < end)
+    {
+        unsigned char tag = *p++;
+        op_type op = (op_type) (tag & ((1 << TAG_OP_BITS) - 1));
+        uint64_t len = tag >> TAG_OP_BITS;
+        uint64_t delta;
+
+        if (op == NOP || len == 0 || !read_varint(&p, end, &delta))
+        {
+            return -2;
+        }
+
+        if (len == TAG_LEN_MAX)
+        {
+            uint64_t more;
+            if (!read_varint(&p, end, &more) || more > SIZE_MAX - TAG_LEN_MAX)
+            {
+                return -2;
+            }
+            len += more;
+        }
+
+        if (delta > SIZE_MAX - pos || (op != DEL && len > (uint64_t) (end - p)))
+        {
+            return -2;
+        }
+        pos += delta;
+
+        if (script_push(s, op, pos, (const char*) p, len) != 0)
+        {
+            return -1;
+        }
+
+        if (op != DEL)
+        {
+            p += len;
+        }
+        if (op != ADD)
+        {
+            if (len > SIZE_MAX - pos)
+            {
+                return -2;
+            }
+            pos += len;
+        }
+    }
+
+    return 0;
+}
+
+
+int script_load(const char* file, edit_script* s)
+{
+    memset(s, 0, sizeof(edit_script));
+
+    char* buf = NULL;
+    long size = file_load(file, &buf);
+    if (size < 0)
+    {
+        return -1;
+    }
+
+    const unsigned char* p = (const unsigned char*) buf;
+    int ret;
+
+    if ((size_t) size >= SCRIPT_MAGIC_LEN && memcmp(p, SCRIPT_MAGIC, SCRIPT_MAGIC_LEN) == 0)
+    {
+        ret = script_decode_v2(p, size, s);
+    }
+    else
+    {
+        ret = script_decode_v1(p, size, s);
+    }
+
+    free(buf);
+
+    if (ret != 0)
+    {
+        script_free(s);
+    }
+
+    return ret;
+}
+
+
+void script_free(edit_script* s)
+{
+    free(s->runs);
+    free(s->data);
+    memset(s, 0, sizeof(edit_script));
+}
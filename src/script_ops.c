@@ -0,0 +1,373 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../include/script_ops.h"
+#include "../include/util.h"
+
+
+/* Composition sees the middle file B as a list of segments, each one
+ * either a span of A left untouched by s1 or bytes s1 added or set.
+ * Walking s2 over these segments gives C as spans of A and literal
+ * bytes, and the runs of A -> C are what lies between the spans of A.
+ * The size of A is unknown: its last span is open, it runs to the end. */
+
+
+/* a piece of B */
+typedef struct
+{
+    bool literal;
+    size_t off; /* offset in A, or in the data of s1 if literal */
+    size_t len;
+} segment;
+
+
+/* builds the runs of A -> C from the pieces of C, in order */
+typedef struct
+{
+    edit_script* out;
+    size_t apos;  /* end of the last span of A in C */
+    char* lit;    /* bytes of C after it */
+    size_t nlit;
+    size_t litcap;
+} composer;
+
+
+/* turns A[c->apos, a) into the pending bytes */
+static int composer_flush(composer* c, size_t a)
+{
+    size_t gap = a - c->apos;
+    size_t set = gap < c->nlit ? gap : c->nlit;
+
+    if (set > 0 && script_push(c->out, SET, c->apos, c->lit, set) != 0)
+    {
+        return -1;
+    }
+    if (gap > set && script_push(c->out, DEL, c->apos + set, NULL, gap - set) != 0)
+    {
+        return -1;
+    }
+    if (c->nlit > set && script_push(c->out, ADD, a, c->lit + set, c->nlit - set) != 0)
+    {
+        return -1;
+    }
+
+    c->nlit = 0;
+    return 0;
+}
+
+
+static int composer_literal(composer* c, const char* p, size_t len)
+{
+    if (c->nlit + len > c->litcap)
+    {
+        size_t cap = c->litcap ? c->litcap : 256;
+        while (cap < c->nlit + len)
+        {
+            cap *= 2;
+        }
+
+        char* lit = realloc(c->lit, cap);
+        if (!lit)
+        {
+            return -1;
+        }
+
+        c->lit = lit;
+        c->litcap = cap;
+    }
+
+    memcpy(c->lit + c->nlit, p, len);
+    c->nlit += len;
+    return 0;
+}
+
+
+/* C goes on with A[a, a + len) */
+static int composer_copy(composer* c, size_t a, size_t len)
+{
+    if (a < c->apos)
+    {
+        return -2;
+    }
+    if ((a != c->apos || c->nlit > 0) && composer_flush(c, a) != 0)
+    {
+        return -1;
+    }
+
+    c->apos = a + len;
+    return 0;
+}
+
+
+/* the segments of B, the last one open */
+static int compose_segments(const edit_script* s1, segment** segs, size_t* nseg)
+{
+    segment* seg = malloc((2 * s1->nruns + 1) * sizeof(segment));
+    if (!seg)
+    {
+        return -1;
+    }
+
+    size_t n = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < s1->nruns; i++)
+    {
+        const edit_run* r = &s1->runs[i];
+
+        if (r->position < pos)
+        {
+            free(seg);
+            return -2;
+        }
+        if (r->position > pos)
+        {
+            seg[n++] = (segment) {false, pos, r->position - pos};
+        }
+        if (r->operation != DEL)
+        {
+            seg[n++] = (segment) {true, r->data, r->len};
+        }
+
+        pos = r->operation == ADD ? r->position : r->position + r->len;
+    }
+    seg[n++] = (segment) {false, pos, SIZE_MAX - pos};
+
+    *segs = seg;
+    *nseg = n;
+    return 0;
+}
+
+
+/* moves the cursor (i, off) len bytes through B, copying them to C if keep */
+static int compose_take(composer* c, const edit_script* s1, const segment* seg, size_t nseg,
+                        size_t* i, size_t* off, size_t len, bool keep)
+{
+    while (len > 0)
+    {
+        if (*i == nseg)
+        {
+            return -2;
+        }
+
+        const segment* sg = &seg[*i];
+        size_t k = sg->len - *off < len ? sg->len - *off : len;
+
+        if (keep && k > 0)
+        {
+            int ret = sg->literal ? composer_literal(c, s1->data + sg->off + *off, k)
+                                  : composer_copy(c, sg->off + *off, k);
+            if (ret != 0)
+            {
+                return ret;
+            }
+        }
+
+        *off += k;
+        len -= k;
+        if (*off == sg->len)
+        {
+            (*i)++;
+            *off = 0;
+        }
+    }
+
+    return 0;
+}
+
+
+int script_compose(const edit_script* s1, const edit_script* s2, edit_script* out)
+{
+    segment* seg = NULL;
+    size_t nseg = 0;
+    int ret = compose_segments(s1, &seg, &nseg);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    composer c = {out, 0, NULL, 0, 0};
+    size_t i = 0;
+    size_t off = 0;
+    size_t bpos = 0;
+
+    for (size_t r = 0; r < s2->nruns && ret == 0; r++)
+    {
+        const edit_run* run = &s2->runs[r];
+
+        if (run->position < bpos)
+        {
+            ret = -2;
+            break;
+        }
+
+        /* B is unchanged up to the run */
+        ret = compose_take(&c, s1, seg, nseg, &i, &off, run->position - bpos, true);
+        bpos = run->position;
+
+        if (ret == 0 && run->operation != ADD)
+        {
+            ret = compose_take(&c, s1, seg, nseg, &i, &off, run->len, false);
+            bpos += run->len;
+        }
+        if (ret == 0 && run->operation != DEL)
+        {
+            ret = composer_literal(&c, s2->data + run->data, run->len);
+        }
+    }
+
+    /* the rest of B, up to the end of A */
+    for (; i < nseg && ret == 0; i++, off = 0)
+    {
+        ret = seg[i].literal ? composer_literal(&c, s1->data + seg[i].off + off, seg[i].len - off)
+                             : composer_copy(&c, seg[i].off + off, seg[i].len - off);
+    }
+
+    free(c.lit);
+    free(seg);
+
+    return ret;
+}
+
+
+int script_compose_files(char* const* files, size_t n, const char* outfile)
+{
+    edit_script acc;
+    int ret = script_load(files[0], &acc);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    for (size_t k = 1; k < n; k++)
+    {
+        edit_script next;
+        ret = script_load(files[k], &next);
+        if (ret != 0)
+        {
+            script_free(&acc);
+            return ret;
+        }
+
+        edit_script composed = {0};
+        ret = script_compose(&acc, &next, &composed);
+        script_free(&next);
+        script_free(&acc);
+        if (ret != 0)
+        {
+            script_free(&composed);
+            return ret;
+        }
+
+        acc = composed;
+    }
+
+    ret = script_save(&acc, outfile) == 0 ? 0 : -3;
+    script_free(&acc);
+
+    return ret;
+}
+
+
+int script_invert(const edit_script* s, const char* in, size_t insize, edit_script* out)
+{
+    size_t pos = 0;
+    size_t added = 0;   /* bytes added so far */
+    size_t deleted = 0; /* bytes deleted so far */
+
+    for (size_t i = 0; i < s->nruns; i++)
+    {
+        const edit_run* r = &s->runs[i];
+
+        if (r->position < pos || r->position > insize
+            || (r->operation != ADD && r->len > insize - r->position))
+        {
+            return -2;
+        }
+
+        /* where the run lands in B */
+        size_t bpos = r->position + added - deleted;
+        int ret;
+
+        switch (r->operation)
+        {
+            case ADD:
+            {
+                ret = script_push(out, DEL, bpos, NULL, r->len);
+                added += r->len;
+                pos = r->position;
+                break;
+            }
+            case DEL:
+            {
+                ret = script_push(out, ADD, bpos, in + r->position, r->len);
+                deleted += r->len;
+                pos = r->position + r->len;
+                break;
+            }
+            default:
+            {
+                ret = script_push(out, SET, bpos, in + r->position, r->len);
+                pos = r->position + r->len;
+                break;
+            }
+        }
+
+        if (ret != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int script_invert_file(const char* infile, const char* scriptfile, const char* outfile)
+{
+    edit_script s;
+    int ret = script_load(scriptfile, &s);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    const char* in = NULL;
+    size_t insize = 0;
+    if (file_map(infile, &in, &insize) != 0)
+    {
+        script_free(&s);
+        return -1;
+    }
+
+    edit_script inverse = {0};
+    ret = script_invert(&s, in, insize, &inverse);
+    if (ret == 0 && script_save(&inverse, outfile) != 0)
+    {
+        ret = -3;
+    }
+
+    script_free(&inverse);
+    file_unmap(in, insize);
+    script_free(&s);
+
+    return ret;
+}
@@ -15,30 +15,112 @@
 *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
-#include <dirent.h>
 #include <stdlib.h>
-#include <ftw.h>     // ftw
-#include <limits.h>  // INT_MAX
+#include <fcntl.h>   // open
+#include <unistd.h>  // close
+#include <sys/stat.h>
+#include <limits.h>  // LONG_MAX
+#include <stdint.h>  // SIZE_MAX
 #include <stdbool.h>
 #include <string.h>  // strcmp
+#include <pthread.h>
+#include <sched.h>   // sched_yield
+#include <time.h>    // nanosleep
+#include <stdatomic.h>
 
 #include "../include/search.h"
 #include "../include/list.h"
 #include "../include/distance.h"
 #include "../include/name_distance.h"
 #include "../include/list_namedistance.h"
+#include "../include/filter.h"
+#include "../include/util.h"
+#include "../include/tokens.h"
+#include "../include/workqueue.h"
+#include "../include/walk.h"
+#include "../include/sigindex.h"
+#include "../include/distcache.h"
+#include "../include/dedup.h"
+#include "../include/lsh.h"
+#include "../include/vptree.h"
 
 
-/* max dirs open at the same time */
-#define MAX_OPEN_FD 8
+/* files found by the walk and not taken by a worker yet */
+#define QUEUE_ITEMS 4096
+
+/* empty polls before a worker naps while the walk catches up */
+#define IDLE_SPINS 64
 
 char* inputFile = NULL;
-node* list = NULL;
-long lim = INT_MAX;
+const char* inputBuf = NULL;
+signature inputSig;
+/* of inputBuf, if the cache is on */
+uint64_t inputHash = 0;
+/* tightened by searchk as the k best get closer */
+atomic_long lim = LONG_MAX;
+unit_t inputUnit = UNIT_BYTE;
+token_table inputTokens;
+
+
+/* a file found by the walk of search, with how far its size is from the input's */
+typedef struct
+{
+    char* path;
+    size_t gap;
+} search_cand;
+
+
+/* an item whose contents were being compared by another worker */
+typedef struct
+{
+    char* path;
+    dedup_entry* e;
+} search_deferred;
+
 
-bool compare_fun(void* pVoid, op_t op, int value)
+/* what a worker found, merged when all of them are done */
+typedef struct
 {
-    int dist = ((name_distance*) pVoid)->distance;
+    node* head;
+    node* tail;
+    name_distance** heap; /* searchk: the k best so far, the worst on top */
+    size_t nheap;
+    search_cand* cands;   /* search: the files a walker found */
+    size_t ncands;
+    size_t capcands;
+    sigindex_batch batch; /* the files read that the index missed */
+    unsigned long indexed;
+    search_deferred* deferred;
+    size_t ndeferred;
+    size_t capdeferred;
+    filter_stats stats;
+} search_worker;
+
+
+/* The walk pushes the files on the queue, the workers take them and
+ * compute the distances. The input is only read meanwhile, lim only
+ * lowered when k is set. */
+typedef struct
+{
+    workqueue queue;
+    search_worker* workers; /* the nworkers computing, then the walkers */
+    int nworkers;
+    size_t k;               /* keep the k closest only, 0 to keep all within lim */
+    bool nearest;           /* search: walk first, then the closest sizes first */
+    search_cand* cands;     /* search: all the files, the closest sizes first */
+    size_t ncands;
+    atomic_size_t next;     /* search: first of cands not taken yet */
+    sigindex* index;        /* NULL if the files are always read */
+    dedup_table dups;       /* the files and contents met so far */
+    atomic_bool walked;
+    atomic_bool failed;
+} search_job;
+
+search_job* job = NULL;
+
+bool compare_fun(void* pVoid, op_t op, long value)
+{
+    long dist = ((name_distance*) pVoid)->distance;
 
     switch (op)
     {
@@ -69,180 +151,1318 @@ bool compare_fun(void* pVoid, op_t op, int value)
 }
 
 
-int add_file(const char* fname, const struct stat* st, int type)
+int cmpfunc(const void* a, const void* b)
 {
-    /* must be a regular file */
-    if (type == FTW_D)
-        return 0;
+    name_distance* nd1 = (name_distance*) a;
+    name_distance* nd2 = (name_distance*) b;
 
-    /* file > lim has always distance > lim */
-    if (st->st_size > lim)
+    if (nd1->distance < nd2->distance)
     {
-        /* don't process */
-        return 0;
+        return -1;
+    }
+    else if (nd1->distance > nd2->distance)
+    {
+        return 1;
+    }
+    else
+    {
+        /* if distances are the same, compare filename */
+        return strcmp(nd1->filename, nd2->filename);
     }
+}
 
-    /* get distance to inputFile */
-    int distance = distance_file(fname, inputFile);
-    if (distance < 0)
+
+/* first of the filters to rule the candidate out, FILTER_STAGES if none does */
+static filter_stage candidate_filter(const signature* sig, long bound)
+{
+    if (filter_histogram_bound(sig, &inputSig) > bound)
     {
-        return -1;
+        return FILTER_HISTOGRAM;
     }
 
-    /* create node */
-    name_distance* fd = (name_distance*) malloc(sizeof(name_distance));
-    if (!fd)
+    if (filter_qgram_bound(sig, &inputSig) > bound)
     {
-        return -1;
+        return FILTER_QGRAM;
     }
-    memset(fd, 0, sizeof(name_distance));
 
-    /* resolve path to absolute */
-    char resolvedPath[PATH_MAX + 1];
-    char* ptr = realpath(fname, resolvedPath);
-    if (!ptr)
+    return FILTER_STAGES;
+}
+
+
+/* the distance of contents hash of size bytes from the input, if the cache knows it */
+static bool candidate_cached(filter_stats* stats, uint64_t hash, size_t size, long bound, long* distance)
+{
+    if (!distcache_get(hash, size, inputHash, inputSig.size, inputUnit, bound, distance))
     {
-        return -1;
+        return false;
     }
 
-    /* set node data: distance and filename */
-    /* copy & detect truncation */
+    stats->cached++;
+    return true;
+}
 
-    fd->distance = distance;
-    if (strlcpy(fd->filename, ptr, sizeof(fd->filename)) >= sizeof(fd->filename))
+
+/* Claims the file or the contents keyed by a and b. DEDUP_OWNER if the
+ * distance is the caller's to compute, DEDUP_DONE with it in distance,
+ * DEDUP_PENDING with the entry to wait on in e, -1 if out of memory */
+static int search_claim(search_worker* w, dedup_kind kind, uint64_t a, uint64_t b, long bound,
+                        dedup_entry** e, long* distance)
+{
+    int claim = dedup_claim(&job->dups, kind, a, b, e, distance);
+    if (claim == DEDUP_DONE || claim == DEDUP_PENDING)
     {
-        /* error */
+        w->stats.duplicates++;
+    }
+
+    /* computed with a bound as high as this one at least */
+    if (claim == DEDUP_DONE && *distance > bound)
+    {
+        *distance = bound + 1;
+    }
+
+    return claim;
+}
+
+
+/* maps the candidate, st receives its status */
+static int candidate_map(const char* fname, const char** buf, struct stat* st)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1 || fstat(fd, st) != 0)
+    {
+        if (fd != -1)
+            close(fd);
         return -1;
     }
 
-    /* add to list */
+    int ret = file_map_fd(fd, st->st_size, buf);
+    close(fd);
+
+    return ret;
+}
+
+
+/* Distance in bytes of the candidate's contents, hash of *size bytes,
+ * bound + 1 if a filter rules them out. With an index entry e the file
+ * is mapped into *buf only if the entry can't rule it out, otherwise
+ * *buf holds it already and sig is its whole signature, if computed */
+static long contents_bytes(search_worker* w, const char* fname, const sigindex_entry* e, const signature* sig,
+                           const char** buf, size_t* size, uint64_t hash, long bound)
+{
+    filter_stats* stats = &w->stats;
+    bool cached = distcache_enabled();
+    long distance;
+
+    if (e)
+    {
+        filter_stage stage = candidate_filter(&e->sig, bound);
+        if (stage != FILTER_STAGES)
+        {
+            filter_count(stats, stage);
+            return bound + 1;
+        }
+
+        /* compared before: the file isn't even opened */
+        if (cached && candidate_cached(stats, hash, *size, bound, &distance))
+        {
+            return distance;
+        }
+
+        struct stat st;
+        if (candidate_map(fname, buf, &st) != 0)
+        {
+            return -1;
+        }
+        *size = st.st_size;
+    }
+
+    /* the same bytes: no need to look further */
+    if (*size == inputSig.size && memcmp(*buf, inputBuf, *size) == 0)
+    {
+        filter_count(stats, FILTER_STAGES);
+        return 0;
+    }
 
-    if (list == NULL)
+    if (!e && sig)
     {
-        /* create list if first node */
-        list = list_create(fd, NULL);
+        filter_stage stage = candidate_filter(sig, bound);
+        if (stage != FILTER_STAGES)
+        {
+            filter_count(stats, stage);
+            return bound + 1;
+        }
     }
-    else
+    else if (!e)
+    {
+        signature part;
+        signature_histogram(*buf, *size, &part);
+        if (filter_histogram_bound(&part, &inputSig) > bound)
+        {
+            filter_count(stats, FILTER_HISTOGRAM);
+            return bound + 1;
+        }
+
+        signature_qgrams(*buf, *size, &part);
+        if (filter_qgram_bound(&part, &inputSig) > bound)
+        {
+            filter_count(stats, FILTER_QGRAM);
+            return bound + 1;
+        }
+    }
+
+    /* the index entry was looked up already */
+    if (!e && cached && candidate_cached(stats, hash, *size, bound, &distance))
     {
-        /* append data to list */
-        list_append(list, fd);
+        return distance;
     }
 
-    return 0;
+    filter_count(stats, FILTER_STAGES);
+
+    /* get distance to inputFile, giving up past bound */
+    distance = distance_string_bounded(*buf, *size, inputBuf, inputSig.size, bound);
+
+    if (cached)
+    {
+        distcache_put(hash, *size, inputHash, inputSig.size, UNIT_BYTE, bound, distance);
+    }
+
+    return distance;
 }
 
 
-int cmpfunc(const void* a, const void* b)
+/* Distance of the candidate in bytes, bound + 1 if a filter rules it out.
+ * If another file with the same contents is being compared, *wait
+ * receives its entry and the distance is left to come */
+static long candidate_bytes(search_worker* w, const char* fname, const struct stat* st, long bound,
+                            dedup_entry** wait)
 {
-    name_distance* nd1 = (name_distance*) a;
-    name_distance* nd2 = (name_distance*) b;
+    sigindex* index = job->index;
 
-    if (nd1->distance < nd2->distance)
+    /* cheap lower bounds first, from the size
+     * alone up to the q-gram counts */
+
+    signature sig;
+    sig.size = st->st_size;
+    if (filter_size_bound(&sig, &inputSig) > bound)
     {
-        return -1;
+        filter_count(&w->stats, FILTER_SIZE);
+        return bound + 1;
     }
-    else if (nd1->distance > nd2->distance)
+
+    /* with an index the file is only opened if its entry can't rule it out */
+    const sigindex_entry* e = index ? sigindex_find(index, fname, st) : NULL;
+    const char* buf = NULL;
+    size_t size = st->st_size;
+    uint64_t hash = e ? e->hash : 0;
+
+    if (e)
     {
-        return 1;
+        w->indexed++;
     }
     else
     {
-        /* if distances are the same, compare filename */
-        return strcmp(nd1->filename, nd2->filename);
+        /* map the candidate, pages are read in as the hash goes through it */
+        struct stat cur;
+        if (candidate_map(fname, &buf, &cur) != 0)
+        {
+            return -1;
+        }
+        size = cur.st_size;
+        hash = hash_bytes(buf, size);
+
+        /* read whole for the index, the next runs won't have to */
+        if (index)
+        {
+            signature_compute(buf, size, &sig);
+            if (sigindex_batch_add(&w->batch, index, fname, &cur, hash, &sig) != 0)
+            {
+                file_unmap(buf, size);
+                return -1;
+            }
+        }
+    }
+
+    /* the same contents under another name are compared once */
+    long distance = -1;
+    dedup_entry* c = NULL;
+    int claim = search_claim(w, DEDUP_CONTENTS, size, hash, bound, &c, &distance);
+    if (claim == DEDUP_OWNER)
+    {
+        distance = contents_bytes(w, fname, e, index && !e ? &sig : NULL, &buf, &size, hash, bound);
+        dedup_publish(&job->dups, c, distance);
+    }
+    else if (claim == DEDUP_PENDING)
+    {
+        *wait = c;
     }
+
+    file_unmap(buf, size);
+
+    return distance;
 }
 
 
-int search_min(const char* f, const char* dir)
+/* distance in lines or words of the candidate's contents, hash of size bytes */
+static long contents_tokens(search_worker* w, const char* buf, size_t size, uint64_t hash, long bound)
 {
-    if (f == NULL || dir == NULL)
+    filter_stats* stats = &w->stats;
+    bool cached = distcache_enabled();
+
+    long distance;
+    if (cached && candidate_cached(stats, hash, size, bound, &distance))
+    {
+        return distance;
+    }
+
+    uint32_t* ids = NULL;
+    size_t n = 0;
+    if (tokens_lookup(&inputTokens, buf, size, &ids, &n) != 0)
     {
         return -1;
     }
 
-    /* get size of f */
-    struct stat st;
-    stat(f, &st);
-    int sizef = st.st_size;
+    /* the byte filters don't bound a distance in tokens, the count does */
+    size_t diff = n < inputTokens.n ? inputTokens.n - n : n - inputTokens.n;
+    if (diff > (size_t) bound)
+    {
+        filter_count(stats, FILTER_SIZE);
+        free(ids);
+        return bound + 1;
+    }
 
-    /* set up parameters needed inside add_file
-       can't pass directly bc of ftw callback signature constraint */
-    lim = sizef;
-    inputFile = (char*) f;
+    filter_count(stats, FILTER_STAGES);
 
-    /* dir traversal, MAX_OPEN_FD open dirs max */
-    int res = ftw(dir, add_file, MAX_OPEN_FD);
-    if (res != 0)
+    distance = distance_ids_bounded(ids, n, inputTokens.ids, inputTokens.n, inputTokens.nids + 1, bound);
+    free(ids);
+
+    if (cached)
+    {
+        distcache_put(hash, size, inputHash, inputSig.size, inputUnit, bound, distance);
+    }
+
+    return distance;
+}
+
+
+/* distance of the candidate in lines or words, bound + 1 if too far.
+ * *wait as for candidate_bytes */
+static long candidate_tokens(search_worker* w, const char* fname, long bound, dedup_entry** wait)
+{
+    const char* buf = NULL;
+    size_t size = 0;
+    if (file_map(fname, &buf, &size) != 0)
     {
         return -1;
     }
 
-    /* find min of list */
-    int min = list_namedistance_min(list);
+    /* the same contents under another name are compared once */
+    long distance = -1;
+    dedup_entry* c = NULL;
+    uint64_t hash = hash_bytes(buf, size);
+    int claim = search_claim(w, DEDUP_CONTENTS, size, hash, bound, &c, &distance);
+    if (claim == DEDUP_OWNER)
+    {
+        distance = contents_tokens(w, buf, size, hash, bound);
+        dedup_publish(&job->dups, c, distance);
+    }
+    else if (claim == DEDUP_PENDING)
+    {
+        *wait = c;
+    }
 
-    /* filter list in place, keep elems w/ distance == min */
-    node* filterd = list_filter(list, (comparison_f) compare_fun, EQUAL_TO, min);
+    file_unmap(buf, size);
 
-    /* print filenames */
-    list_traverse(filterd, (callback_t) list_namedistance_print_name);
+    return distance;
+}
 
-    /* frees up the list */
-    list_free(filterd);
 
-    return 0;
+static inline bool nd_worse(const name_distance* a, const name_distance* b)
+{
+    return cmpfunc(a, b) > 0;
 }
 
 
-int search_all(const char* f, const char* dir, long limit)
+/* moves the root of the heap down to its place */
+static void heap_sift_down(name_distance** heap, size_t n)
 {
-    if (!f || !dir)
+    size_t i = 0;
+    for (;;)
     {
-        return -1;
+        size_t worst = i;
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
+
+        if (l < n && nd_worse(heap[l], heap[worst]))
+            worst = l;
+        if (r < n && nd_worse(heap[r], heap[worst]))
+            worst = r;
+        if (worst == i)
+            return;
+
+        name_distance* tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
     }
+}
 
-    /* set up parameters needed inside add_file, */
-    /* can't pass directly bc of ftw callback signature constraint */
 
-    lim = limit;
-    inputFile = (char*) f;
+/* moves the last of the heap up to its place */
+static void heap_sift_up(name_distance** heap, size_t n)
+{
+    size_t i = n - 1;
+    while (i > 0 && nd_worse(heap[i], heap[(i - 1) / 2]))
+    {
+        name_distance* tmp = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
 
-    /* dir traversal, MAX_OPEN_FD open dirs max */
-    int res = ftw(dir, add_file, MAX_OPEN_FD);
-    if (res != 0)
+
+/* lowers lim to bound, if another worker didn't go lower already */
+static void search_tighten(long bound)
+{
+    long cur = atomic_load_explicit(&lim, memory_order_relaxed);
+    while (bound < cur
+           && !atomic_compare_exchange_weak_explicit(&lim, &cur, bound, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+
+/* Keeps fd among the worker's k best, freeing whatever is left out.
+ * With k found, the worst of them bounds every later comparison: the
+ * k best overall can't be any farther. */
+static void search_keep_best(search_worker* w, name_distance* fd)
+{
+    size_t k = job->k;
+
+    if (w->nheap < k)
+    {
+        w->heap[w->nheap++] = fd;
+        heap_sift_up(w->heap, w->nheap);
+    }
+    else if (nd_worse(w->heap[0], fd))
+    {
+        free(w->heap[0]);
+        w->heap[0] = fd;
+        heap_sift_down(w->heap, k);
+    }
+    else
+    {
+        free(fd);
+    }
+
+    if (w->nheap == k)
+    {
+        search_tighten(w->heap[0]->distance);
+    }
+}
+
+
+/* keeps the item if its distance is within bound */
+static int search_item_keep(search_worker* w, const char* path, long distance, long bound)
+{
+    /* too far, don't add */
+    if (distance > bound)
+    {
+        return 0;
+    }
+
+    /* create node */
+    name_distance* fd = (name_distance*) malloc(sizeof(name_distance));
+    if (!fd)
     {
         return -1;
     }
+    memset(fd, 0, sizeof(name_distance));
 
-    /* filter list in place, keep elems w/ distance <= limit */
-    node* filtered = list_filter(list, (comparison_f) compare_fun, EQ_LESS_THAN, limit);
+    /* set node data: distance and filename, already absolute */
+    /* copy & detect truncation */
 
-    /* get number of nodes in list */
-    int len = list_count(filtered);
+    fd->distance = distance;
+    if (strlcpy(fd->filename, path, sizeof(fd->filename)) >= sizeof(fd->filename))
+    {
+        /* error */
+        free(fd);
+        return -1;
+    }
 
-    /* no files found, return */
-    if (len <= 0)
+    if (job->k > 0)
+    {
+        search_keep_best(w, fd);
         return 0;
+    }
 
-    /* save list to array */
-    name_distance* arr = NULL;
-    if (list_namedistance_save_to_array(filtered, &arr) == -1)
+    /* the best so far bounds the others, ties with it are still kept */
+    if (job->nearest)
     {
-        /* free list */
-        list_free(filtered);
+        search_tighten(distance);
+    }
+
+    /* append to the worker's own list */
+    node* n = list_create(fd, NULL);
+    if (!n)
+    {
+        free(fd);
         return -1;
     }
 
-    /* free list */
-    list_free(filtered);
+    if (w->tail)
+    {
+        w->tail->next = n;
+    }
+    else
+    {
+        w->head = n;
+    }
+    w->tail = n;
 
-    /* order by distance asc, filename asc */
-    qsort(arr, len, sizeof(name_distance), cmpfunc);
+    return 0;
+}
 
-    /* print all */
-    for (int i = 0; i < len; i++)
+
+/* leaves the item for when the distance of e is known */
+static int search_item_defer(search_worker* w, const char* path, dedup_entry* e)
+{
+    if (w->ndeferred == w->capdeferred)
+    {
+        size_t cap = w->capdeferred ? w->capdeferred * 2 : 64;
+        search_deferred* deferred = realloc(w->deferred, cap * sizeof(search_deferred));
+        if (!deferred)
+        {
+            return -1;
+        }
+
+        w->deferred = deferred;
+        w->capdeferred = cap;
+    }
+
+    char* p = strdup(path);
+    if (!p)
     {
-        namedistance_print(&arr[i]);
+        return -1;
     }
 
+    w->deferred[w->ndeferred++] = (search_deferred) {p, e};
+
     return 0;
-}
\ No newline at end of file
+}
+
+
+/* computes the distance of the item, keeping it if it's within lim */
+static int search_item_run(search_worker* w, const char* path)
+{
+    /* read once, other workers may lower it meanwhile */
+    long bound = atomic_load_explicit(&lim, memory_order_relaxed);
+
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return -1;
+    }
+
+    /* hardlinks, and symlinks to a file met already, are compared once */
+    long distance = -1;
+    dedup_entry* f = NULL;
+    dedup_entry* wait = NULL;
+    int claim = search_claim(w, DEDUP_INODE, st.st_dev, st.st_ino, bound, &f, &distance);
+    if (claim == DEDUP_OWNER)
+    {
+        distance = inputUnit == UNIT_BYTE ? candidate_bytes(w, path, &st, bound, &wait)
+                                          : candidate_tokens(w, path, bound, &wait);
+
+        /* the file's other names wait on its contents too */
+        if (wait)
+            dedup_alias(&job->dups, f, wait);
+        else
+            dedup_publish(&job->dups, f, distance);
+    }
+    else if (claim == DEDUP_PENDING)
+    {
+        wait = f;
+    }
+
+    if (wait)
+    {
+        return search_item_defer(w, path, wait);
+    }
+
+    if (distance < 0)
+    {
+        return -1;
+    }
+
+    return search_item_keep(w, path, distance, bound);
+}
+
+
+/* keeps the items left waiting, now that every distance is known */
+static int search_worker_resolve(search_worker* w)
+{
+    int res = 0;
+
+    /* lim is as low as it gets: whatever the bound of the
+     * computation was, it was this one at least */
+    long bound = atomic_load_explicit(&lim, memory_order_relaxed);
+
+    for (size_t i = 0; i < w->ndeferred; i++)
+    {
+        long distance = dedup_value(w->deferred[i].e);
+        if (distance > bound)
+            distance = bound + 1;
+        if (res == 0 && (distance < 0 || search_item_keep(w, w->deferred[i].path, distance, bound) != 0))
+        {
+            res = -1;
+        }
+        free(w->deferred[i].path);
+    }
+
+    free(w->deferred);
+    w->deferred = NULL;
+    w->ndeferred = 0;
+
+    return res;
+}
+
+
+/* runs a path taken from the queue and frees it */
+static void search_item_take(search_worker* w, char* path)
+{
+    if (!job->failed && search_item_run(w, path) != 0)
+    {
+        job->failed = true;
+    }
+    free(path);
+}
+
+
+static void* search_worker_run(void* arg)
+{
+    search_worker* w = (search_worker*) arg;
+    unsigned idle = 0;
+
+    for (;;)
+    {
+        /* checked before the pop: once walked is seen, an empty queue stays empty */
+        bool walked = job->walked;
+
+        void* it;
+        if (workqueue_pop(&job->queue, &it))
+        {
+            search_item_take(w, (char*) it);
+            idle = 0;
+        }
+        else if (walked)
+        {
+            break;
+        }
+        else if (++idle < IDLE_SPINS)
+        {
+            sched_yield();
+        }
+        else
+        {
+            struct timespec nap = {0, 100000};
+            nanosleep(&nap, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* called by the walkers for each file */
+static int search_visit(const char* path, size_t len, int walker, void* arg)
+{
+    search_job* sj = (search_job*) arg;
+
+    if (sj->failed)
+        return -1;
+
+    if (file_is_own(path, len))
+        return 0;
+
+    if (sj->index)
+        sigindex_mark(sj->index, path);
+
+    char* it = malloc(len + 1);
+    if (!it)
+    {
+        return -1;
+    }
+    memcpy(it, path, len + 1);
+
+    /* queue full: the walker does the work itself */
+    if (!workqueue_push(&sj->queue, it))
+    {
+        search_item_take(&sj->workers[sj->nworkers + walker], it);
+    }
+
+    return sj->failed ? -1 : 0;
+}
+
+
+/* called by the walkers for each file when search walks first */
+static int search_collect(const char* path, size_t len, int walker, void* arg)
+{
+    search_job* sj = (search_job*) arg;
+    search_worker* w = &sj->workers[sj->nworkers + walker];
+
+    if (file_is_own(path, len))
+        return 0;
+
+    if (sj->index)
+        sigindex_mark(sj->index, path);
+
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return -1;
+    }
+
+    if (w->ncands == w->capcands)
+    {
+        size_t cap = w->capcands ? w->capcands * 2 : 256;
+        search_cand* cands = realloc(w->cands, cap * sizeof(search_cand));
+        if (!cands)
+        {
+            return -1;
+        }
+
+        w->cands = cands;
+        w->capcands = cap;
+    }
+
+    char* p = malloc(len + 1);
+    if (!p)
+    {
+        return -1;
+    }
+    memcpy(p, path, len + 1);
+
+    size_t size = st.st_size;
+    w->cands[w->ncands++] = (search_cand) {p, size > inputSig.size ? size - inputSig.size : inputSig.size - size};
+
+    return 0;
+}
+
+
+static int cand_cmp(const void* a, const void* b)
+{
+    const search_cand* c1 = (const search_cand*) a;
+    const search_cand* c2 = (const search_cand*) b;
+
+    if (c1->gap != c2->gap)
+    {
+        return c1->gap < c2->gap ? -1 : 1;
+    }
+
+    return strcmp(c1->path, c2->path);
+}
+
+
+/* gathers the walkers' files in sj->cands, the closest sizes first */
+static int search_sort_cands(search_job* sj)
+{
+    size_t n = 0;
+    for (int t = sj->nworkers; t < 2 * sj->nworkers; t++)
+    {
+        n += sj->workers[t].ncands;
+    }
+
+    sj->cands = malloc((n ? n : 1) * sizeof(search_cand));
+    if (!sj->cands)
+    {
+        return -1;
+    }
+
+    for (int t = sj->nworkers; t < 2 * sj->nworkers; t++)
+    {
+        search_worker* w = &sj->workers[t];
+        memcpy(sj->cands + sj->ncands, w->cands, w->ncands * sizeof(search_cand));
+        sj->ncands += w->ncands;
+
+        free(w->cands);
+        w->cands = NULL;
+        w->ncands = 0;
+    }
+
+    /* the likeliest to be close first, so that the bound drops early */
+    qsort(sj->cands, sj->ncands, sizeof(search_cand), cand_cmp);
+
+    return 0;
+}
+
+
+static void* search_worker_nearest(void* arg)
+{
+    search_worker* w = (search_worker*) arg;
+
+    while (!job->failed)
+    {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->ncands)
+        {
+            break;
+        }
+
+        /* in bytes the size gap bounds the distance: the files after
+         * this one are even farther, none of them can reach the best */
+        if (inputUnit == UNIT_BYTE && (long) job->cands[i].gap > atomic_load_explicit(&lim, memory_order_relaxed))
+        {
+            size_t from = atomic_exchange(&job->next, job->ncands);
+            w->stats.rejected[FILTER_SIZE] += 1 + (from < job->ncands ? job->ncands - from : 0);
+            break;
+        }
+
+        if (search_item_run(w, job->cands[i].path) != 0)
+        {
+            job->failed = true;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* the worker's k best joined to its list */
+static int search_worker_flush(search_worker* w)
+{
+    for (size_t i = 0; i < w->nheap; i++)
+    {
+        node* n = list_create(w->heap[i], NULL);
+        if (!n)
+        {
+            for (size_t j = i; j < w->nheap; j++)
+                free(w->heap[j]);
+            w->nheap = 0;
+            return -1;
+        }
+
+        if (w->tail)
+            w->tail->next = n;
+        else
+            w->head = n;
+        w->tail = n;
+    }
+    w->nheap = 0;
+
+    return 0;
+}
+
+
+/* called for each of the files given to search_run */
+static int search_feed(char* const* only, size_t nonly, walk_visit_f visit, search_job* sj)
+{
+    for (size_t i = 0; i < nonly; i++)
+    {
+        /* gone since the index was built */
+        struct stat st;
+        if (stat(only[i], &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+
+        if (visit(only[i], strlen(only[i]), 0, sj) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* the files read go in the index, the ones gone come out */
+static void search_save_index(search_job* sj)
+{
+    sigindex_batch* batches = malloc(2 * (size_t) sj->nworkers * sizeof(sigindex_batch));
+    if (!batches)
+    {
+        return;
+    }
+
+    unsigned long indexed = 0;
+    unsigned long read = 0;
+    for (int t = 0; t < 2 * sj->nworkers; t++)
+    {
+        batches[t] = sj->workers[t].batch;
+        indexed += sj->workers[t].indexed;
+        read += sj->workers[t].batch.n;
+    }
+
+    /* a read-only directory just goes without */
+    if (sigindex_save(sj->index, batches, 2 * sj->nworkers) != 0)
+    {
+        fprintf(stderr, "Can't save the index of %s\n", sj->index->root);
+    }
+    fprintf(stderr, "INDEX: %lu up to date, %lu read\n", indexed, read);
+
+    free(batches);
+}
+
+
+/* Walks dir computing the distances on opts->threads threads, this one
+ * included, while as many walkers feed them. Returns the files within
+ * lim, or each worker's k closest if k > 0, in no particular order.
+ * If nearest the walk comes first, then the files are compared the
+ * closest sizes first, each distance found lowering lim. With an index,
+ * the signatures of dir's index stand in for the files' contents. If
+ * only is given its nonly files are compared instead of dir's */
+static int search_run(const char* dir, const search_opts* opts, size_t k, bool nearest,
+                      char* const* only, size_t nonly, node** found, filter_stats* stats)
+{
+    *found = NULL;
+    memset(stats, 0, sizeof(filter_stats));
+
+    /* the signatures are of bytes: no use counting lines or words.
+     * Nor for a few files, the others would look gone */
+    sigindex idx;
+    bool indexed = opts->index && !only && inputUnit == UNIT_BYTE && sigindex_open(&idx, dir) == 0;
+
+    search_job sj;
+    sj.nworkers = opts->threads < 1 ? 1 : opts->threads;
+    sj.k = k;
+    sj.nearest = nearest;
+    sj.cands = NULL;
+    sj.ncands = 0;
+    atomic_init(&sj.next, 0);
+    sj.index = indexed ? &idx : NULL;
+    sj.workers = calloc(2 * (size_t) sj.nworkers, sizeof(search_worker));
+    pthread_t* tids = malloc(sj.nworkers * sizeof(pthread_t));
+    atomic_init(&sj.walked, false);
+    atomic_init(&sj.failed, false);
+
+    bool heaps = true;
+    for (int t = 0; k > 0 && sj.workers && t < 2 * sj.nworkers; t++)
+    {
+        sj.workers[t].heap = malloc(k * sizeof(name_distance*));
+        heaps = heaps && sj.workers[t].heap;
+    }
+
+    bool queued = sj.workers && tids && heaps && workqueue_init(&sj.queue, QUEUE_ITEMS) == 0;
+    if (!queued || dedup_init(&sj.dups) != 0)
+    {
+        for (int t = 0; sj.workers && t < 2 * sj.nworkers; t++)
+            free(sj.workers[t].heap);
+        if (queued)
+            workqueue_free(&sj.queue);
+        free(sj.workers);
+        free(tids);
+        if (indexed)
+            sigindex_close(&idx);
+        return -1;
+    }
+
+    job = &sj;
+
+    int res = 0;
+    void* (*work)(void*) = search_worker_run;
+
+    /* all the sizes are needed before the first comparison */
+    if (nearest)
+    {
+        res = only ? search_feed(only, nonly, search_collect, &sj)
+                   : walk_tree(dir, sj.nworkers, search_collect, &sj);
+        if (search_sort_cands(&sj) != 0)
+        {
+            res = -1;
+        }
+        work = search_worker_nearest;
+        sj.walked = true;
+    }
+
+    int started = 1;
+    while (res == 0 && started < sj.nworkers
+           && pthread_create(&tids[started], NULL, work, &sj.workers[started]) == 0)
+    {
+        started++;
+    }
+
+    /* as many threads walk, mostly waiting on the file system */
+    if (!nearest)
+    {
+        res = only ? search_feed(only, nonly, search_visit, &sj)
+                   : walk_tree(dir, sj.nworkers, search_visit, &sj);
+        sj.walked = true;
+    }
+
+    /* then help with what's left */
+    if (res == 0)
+    {
+        work(&sj.workers[0]);
+    }
+
+    for (int t = 1; t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+    }
+
+    /* the copies of contents that were being compared */
+    for (int t = 0; t < 2 * sj.nworkers; t++)
+    {
+        if (search_worker_resolve(&sj.workers[t]) != 0)
+        {
+            sj.failed = true;
+        }
+    }
+
+    /* chain the lists, add up the counters */
+    node* tail = NULL;
+    for (int t = 0; t < 2 * sj.nworkers; t++)
+    {
+        search_worker* w = &sj.workers[t];
+
+        /* left by a failed walk */
+        for (size_t i = 0; i < w->ncands; i++)
+        {
+            free(w->cands[i].path);
+        }
+        free(w->cands);
+
+        if (search_worker_flush(w) != 0)
+        {
+            sj.failed = true;
+        }
+        free(w->heap);
+
+        if (w->head)
+        {
+            if (tail)
+                tail->next = w->head;
+            else
+                *found = w->head;
+            tail = w->tail;
+        }
+
+        for (int k = 0; k < FILTER_STAGES; k++)
+        {
+            stats->rejected[k] += w->stats.rejected[k];
+        }
+        stats->passed += w->stats.passed;
+        stats->cached += w->stats.cached;
+        stats->duplicates += w->stats.duplicates;
+    }
+
+    for (size_t i = 0; i < sj.ncands; i++)
+    {
+        free(sj.cands[i].path);
+    }
+    free(sj.cands);
+
+    bool failed = res != 0 || sj.failed;
+
+    if (indexed)
+    {
+        if (!failed)
+            search_save_index(&sj);
+        for (int t = 0; t < 2 * sj.nworkers; t++)
+            sigindex_batch_free(&sj.workers[t].batch);
+        sigindex_close(&idx);
+    }
+
+    job = NULL;
+    dedup_free(&sj.dups);
+    workqueue_free(&sj.queue);
+    free(sj.workers);
+    free(tids);
+
+    return failed ? -1 : 0;
+}
+
+
+/* loads f and its signature, or its tokens, for the workers */
+int search_load_input(const char* f, unit_t unit)
+{
+    size_t size = 0;
+    if (file_map(f, &inputBuf, &size) != 0)
+    {
+        return -1;
+    }
+
+    inputFile = (char*) f;
+    inputUnit = unit;
+    signature_compute(inputBuf, size, &inputSig);
+    inputHash = distcache_enabled() ? hash_bytes(inputBuf, size) : 0;
+
+    if (unit != UNIT_BYTE && tokens_intern(inputBuf, size, unit, &inputTokens) != 0)
+    {
+        file_unmap(inputBuf, size);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void search_release_input()
+{
+    if (inputUnit != UNIT_BYTE)
+    {
+        tokens_free(&inputTokens);
+    }
+    file_unmap(inputBuf, inputSig.size);
+    inputBuf = NULL;
+    inputFile = NULL;
+}
+
+
+/* Answers the search from dir's vantage point tree: the distances it
+ * keeps rule out whole subtrees, the files in them aren't compared */
+static int search_tree(const char* dir, const search_opts* opts, size_t k, bool nearest, node** found,
+                       filter_stats* stats)
+{
+    *found = NULL;
+    memset(stats, 0, sizeof(filter_stats));
+
+    vptree_result res;
+    const token_table* tokens = inputUnit == UNIT_BYTE ? NULL : &inputTokens;
+    if (vptree_query(dir, inputBuf, inputSig.size, tokens, lim, k, nearest, opts->threads, &res) != 0)
+    {
+        fprintf(stderr, "No tree index of this unit in %s, build it with build-index\n", dir);
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < res.n && ret == 0; i++)
+    {
+        name_distance* fd = (name_distance*) calloc(1, sizeof(name_distance));
+        node* n = fd ? list_create(fd, *found) : NULL;
+        if (!n || strlcpy(fd->filename, res.hits[i].path, sizeof(fd->filename)) >= sizeof(fd->filename))
+        {
+            free(fd);
+            free(n);
+            ret = -1;
+            break;
+        }
+
+        fd->distance = res.hits[i].distance;
+        *found = n;
+    }
+
+    stats->passed = res.compared;
+    fprintf(stderr, "TREE: %lu of %lu files compared\n", res.compared, res.files);
+    if (res.changed > 0 || res.added > 0)
+    {
+        fprintf(stderr, "STALE: %lu files changed or gone, %lu added since build-index, compared without the tree\n",
+                res.changed, res.added);
+    }
+    vptree_result_free(&res);
+
+    return ret;
+}
+
+
+/* Runs the search on dir as search_run does. With LSH, the candidates
+ * of the input come first and lower lim as far as they reach: unless
+ * exact they're the only ones, else all the files of dir are searched
+ * after them, the bound as the candidates left it. With the tree, it
+ * answers alone */
+static int search_drive(const char* dir, const search_opts* opts, size_t k, bool nearest, node** found,
+                        filter_stats* stats)
+{
+    if (opts->tree)
+    {
+        return search_tree(dir, opts, k, nearest, found, stats);
+    }
+
+    /* a fixed limit gains nothing from the candidates */
+    if (!opts->lsh || (opts->exact && k == 0 && !nearest))
+    {
+        return search_run(dir, opts, k, nearest, NULL, 0, found, stats);
+    }
+
+    char** cands = NULL;
+    size_t ncands = 0;
+    if (lsh_query(dir, inputBuf, inputSig.size, &cands, &ncands) != 0)
+    {
+        fprintf(stderr, "No LSH index in %s, build it with lsh-index\n", dir);
+        *found = NULL;
+        return -1;
+    }
+
+    int res = search_run(dir, opts, k, nearest, cands, ncands, found, stats);
+    lsh_free_paths(cands, ncands);
+
+    if (!opts->exact)
+    {
+        if (res == 0)
+        {
+            fprintf(stderr, "PROBABILISTIC: %zu LSH candidates compared, --exact to search all\n", ncands);
+        }
+        return res;
+    }
+
+    list_free(*found);
+    *found = NULL;
+    if (res != 0)
+    {
+        return -1;
+    }
+
+    return search_run(dir, opts, k, nearest, NULL, 0, found, stats);
+}
+
+
+/* prints the first max files of list sorted by distance then name,
+ * with their distance if with_distance. Frees the list */
+static int search_print(node* list, bool with_distance, size_t max)
+{
+    /* get number of nodes in list */
+    int len = list_count(list);
+
+    /* no files found, return */
+    if (len <= 0)
+    {
+        return 0;
+    }
+
+    /* save list to array */
+    name_distance* arr = NULL;
+    if (list_namedistance_save_to_array(list, &arr) == -1)
+    {
+        /* free list */
+        list_free(list);
+        return -1;
+    }
+
+    /* free list */
+    list_free(list);
+
+    /* only the printed names are resolved: a symlinked file gets its target */
+    for (int i = 0; i < len; i++)
+    {
+        char resolvedPath[PATH_MAX + 1];
+        if (realpath(arr[i].filename, resolvedPath))
+        {
+            strlcpy(arr[i].filename, resolvedPath, sizeof(arr[i].filename));
+        }
+    }
+
+    /* order by distance asc, filename asc: workers finish in any order */
+    qsort(arr, len, sizeof(name_distance), cmpfunc);
+
+    /* print all, or the first max */
+    if ((size_t) len > max)
+    {
+        len = (int) max;
+    }
+    for (int i = 0; i < len; i++)
+    {
+        if (with_distance)
+            namedistance_print(&arr[i]);
+        else
+            printf("%s\n", arr[i].filename);
+    }
+    free(arr);
+
+    return 0;
+}
+
+
+int search_min(const char* f, const char* dir, const search_opts* opts)
+{
+    if (f == NULL || dir == NULL)
+    {
+        return -1;
+    }
+
+    /* set up parameters read by the workers */
+    if (search_load_input(f, opts->unit) != 0)
+    {
+        return -1;
+    }
+    lim = opts->unit == UNIT_BYTE ? (long) inputSig.size : (long) inputTokens.n;
+
+    /* the closest sizes first, each distance found bounding the others */
+    node* list = NULL;
+    filter_stats stats;
+    int res = search_drive(dir, opts, 0, true, &list, &stats);
+    search_release_input();
+    if (res != 0)
+    {
+        list_free(list);
+        return -1;
+    }
+
+    /* find min of list */
+    long min = list_namedistance_min(list);
+
+    /* filter list in place, keep elems w/ distance == min */
+    node* filterd = list_filter(list, (comparison_f) compare_fun, EQUAL_TO, min);
+
+    /* print filenames */
+    res = search_print(filterd, false, SIZE_MAX);
+    filter_print_stats(&stats, stderr);
+
+    return res;
+}
+
+
+int search_all(const char* f, const char* dir, long limit, const search_opts* opts)
+{
+    if (!f || !dir)
+    {
+        return -1;
+    }
+
+    /* set up parameters read by the workers */
+    if (search_load_input(f, opts->unit) != 0)
+    {
+        return -1;
+    }
+    lim = limit;
+
+    node* list = NULL;
+    filter_stats stats;
+    int res = search_drive(dir, opts, 0, false, &list, &stats);
+    search_release_input();
+    if (res != 0)
+    {
+        list_free(list);
+        return -1;
+    }
+
+    /* filter list in place, keep elems w/ distance <= limit */
+    node* filtered = list_filter(list, (comparison_f) compare_fun, EQ_LESS_THAN, limit);
+
+    res = search_print(filtered, true, SIZE_MAX);
+    filter_print_stats(&stats, stderr);
+
+    return res;
+}
+
+
+int search_k(const char* f, const char* dir, long k, const search_opts* opts)
+{
+    if (!f || !dir || k < 1)
+    {
+        return -1;
+    }
+
+    /* set up parameters read by the workers */
+    if (search_load_input(f, opts->unit) != 0)
+    {
+        return -1;
+    }
+    lim = LONG_MAX;
+
+    /* each worker keeps its own k best, the k best overall are among them */
+    node* list = NULL;
+    filter_stats stats;
+    int res = search_drive(dir, opts, (size_t) k, false, &list, &stats);
+    search_release_input();
+    if (res != 0)
+    {
+        list_free(list);
+        return -1;
+    }
+
+    res = search_print(list, true, (size_t) k);
+    filter_print_stats(&stats, stderr);
+
+    return res;
+}
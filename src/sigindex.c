@@ -0,0 +1,401 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>  // PATH_MAX
+#include <fcntl.h>   // open
+
+#include "../include/sigindex.h"
+#include "../include/util.h"
+
+
+/* seen marks */
+#define SEEN_WALKED 1
+#define SEEN_OUTDATED 2
+
+
+typedef struct
+{
+    char magic[SIGINDEX_MAGIC_LEN];
+    uint32_t entrysize;
+    uint64_t n;
+    uint64_t namesize;
+} sigindex_header;
+
+
+/* path relative to the directory, NULL if it's not under it */
+static const char* rel_path(const sigindex* idx, const char* path, size_t* len)
+{
+    if (strncmp(path, idx->root, idx->rootlen) != 0)
+    {
+        return NULL;
+    }
+
+    /* the root itself ends with '/' only if it's "/" */
+    path += idx->rootlen;
+    if (idx->root[idx->rootlen - 1] != '/')
+    {
+        if (*path != '/')
+        {
+            return NULL;
+        }
+        path++;
+    }
+
+    *len = strlen(path);
+    return path;
+}
+
+
+/* slot of the entry named name, or the free slot where it would go */
+static size_t slot_find(const sigindex* idx, const char* name, size_t len)
+{
+    size_t mask = idx->nslots - 1;
+
+    for (size_t i = hash_bytes(name, len) & mask;; i = (i + 1) & mask)
+    {
+        uint32_t s = idx->slots[i];
+        if (s == 0)
+        {
+            return i;
+        }
+
+        const sigindex_entry* e = &idx->entries[s - 1];
+        if (e->namelen == len && memcmp(idx->names + e->name, name, len) == 0)
+        {
+            return i;
+        }
+    }
+}
+
+
+/* entry of path, SIZE_MAX if it has none */
+static size_t entry_of(const sigindex* idx, const char* path)
+{
+    size_t len = 0;
+    const char* name = rel_path(idx, path, &len);
+    if (!name || idx->n == 0)
+    {
+        return SIZE_MAX;
+    }
+
+    uint32_t s = idx->slots[slot_find(idx, name, len)];
+    return s ? s - 1 : SIZE_MAX;
+}
+
+
+/* checks the mapped file is a whole index of this build */
+static bool index_valid(const char* map, size_t size)
+{
+    if (size < sizeof(sigindex_header))
+    {
+        return false;
+    }
+
+    sigindex_header h;
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, SIGINDEX_MAGIC, SIGINDEX_MAGIC_LEN) != 0 || h.entrysize != sizeof(sigindex_entry)
+        || h.n > UINT32_MAX - 1 || h.n > (size - sizeof(h)) / sizeof(sigindex_entry)
+        || h.namesize != size - sizeof(h) - h.n * sizeof(sigindex_entry))
+    {
+        return false;
+    }
+
+    const sigindex_entry* entries = (const sigindex_entry*) (map + sizeof(h));
+    for (uint64_t i = 0; i < h.n; i++)
+    {
+        if (entries[i].name > h.namesize || entries[i].namelen > h.namesize - entries[i].name)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+int sigindex_open(sigindex* idx, const char* dir)
+{
+    memset(idx, 0, sizeof(sigindex));
+
+    idx->root = realpath(dir, NULL);
+    struct stat st;
+    if (!idx->root || stat(idx->root, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        free(idx->root);
+        idx->root = NULL;
+        return -1;
+    }
+    idx->rootlen = strlen(idx->root);
+
+    char file[PATH_MAX];
+    if ((size_t) snprintf(file, sizeof(file), "%s/%s", idx->root, SIGINDEX_NAME) >= sizeof(file))
+    {
+        sigindex_close(idx);
+        return -1;
+    }
+
+    /* missing or unusable: start from an empty one */
+    if (file_map(file, &idx->map, &idx->mapsize) == 0 && !index_valid(idx->map, idx->mapsize))
+    {
+        file_unmap(idx->map, idx->mapsize);
+        idx->map = NULL;
+        idx->mapsize = 0;
+    }
+
+    if (idx->map)
+    {
+        sigindex_header h;
+        memcpy(&h, idx->map, sizeof(h));
+        idx->n = h.n;
+        idx->entries = (const sigindex_entry*) (idx->map + sizeof(h));
+        idx->names = (const char*) (idx->entries + h.n);
+    }
+
+    /* at most half full */
+    idx->nslots = 16;
+    while (idx->nslots < 2 * idx->n)
+    {
+        idx->nslots *= 2;
+    }
+
+    idx->slots = calloc(idx->nslots, sizeof(uint32_t));
+    idx->seen = calloc(idx->n ? idx->n : 1, sizeof(atomic_uchar));
+    if (!idx->slots || !idx->seen)
+    {
+        sigindex_close(idx);
+        return -1;
+    }
+
+    for (size_t i = 0; i < idx->n; i++)
+    {
+        const sigindex_entry* e = &idx->entries[i];
+        size_t s = slot_find(idx, idx->names + e->name, e->namelen);
+
+        /* a name twice: the first one wins, the other is dropped */
+        if (idx->slots[s] == 0)
+        {
+            idx->slots[s] = (uint32_t) i + 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void sigindex_mark(sigindex* idx, const char* path)
+{
+    size_t i = entry_of(idx, path);
+    /* outdated stays so, whichever thread marked it first */
+    if (i != SIZE_MAX)
+    {
+        unsigned char none = 0;
+        atomic_compare_exchange_strong_explicit(&idx->seen[i], &none, SEEN_WALKED, memory_order_relaxed,
+                                                memory_order_relaxed);
+    }
+}
+
+
+const sigindex_entry* sigindex_find(sigindex* idx, const char* path, const struct stat* st)
+{
+    size_t i = entry_of(idx, path);
+    if (i == SIZE_MAX)
+    {
+        return NULL;
+    }
+
+    const sigindex_entry* e = &idx->entries[i];
+    if (e->dev != (uint64_t) st->st_dev || e->ino != (uint64_t) st->st_ino || e->sig.size != (size_t) st->st_size
+        || e->mtime_sec != (int64_t) st->st_mtim.tv_sec || e->mtime_nsec != (int64_t) st->st_mtim.tv_nsec)
+    {
+        atomic_store_explicit(&idx->seen[i], SEEN_OUTDATED, memory_order_relaxed);
+        return NULL;
+    }
+
+    return e;
+}
+
+
+int sigindex_batch_add(sigindex_batch* b, const sigindex* idx, const char* path, const struct stat* st,
+                       uint64_t hash, const signature* sig)
+{
+    size_t len = 0;
+    const char* name = rel_path(idx, path, &len);
+    if (!name)
+    {
+        return 0;
+    }
+
+    if (b->n == b->cap)
+    {
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        sigindex_entry* entries = realloc(b->entries, cap * sizeof(sigindex_entry));
+        if (!entries)
+        {
+            return -1;
+        }
+
+        b->entries = entries;
+        b->cap = cap;
+    }
+
+    if (b->nnames + len > b->namecap)
+    {
+        size_t cap = b->namecap ? b->namecap : 4096;
+        while (cap < b->nnames + len)
+        {
+            cap *= 2;
+        }
+
+        char* names = realloc(b->names, cap);
+        if (!names)
+        {
+            return -1;
+        }
+
+        b->names = names;
+        b->namecap = cap;
+    }
+
+    sigindex_entry* e = &b->entries[b->n++];
+    memset(e, 0, sizeof(sigindex_entry));
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime_sec = st->st_mtim.tv_sec;
+    e->mtime_nsec = st->st_mtim.tv_nsec;
+    e->hash = hash;
+    e->name = b->nnames;
+    e->namelen = len;
+    e->sig = *sig;
+
+    memcpy(b->names + b->nnames, name, len);
+    b->nnames += len;
+
+    return 0;
+}
+
+
+void sigindex_batch_free(sigindex_batch* b)
+{
+    free(b->entries);
+    free(b->names);
+    memset(b, 0, sizeof(sigindex_batch));
+}
+
+
+/* the old entry i goes in the new index */
+static inline bool entry_kept(const sigindex* idx, size_t i)
+{
+    const sigindex_entry* e = &idx->entries[i];
+    return atomic_load_explicit(&idx->seen[i], memory_order_relaxed) == SEEN_WALKED
+           && idx->slots[slot_find(idx, idx->names + e->name, e->namelen)] == (uint32_t) i + 1;
+}
+
+
+int sigindex_save(sigindex* idx, const sigindex_batch* batches, int nbatches)
+{
+    sigindex_header h;
+    memcpy(h.magic, SIGINDEX_MAGIC, SIGINDEX_MAGIC_LEN);
+    h.entrysize = sizeof(sigindex_entry);
+    h.n = 0;
+    h.namesize = 0;
+
+    for (size_t i = 0; i < idx->n; i++)
+    {
+        if (entry_kept(idx, i))
+        {
+            h.n++;
+            h.namesize += idx->entries[i].namelen;
+        }
+    }
+
+    /* nothing added, nothing dropped */
+    bool changed = h.n != idx->n || !idx->map;
+    for (int t = 0; t < nbatches; t++)
+    {
+        h.n += batches[t].n;
+        h.namesize += batches[t].nnames;
+        changed = changed || batches[t].n > 0;
+    }
+
+    if (!changed || h.n > UINT32_MAX - 1)
+    {
+        return 0;
+    }
+
+    char file[PATH_MAX];
+    char tmp[PATH_MAX];
+    FILE* f = NULL;
+    if ((size_t) snprintf(file, sizeof(file), "%s/%s", idx->root, SIGINDEX_NAME) >= sizeof(file)
+        || !(f = file_replace_open(file, tmp)))
+    {
+        return -1;
+    }
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    /* entries with the offsets of their names in the new file */
+    uint64_t name = 0;
+    for (size_t i = 0; ok && i < idx->n; i++)
+    {
+        if (entry_kept(idx, i))
+        {
+            sigindex_entry e = idx->entries[i];
+            e.name = name;
+            name += e.namelen;
+            ok = fwrite(&e, sizeof(e), 1, f) == 1;
+        }
+    }
+    for (int t = 0; ok && t < nbatches; t++)
+    {
+        for (size_t i = 0; ok && i < batches[t].n; i++)
+        {
+            sigindex_entry e = batches[t].entries[i];
+            e.name += name;
+            ok = fwrite(&e, sizeof(e), 1, f) == 1;
+        }
+        name += batches[t].nnames;
+    }
+
+    /* then the names, in the same order */
+    for (size_t i = 0; ok && i < idx->n; i++)
+    {
+        if (entry_kept(idx, i))
+        {
+            const sigindex_entry* e = &idx->entries[i];
+            ok = fwrite(idx->names + e->name, 1, e->namelen, f) == e->namelen;
+        }
+    }
+    for (int t = 0; ok && t < nbatches; t++)
+    {
+        ok = fwrite(batches[t].names, 1, batches[t].nnames, f) == batches[t].nnames;
+    }
+
+    return file_replace_commit(f, tmp, file, ok);
+}
+
+
+void sigindex_close(sigindex* idx)
+{
+    file_unmap(idx->map, idx->mapsize);
+    free(idx->root);
+    free(idx->slots);
+    free(idx->seen);
+    memset(idx, 0, sizeof(sigindex));
+}
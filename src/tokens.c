@@ -0,0 +1,351 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>  // LONG_MAX
+
+#include "../include/tokens.h"
+#include "../include/distance.h"
+#include "../include/distcache.h"
+#include "../include/util.h"
+
+
+/* FNV-1a */
+#define HASH_BASIS 0xcbf29ce484222325ULL
+#define HASH_PRIME 0x100000001b3ULL
+
+
+int unit_parse(const char* name, unit_t* unit)
+{
+    if (strcmp(name, "byte") == 0)
+    {
+        *unit = UNIT_BYTE;
+    }
+    else if (strcmp(name, "line") == 0)
+    {
+        *unit = UNIT_LINE;
+    }
+    else if (strcmp(name, "word") == 0)
+    {
+        *unit = UNIT_WORD;
+    }
+    else
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static inline bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+
+/* finds the token at or after *pos, false when there are no more */
+static bool token_next(const char* buf, size_t len, unit_t unit, size_t* pos, const char** tok, size_t* toklen)
+{
+    size_t i = *pos;
+
+    if (unit == UNIT_LINE)
+    {
+        if (i >= len)
+        {
+            return false;
+        }
+
+        const char* nl = memchr(buf + i, '\n', len - i);
+        size_t end = nl ? (size_t) (nl - buf) : len;
+
+        *tok = buf + i;
+        *toklen = end - i;
+        *pos = nl ? end + 1 : len;
+        return true;
+    }
+
+    while (i < len && is_blank(buf[i]))
+    {
+        i++;
+    }
+    if (i == len)
+    {
+        *pos = len;
+        return false;
+    }
+
+    size_t start = i;
+    while (i < len && !is_blank(buf[i]))
+    {
+        i++;
+    }
+
+    *tok = buf + start;
+    *toklen = i - start;
+    *pos = i;
+    return true;
+}
+
+
+static uint64_t token_hash(const char* p, size_t len)
+{
+    uint64_t h = HASH_BASIS;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char) p[i]) * HASH_PRIME;
+    }
+
+    return h;
+}
+
+
+/* slot holding the token, or the free slot where it would go */
+static token_slot* token_find(const token_slot* slots, size_t nslots, const char* p, size_t len, uint64_t hash)
+{
+    size_t mask = nslots - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        const token_slot* s = &slots[i];
+        if (!s->p || (s->hash == hash && s->len == len && memcmp(s->p, p, len) == 0))
+        {
+            return (token_slot*) s;
+        }
+    }
+}
+
+
+/* doubles the slots, the table is kept at most half full */
+static int tokens_grow(token_table* t)
+{
+    size_t nslots = t->nslots ? t->nslots * 2 : 1024;
+    token_slot* slots = calloc(nslots, sizeof(token_slot));
+    if (!slots)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < t->nslots; i++)
+    {
+        if (t->slots[i].p)
+        {
+            *token_find(slots, nslots, t->slots[i].p, t->slots[i].len, t->slots[i].hash) = t->slots[i];
+        }
+    }
+
+    free(t->slots);
+    t->slots = slots;
+    t->nslots = nslots;
+
+    return 0;
+}
+
+
+/* appends id to the growing array ids */
+static int ids_push(uint32_t** ids, size_t* n, size_t* cap, uint32_t id)
+{
+    if (*n == *cap)
+    {
+        size_t c = *cap ? *cap * 2 : 1024;
+        uint32_t* p = realloc(*ids, c * sizeof(uint32_t));
+        if (!p)
+        {
+            return -1;
+        }
+
+        *ids = p;
+        *cap = c;
+    }
+
+    (*ids)[(*n)++] = id;
+    return 0;
+}
+
+
+/* the ids of buf's tokens appended to ids, the new ones added to t */
+static int tokens_insert(token_table* t, const char* buf, size_t len, uint32_t** ids, size_t* n)
+{
+    size_t cap = *n;
+    size_t pos = 0;
+    const char* tok;
+    size_t toklen;
+
+    while (token_next(buf, len, t->unit, &pos, &tok, &toklen))
+    {
+        if (2 * ((size_t) t->nids + 1) > t->nslots && tokens_grow(t) != 0)
+        {
+            return -1;
+        }
+
+        uint64_t hash = token_hash(tok, toklen);
+        token_slot* s = token_find(t->slots, t->nslots, tok, toklen, hash);
+        if (!s->p)
+        {
+            /* the last id is kept for tokens not found */
+            if (t->nids == UINT32_MAX - 1)
+            {
+                return -1;
+            }
+
+            *s = (token_slot) {tok, toklen, hash, t->nids++};
+        }
+
+        if (ids_push(ids, n, &cap, s->id) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int tokens_intern(const char* buf, size_t len, unit_t unit, token_table* t)
+{
+    memset(t, 0, sizeof(token_table));
+    t->unit = unit;
+
+    if (tokens_insert(t, buf, len, &t->ids, &t->n) != 0)
+    {
+        tokens_free(t);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int tokens_add(token_table* t, const char* buf, size_t len, uint32_t** ids, size_t* n)
+{
+    *ids = NULL;
+    *n = 0;
+
+    if (tokens_insert(t, buf, len, ids, n) != 0)
+    {
+        free(*ids);
+        *ids = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int tokens_lookup(const token_table* t, const char* buf, size_t len, uint32_t** ids, size_t* n)
+{
+    *ids = NULL;
+    *n = 0;
+
+    size_t cap = 0;
+    size_t pos = 0;
+    const char* tok;
+    size_t toklen;
+
+    while (token_next(buf, len, t->unit, &pos, &tok, &toklen))
+    {
+        uint32_t id = t->nids;
+        if (t->nslots > 0)
+        {
+            token_slot* s = token_find(t->slots, t->nslots, tok, toklen, token_hash(tok, toklen));
+            id = s->p ? s->id : t->nids;
+        }
+
+        if (ids_push(ids, n, &cap, id) != 0)
+        {
+            free(*ids);
+            *ids = NULL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+void tokens_free(token_table* t)
+{
+    free(t->slots);
+    free(t->ids);
+    memset(t, 0, sizeof(token_table));
+}
+
+
+long tokens_file_distance(const char* file1, const char* file2, unit_t unit)
+{
+    if (unit == UNIT_BYTE)
+    {
+        return distance_file(file1, file2);
+    }
+
+    const char* buf1 = NULL;
+    const char* buf2 = NULL;
+    size_t size1 = 0;
+    size_t size2 = 0;
+
+    if (file_map(file1, &buf1, &size1) != 0)
+    {
+        return -1;
+    }
+    if (file_map(file2, &buf2, &size2) != 0)
+    {
+        file_unmap(buf1, size1);
+        return -1;
+    }
+
+    long dist = -1;
+    token_table t;
+    uint32_t* ids = NULL;
+    size_t n = 0;
+
+    /* the same contents asked before, under any name */
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    bool cached = distcache_enabled();
+    if (cached)
+    {
+        h1 = hash_bytes(buf1, size1);
+        h2 = hash_bytes(buf2, size2);
+        if (distcache_get(h1, size1, h2, size2, unit, LONG_MAX, &dist))
+        {
+            file_unmap(buf1, size1);
+            file_unmap(buf2, size2);
+            return dist;
+        }
+    }
+
+    if (tokens_intern(buf1, size1, unit, &t) == 0)
+    {
+        if (tokens_lookup(&t, buf2, size2, &ids, &n) == 0)
+        {
+            dist = distance_ids(t.ids, t.n, ids, n, t.nids + 1);
+            free(ids);
+        }
+        tokens_free(&t);
+    }
+
+    if (cached)
+    {
+        distcache_put(h1, size1, h2, size2, unit, LONG_MAX, dist);
+    }
+
+    file_unmap(buf1, size1);
+    file_unmap(buf2, size2);
+
+    return dist;
+}
@@ -15,9 +15,17 @@
 *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE // sched_getaffinity
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <sched.h>    // sched_getaffinity
 #include <sys/stat.h>
+#include <sys/mman.h> // mmap
+#include <fcntl.h>    // open
+#include <unistd.h>   // close, sysconf
+#include <string.h>   // memcpy, strncmp
+#include <limits.h>   // PATH_MAX
 
 #include "../include/util.h"
 
@@ -34,34 +42,7 @@ int minmin(int x, int y, int z)
 }
 
 
-int file_copy_to(FILE* infile, FILE* outfile, u_int32_t pos_to)
-{
-    char c;
-
-    while (ftell(infile) < pos_to)
-    {
-        /* read & copy char by char */
-        if (fread(&c, 1, 1, infile) != 0)
-        {
-            fputc(c, outfile);
-        }
-    }
-
-    return 0;
-}
-
-
-void file_copy(FILE* infile, FILE* outfile)
-{
-    char c = 0;
-    while (fread(&c, 1, 1, infile))
-    {
-        fputc(c, outfile);
-    }
-}
-
-
-int file_load(const char* filename, char** buffer)
+long file_load(const char* filename, char** buffer)
 {
     /* open read */
     FILE *f = fopen(filename, "r");
@@ -74,7 +55,7 @@ int file_load(const char* filename, char** buffer)
     /* get file size */
     struct stat st;
     stat(filename, &st);
-    int size = st.st_size;
+    long size = st.st_size;
 
     /* reset seek */
     fseek(f, 0, SEEK_SET);
@@ -83,7 +64,7 @@ int file_load(const char* filename, char** buffer)
     *buffer = (char*) calloc(size + 1, sizeof(char));
 
     /* copy file contents into buffer */
-    if (!*buffer || fread(*buffer, sizeof(char), size, f) != size)
+    if (!*buffer || fread(*buffer, sizeof(char), size, f) != (size_t) size)
     {
         free(*buffer);
         return -2;
@@ -99,7 +80,231 @@ int file_load(const char* filename, char** buffer)
 }
 
 
+int file_map(const char* filename, const char** buffer, size_t* size)
+{
+    *buffer = NULL;
+    *size = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    int ret = file_map_fd(fd, st.st_size, buffer);
+    close(fd);
+    if (ret != 0)
+    {
+        return -1;
+    }
+
+    *size = st.st_size;
+
+    return 0;
+}
+
+
+int file_map_fd(int fd, size_t size, const char** buffer)
+{
+    *buffer = NULL;
+
+    /* nothing to map */
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    *buffer = (const char*) p;
+
+    return 0;
+}
+
+
+void file_unmap(const char* buffer, size_t size)
+{
+    if (buffer)
+    {
+        munmap((void*) buffer, size);
+    }
+}
+
+
 u_int32_t bytes_to_uint32(const char* buf)
 {
-    return buf[0] + (buf[1] << 8) + (buf[2] << 16) + (buf[3] << 24);
+    const unsigned char* b = (const unsigned char*) buf;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((u_int32_t) b[3] << 24);
+}
+
+
+bool file_is_own(const char* path, size_t len)
+{
+    const char* base = path + len;
+    while (base > path && base[-1] != '/')
+    {
+        base--;
+    }
+
+    return strncmp(base, OWN_PREFIX, sizeof(OWN_PREFIX) - 1) == 0;
+}
+
+
+FILE* file_replace_open(const char* file, char* tmp)
+{
+    if ((size_t) snprintf(tmp, PATH_MAX, "%s.XXXXXX", file) >= PATH_MAX)
+    {
+        return NULL;
+    }
+
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    fchmod(fd, 0644);
+
+    FILE* f = fdopen(fd, "wb");
+    if (!f)
+    {
+        close(fd);
+        unlink(tmp);
+    }
+
+    return f;
+}
+
+
+int file_replace_commit(FILE* f, const char* tmp, const char* file, bool ok)
+{
+    if (fclose(f) != 0 || !ok || rename(tmp, file) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* multipliers of the hash, odd 64-bit constants */
+#define HASH_M1 0x9e3779b97f4a7c15ULL
+#define HASH_M2 0xc2b2ae3d27d4eb4fULL
+
+
+static inline uint64_t hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= HASH_M2;
+    h ^= h >> 29;
+    return h;
+}
+
+
+uint64_t hash_bytes(const char* buf, size_t len)
+{
+    /* four independent lanes of 8 bytes, so that the multiplies overlap */
+    uint64_t lane[4] = {HASH_M1, HASH_M2, ~HASH_M1, ~HASH_M2};
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            uint64_t w;
+            memcpy(&w, buf + i + 8 * j, 8);
+            lane[j] = (lane[j] ^ w) * HASH_M1;
+            lane[j] ^= lane[j] >> 31;
+        }
+    }
+
+    uint64_t h = (uint64_t) len * HASH_M2;
+    for (int j = 0; j < 4; j++)
+    {
+        h = (h ^ hash_mix(lane[j])) * HASH_M1;
+    }
+
+    /* the tail, a byte at a time */
+    for (; i < len; i++)
+    {
+        h = (h ^ (unsigned char) buf[i]) * HASH_M2;
+    }
+
+    return hash_mix(h);
+}
+
+
+/* cpus granted by a cgroup quota of quota us every period us, rounded up */
+static int cpu_quota(long long quota, long long period)
+{
+    if (quota <= 0 || period <= 0)
+    {
+        return 0;
+    }
+
+    return (int) ((quota + period - 1) / period);
+}
+
+
+int cpu_count(void)
+{
+    int n = 0;
+
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        n = CPU_COUNT(&set);
+    }
+    if (n <= 0)
+    {
+        n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    /* cgroup v2: "quota period", or "max period" if unlimited */
+    int quota = 0;
+    FILE* f = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (f)
+    {
+        long long q = 0;
+        long long p = 0;
+        if (fscanf(f, "%lld %lld", &q, &p) == 2)
+        {
+            quota = cpu_quota(q, p);
+        }
+        fclose(f);
+    }
+    else
+    {
+        /* cgroup v1: the quota is -1 if unlimited */
+        FILE* fq = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+        FILE* fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+        long long q = 0;
+        long long p = 0;
+        if (fq && fp && fscanf(fq, "%lld", &q) == 1 && fscanf(fp, "%lld", &p) == 1)
+        {
+            quota = cpu_quota(q, p);
+        }
+        if (fq)
+            fclose(fq);
+        if (fp)
+            fclose(fp);
+    }
+
+    if (quota > 0 && quota < n)
+    {
+        n = quota;
+    }
+
+    return n > 0 ? n : 1;
 }
@@ -0,0 +1,1147 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>  // PATH_MAX
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../include/vptree.h"
+#include "../include/distance.h"
+#include "../include/util.h"
+#include "../include/walk.h"
+
+
+/* subsets smaller than this are measured, and split, by one thread */
+#define SPLIT_PARALLEL 64
+
+
+typedef struct
+{
+    char magic[VPTREE_MAGIC_LEN];
+    uint32_t unit;
+    uint64_t n;
+    uint64_t namesize;
+} vptree_header;
+
+
+/* a file of the build, the node it becomes in the same place */
+typedef struct
+{
+    char* name;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    long d;            /* from the vantage point of the subset being split */
+    int64_t radius;
+    uint32_t inside;
+    uint32_t count;
+} vptree_file;
+
+
+typedef struct
+{
+    const char* root;
+    size_t rootlen;
+    unit_t unit;
+    vptree_file* files;
+    atomic_bool failed;
+} vptree_job;
+
+
+/* the distances of a subset from its vantage point, taken by the threads in turn */
+typedef struct
+{
+    vptree_job* job;
+    const char* buf;
+    size_t len;
+    const token_table* t;
+    atomic_size_t next;
+    size_t hi;
+} vptree_measure;
+
+
+/* a subtree built by a thread of its own */
+typedef struct
+{
+    vptree_job* job;
+    size_t lo;
+    size_t hi;
+    int threads;
+} vptree_subtree;
+
+
+/* what the walk before a query found of the file of a node */
+typedef enum
+{
+    NODE_GONE,      /* removed, or unreadable now */
+    NODE_FRESH,     /* as it was built */
+    NODE_CHANGED    /* since the build */
+} vptree_state;
+
+
+/* the paths of the files one walker found the tree doesn't have as they are */
+typedef struct
+{
+    char** paths;
+    size_t n;
+    size_t cap;
+    unsigned long changed;   /* of them, those in the tree */
+} vptree_stale;
+
+
+/* The walk checking the tree against the directory before a query: the
+ * nodes are found by name, the slots hold their index + 1, 0 if empty. */
+typedef struct
+{
+    const vptree_node* nodes;
+    const char* names;
+    size_t rootlen;
+    uint32_t* slots;
+    size_t nslots;            /* a power of 2 */
+    unsigned char* state;     /* of each node, a vptree_state */
+    vptree_stale* walkers;
+} vptree_check;
+
+
+/* a subtree left to search, none of its files closer than lb */
+typedef struct
+{
+    uint32_t node;
+    long lb;
+} vptree_todo;
+
+
+/* A query. The workers compare the files of extras first, then take
+ * the subtrees from todo and push the children they can't rule out;
+ * the lock guards all but the tree and the files. */
+typedef struct
+{
+    const vptree_node* nodes;
+    const char* names;
+    const unsigned char* state;   /* of each node, a vptree_state */
+    char** extras;                /* the files changed or added since the build */
+    size_t nextras;
+    const char* root;
+    size_t rootlen;
+    const char* buf;
+    size_t len;
+    const token_table* t;
+    size_t k;
+    bool nearest;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t nextra;        /* first of extras not taken yet */
+    vptree_todo* todo;
+    size_t ntodo;
+    size_t captodo;
+    int busy;             /* workers computing a distance */
+    long tau;             /* the bound, only ever lowered */
+    long* heap;           /* k: the k best distances, the worst on top */
+    size_t nheap;
+    vptree_hit* hits;
+    size_t nhits;
+    size_t caphits;
+    unsigned long compared;
+    bool failed;
+} vptree_search;
+
+
+/* distance of b from a, interned in t unless bytes are counted, if it doesn't exceed k */
+static long pair_distance(const char* a, size_t alen, const token_table* t, const char* b, size_t blen, long k)
+{
+    if (!t)
+    {
+        return distance_string_bounded(a, alen, b, blen, k);
+    }
+
+    uint32_t* ids = NULL;
+    size_t n = 0;
+    if (tokens_lookup(t, b, blen, &ids, &n) != 0)
+    {
+        return -1;
+    }
+
+    long d = distance_ids_bounded(t->ids, t->n, ids, n, t->nids + 1, k);
+    free(ids);
+
+    return d;
+}
+
+
+/* the path of the file named name under root in path, a PATH_MAX buffer */
+static int name_path(const char* root, size_t rootlen, const char* name, size_t len, char* path)
+{
+    if (rootlen + 1 + len >= PATH_MAX)
+    {
+        return -1;
+    }
+
+    memcpy(path, root, rootlen);
+    path[rootlen] = '/';
+    memcpy(path + rootlen + 1, name, len);
+    path[rootlen + 1 + len] = '\0';
+
+    return 0;
+}
+
+
+/* maps the file named name under root, path a PATH_MAX buffer */
+static int name_map(const char* root, size_t rootlen, const char* name, size_t len, char* path,
+                    const char** buf, size_t* size)
+{
+    if (name_path(root, rootlen, name, len, path) != 0)
+    {
+        return -1;
+    }
+
+    return file_map(path, buf, size);
+}
+
+
+static void* measure_run(void* arg)
+{
+    vptree_measure* m = (vptree_measure*) arg;
+    vptree_job* job = m->job;
+    char path[PATH_MAX];
+
+    size_t i;
+    while (!job->failed && (i = atomic_fetch_add(&m->next, 1)) < m->hi)
+    {
+        vptree_file* f = &job->files[i];
+        const char* buf = NULL;
+        size_t len = 0;
+        if (name_map(job->root, job->rootlen, f->name, strlen(f->name), path, &buf, &len) != 0)
+        {
+            job->failed = true;
+            break;
+        }
+
+        f->d = pair_distance(m->buf, m->len, m->t, buf, len, BOUND_MAX);
+        file_unmap(buf, len);
+
+        if (f->d < 0)
+        {
+            job->failed = true;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* finds the distances of files lo + 1 .. hi from lo, their vantage point */
+static int measure(vptree_job* job, size_t lo, size_t hi, int threads)
+{
+    char path[PATH_MAX];
+    const vptree_file* vp = &job->files[lo];
+
+    vptree_measure m;
+    m.job = job;
+    m.hi = hi;
+    m.t = NULL;
+    atomic_init(&m.next, lo + 1);
+    if (name_map(job->root, job->rootlen, vp->name, strlen(vp->name), path, &m.buf, &m.len) != 0)
+    {
+        job->failed = true;
+        return -1;
+    }
+
+    token_table t;
+    if (job->unit != UNIT_BYTE)
+    {
+        if (tokens_intern(m.buf, m.len, job->unit, &t) != 0)
+        {
+            file_unmap(m.buf, m.len);
+            job->failed = true;
+            return -1;
+        }
+        m.t = &t;
+    }
+
+    /* the calling thread measures too */
+    int nthreads = threads > 1 && hi - lo > SPLIT_PARALLEL ? threads : 1;
+    pthread_t* tids = malloc(nthreads * sizeof(pthread_t));
+    int started = 1;
+    while (tids && started < nthreads && pthread_create(&tids[started], NULL, measure_run, &m) == 0)
+    {
+        started++;
+    }
+
+    measure_run(&m);
+
+    for (int i = 1; tids && i < started; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+
+    if (m.t)
+    {
+        tokens_free(&t);
+    }
+    file_unmap(m.buf, m.len);
+
+    return job->failed ? -1 : 0;
+}
+
+
+static int file_d_cmp(const void* a, const void* b)
+{
+    long x = ((const vptree_file*) a)->d;
+    long y = ((const vptree_file*) b)->d;
+    return x < y ? -1 : x > y;
+}
+
+
+static void build_subtree(vptree_job* job, size_t lo, size_t hi, int threads);
+
+
+static void* subtree_run(void* arg)
+{
+    vptree_subtree* s = (vptree_subtree*) arg;
+    build_subtree(s->job, s->lo, s->hi, s->threads);
+    return NULL;
+}
+
+
+/* Makes files lo .. hi a subtree: a vantage point in lo, the files
+ * closer than the median of their distances from it right after, the
+ * others after them. The smaller half is built first, or by a thread
+ * of its own, the bigger one goes on in the loop: the stack stays
+ * shallow even if the distances don't split the files evenly. */
+static void build_subtree(vptree_job* job, size_t lo, size_t hi, int threads)
+{
+    pthread_t tids[sizeof(int) * 8];
+    vptree_subtree subs[sizeof(int) * 8];
+    int nsubs = 0;
+
+    while (lo < hi && !job->failed)
+    {
+        vptree_file* files = job->files;
+        size_t n = hi - lo;
+
+        /* a vantage point at random, the same one for the same files */
+        uint64_t seed[2] = {lo, hi};
+        size_t pick = lo + hash_bytes((const char*) seed, sizeof(seed)) % n;
+        vptree_file tmp = files[lo];
+        files[lo] = files[pick];
+        files[pick] = tmp;
+
+        vptree_file* vp = &files[lo];
+        vp->count = (uint32_t) n;
+        vp->inside = 0;
+        vp->radius = 0;
+        if (n == 1 || measure(job, lo, hi, threads) != 0)
+        {
+            break;
+        }
+
+        qsort(files + lo + 1, n - 1, sizeof(vptree_file), file_d_cmp);
+
+        /* the files as far as the median go inside, or those closer
+         * than it, whichever splits them more evenly */
+        size_t first = lo + 1;
+        size_t half = first + (n - 1) / 2;
+        long median = files[half].d;
+        size_t below = half;
+        size_t upto = half;
+        while (below > first && files[below - 1].d == median)
+        {
+            below--;
+        }
+        while (upto < hi && files[upto].d == median)
+        {
+            upto++;
+        }
+
+        size_t end = upto;
+        vp->radius = median;
+        if (half - below < upto - half && below > first)
+        {
+            end = below;
+            vp->radius = median - 1;
+        }
+        vp->inside = (uint32_t) (end - first);
+
+        size_t sublo = first;
+        size_t subhi = end;
+        lo = end;
+        if (end - first > hi - end)
+        {
+            sublo = end;
+            subhi = hi;
+            lo = first;
+            hi = end;
+        }
+
+        /* the thread gets half of the threads left */
+        if (threads > 1 && subhi - sublo >= SPLIT_PARALLEL && nsubs < (int) (sizeof(tids) / sizeof(tids[0])))
+        {
+            subs[nsubs] = (vptree_subtree) {job, sublo, subhi, threads / 2};
+            if (pthread_create(&tids[nsubs], NULL, subtree_run, &subs[nsubs]) == 0)
+            {
+                threads -= threads / 2;
+                nsubs++;
+                continue;
+            }
+        }
+
+        build_subtree(job, sublo, subhi, threads);
+    }
+
+    for (int i = 0; i < nsubs; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+}
+
+
+/* writes the tree of the files to file */
+static int vptree_write(const char* file, unit_t unit, const vptree_file* files, size_t n)
+{
+    char tmp[PATH_MAX];
+    FILE* f = file_replace_open(file, tmp);
+    if (!f)
+    {
+        return -1;
+    }
+
+    vptree_header h;
+    memcpy(h.magic, VPTREE_MAGIC, VPTREE_MAGIC_LEN);
+    h.unit = unit;
+    h.n = n;
+    h.namesize = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        h.namesize += strlen(files[i].name);
+    }
+
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    uint64_t off = 0;
+    for (size_t i = 0; ok && i < n; i++)
+    {
+        vptree_node nd;
+        memset(&nd, 0, sizeof(nd));
+        nd.radius = files[i].radius;
+        nd.size = files[i].size;
+        nd.mtime_sec = files[i].mtime_sec;
+        nd.mtime_nsec = files[i].mtime_nsec;
+        nd.name = off;
+        nd.namelen = (uint32_t) strlen(files[i].name);
+        nd.inside = files[i].inside;
+        nd.count = files[i].count;
+        off += nd.namelen;
+        ok = fwrite(&nd, sizeof(nd), 1, f) == 1;
+    }
+    for (size_t i = 0; ok && i < n; i++)
+    {
+        size_t len = strlen(files[i].name);
+        ok = fwrite(files[i].name, 1, len, f) == len;
+    }
+
+    return file_replace_commit(f, tmp, file, ok);
+}
+
+
+long vptree_build(const char* dir, unit_t unit, int threads)
+{
+    char* root = realpath(dir, NULL);
+    char file[PATH_MAX];
+    if (!root || (size_t) snprintf(file, sizeof(file), "%s/%s", root, VPTREE_NAME) >= sizeof(file))
+    {
+        free(root);
+        return -1;
+    }
+
+    int nthreads = threads < 1 ? 1 : threads;
+    vptree_job job;
+    job.root = root;
+    job.rootlen = strlen(root);
+    job.unit = unit;
+    job.files = NULL;
+    atomic_init(&job.failed, false);
+
+    /* in name order: the same files make the same tree */
+    walk_file* found = NULL;
+    size_t n = 0;
+    int res = walk_collect(root, nthreads, &found, &n);
+
+    job.files = res == 0 ? calloc(n ? n : 1, sizeof(vptree_file)) : NULL;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (job.files)
+        {
+            vptree_file* f = &job.files[i];
+            f->name = found[i].name;
+            f->size = found[i].size;
+            f->mtime_sec = found[i].mtime_sec;
+            f->mtime_nsec = found[i].mtime_nsec;
+        }
+        else
+        {
+            free(found[i].name);
+        }
+    }
+    free(found);
+
+    if (job.files && n < UINT32_MAX)
+    {
+        build_subtree(&job, 0, n, nthreads);
+        if (job.failed || vptree_write(file, unit, job.files, n) != 0)
+        {
+            res = -1;
+        }
+    }
+    else
+    {
+        res = -1;
+    }
+
+    for (size_t i = 0; job.files && i < n; i++)
+    {
+        free(job.files[i].name);
+    }
+    free(job.files);
+    free(root);
+
+    return res == 0 ? (long) n : -1;
+}
+
+
+/* checks the mapped file is a whole tree of this build */
+static bool tree_valid(const char* map, size_t size)
+{
+    if (size < sizeof(vptree_header))
+    {
+        return false;
+    }
+
+    vptree_header h;
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, VPTREE_MAGIC, VPTREE_MAGIC_LEN) != 0 || h.n >= UINT32_MAX
+        || h.n > (size - sizeof(h)) / sizeof(vptree_node)
+        || h.namesize != size - sizeof(h) - h.n * sizeof(vptree_node))
+    {
+        return false;
+    }
+
+    const vptree_node* nodes = (const vptree_node*) (map + sizeof(h));
+    for (uint64_t i = 0; i < h.n; i++)
+    {
+        const vptree_node* nd = &nodes[i];
+        if (nd->name > h.namesize || nd->namelen > h.namesize - nd->name
+            || nd->count == 0 || nd->count > h.n - i || nd->inside >= nd->count || nd->radius < 0)
+        {
+            return false;
+        }
+    }
+
+    return h.n == 0 || nodes[0].count == h.n;
+}
+
+
+static int todo_push(vptree_search* s, uint32_t node, long lb)
+{
+    if (s->ntodo == s->captodo)
+    {
+        size_t cap = s->captodo ? s->captodo * 2 : 64;
+        vptree_todo* todo = realloc(s->todo, cap * sizeof(vptree_todo));
+        if (!todo)
+        {
+            return -1;
+        }
+
+        s->todo = todo;
+        s->captodo = cap;
+    }
+
+    s->todo[s->ntodo++] = (vptree_todo) {node, lb};
+    return 0;
+}
+
+
+/* keeps d among the k best distances, the worst of them on top */
+static void heap_keep(vptree_search* s, long d)
+{
+    long* heap = s->heap;
+    size_t i;
+
+    if (s->nheap < s->k)
+    {
+        /* up from the bottom */
+        i = s->nheap++;
+        while (i > 0 && heap[(i - 1) / 2] < d)
+        {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = d;
+        return;
+    }
+
+    if (d >= heap[0])
+    {
+        return;
+    }
+
+    /* down from the top */
+    i = 0;
+    for (;;)
+    {
+        size_t c = 2 * i + 1;
+        if (c >= s->k)
+        {
+            break;
+        }
+        if (c + 1 < s->k && heap[c + 1] > heap[c])
+        {
+            c++;
+        }
+        if (heap[c] <= d)
+        {
+            break;
+        }
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = d;
+}
+
+
+/* the distance of the query from the file at path if it's within bound,
+ * bound + 1 if farther. -1 if unreadable, -2 if out of memory */
+static long path_distance(const vptree_search* s, const char* path, long bound)
+{
+    const char* buf = NULL;
+    size_t len = 0;
+    if (file_map(path, &buf, &len) != 0)
+    {
+        return -1;
+    }
+
+    long d = pair_distance(s->buf, s->len, s->t, buf, len, bound);
+    file_unmap(buf, len);
+
+    return d < 0 ? -2 : d;
+}
+
+
+static int hit_add(vptree_search* s, const char* path, long d)
+{
+    if (s->nhits == s->caphits)
+    {
+        size_t cap = s->caphits ? s->caphits * 2 : 64;
+        vptree_hit* hits = realloc(s->hits, cap * sizeof(vptree_hit));
+        if (!hits)
+        {
+            return -1;
+        }
+
+        s->hits = hits;
+        s->caphits = cap;
+    }
+
+    char* p = strdup(path);
+    if (!p)
+    {
+        return -1;
+    }
+
+    s->hits[s->nhits++] = (vptree_hit) {p, d};
+    return 0;
+}
+
+
+/* Takes in the distance d of the query from the file at path, -1 if
+ * there's none, keeping it if within the bound, which it may lower.
+ * Called with the lock held */
+static int distance_done(vptree_search* s, const char* path, long d)
+{
+    if (d < 0)
+    {
+        return 0;
+    }
+
+    s->compared++;
+    if (d > s->tau)
+    {
+        return 0;
+    }
+
+    if (hit_add(s, path, d) != 0)
+    {
+        return -1;
+    }
+
+    if (s->k > 0)
+    {
+        heap_keep(s, d);
+        if (s->nheap == s->k && s->heap[0] < s->tau)
+        {
+            s->tau = s->heap[0];
+        }
+    }
+    else if (s->nearest && d < s->tau)
+    {
+        s->tau = d;
+    }
+
+    return 0;
+}
+
+
+/* Takes in the distance d of the query from the vantage point of
+ * todo, bounded by bound, and pushes the subtrees it can't rule out.
+ * Without a distance, -1, both are pushed. The one likelier to hold
+ * the closest files goes last, to be taken first. Called with the
+ * lock held */
+static int node_done(vptree_search* s, vptree_todo todo, long d, long bound, const char* path)
+{
+    const vptree_node* nd = &s->nodes[todo.node];
+    uint32_t outside = nd->count - 1 - nd->inside;
+    long in_lb = todo.lb;
+    long out_lb = todo.lb;
+    bool in = nd->inside > 0;
+    bool out = outside > 0;
+
+    if (distance_done(s, path, d) != 0)
+    {
+        return -1;
+    }
+
+    if (d >= 0)
+    {
+        if (d > bound)
+        {
+            /* farther than radius + tau: nothing inside is within tau */
+            in = false;
+        }
+        else
+        {
+            in_lb = d - nd->radius > in_lb ? d - nd->radius : in_lb;
+            out_lb = nd->radius + 1 - d > out_lb ? nd->radius + 1 - d : out_lb;
+        }
+    }
+
+    in = in && in_lb <= s->tau;
+    out = out && out_lb <= s->tau;
+
+    uint32_t in_node = todo.node + 1;
+    uint32_t out_node = todo.node + 1 + nd->inside;
+    bool in_first = d >= 0 && d <= nd->radius;
+
+    if (in_first)
+    {
+        if ((out && todo_push(s, out_node, out_lb) != 0) || (in && todo_push(s, in_node, in_lb) != 0))
+            return -1;
+    }
+    else
+    {
+        if ((in && todo_push(s, in_node, in_lb) != 0) || (out && todo_push(s, out_node, out_lb) != 0))
+            return -1;
+    }
+
+    return 0;
+}
+
+
+static void* query_run(void* arg)
+{
+    vptree_search* s = (vptree_search*) arg;
+    char* path = malloc(PATH_MAX);
+
+    pthread_mutex_lock(&s->lock);
+    if (!path)
+    {
+        s->failed = true;
+    }
+
+    for (;;)
+    {
+        while (s->nextra == s->nextras && s->ntodo == 0 && s->busy > 0 && !s->failed)
+        {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->failed)
+        {
+            break;
+        }
+
+        /* the files the tree can't tell about, compared as they come */
+        if (s->nextra < s->nextras)
+        {
+            const char* extra = s->extras[s->nextra++];
+            long bound = s->tau;
+
+            s->busy++;
+            pthread_mutex_unlock(&s->lock);
+
+            long d = path_distance(s, extra, bound);
+
+            pthread_mutex_lock(&s->lock);
+            s->busy--;
+            if (d == -2 || distance_done(s, extra, d) != 0)
+            {
+                s->failed = true;
+            }
+            pthread_cond_broadcast(&s->cond);
+            continue;
+        }
+
+        if (s->ntodo == 0)
+        {
+            break;
+        }
+
+        vptree_todo todo = s->todo[--s->ntodo];
+
+        /* the bound dropped since it was pushed */
+        if (todo.lb > s->tau)
+        {
+            continue;
+        }
+
+        /* its distances from the files below don't hold any more,
+         * it's in extras if it's still there */
+        const vptree_node* nd = &s->nodes[todo.node];
+        if (s->state[todo.node] != NODE_FRESH)
+        {
+            if (node_done(s, todo, -1, s->tau, NULL) != 0)
+            {
+                s->failed = true;
+            }
+            continue;
+        }
+
+        long bound = s->tau;
+        if (nd->inside > 0)
+        {
+            bound = s->tau > BOUND_MAX - nd->radius ? BOUND_MAX : s->tau + nd->radius;
+        }
+
+        s->busy++;
+        pthread_mutex_unlock(&s->lock);
+
+        long d = -1;
+        if (name_path(s->root, s->rootlen, s->names + nd->name, nd->namelen, path) == 0)
+        {
+            d = path_distance(s, path, bound);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        s->busy--;
+        if (d == -2 || node_done(s, todo, d, bound, path) != 0)
+        {
+            s->failed = true;
+        }
+        pthread_cond_broadcast(&s->cond);
+    }
+
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    free(path);
+
+    return NULL;
+}
+
+
+/* the node of the file named name, UINT32_MAX if the tree hasn't it */
+static uint32_t node_find(const vptree_check* c, const char* name, size_t len)
+{
+    size_t mask = c->nslots - 1;
+    for (size_t i = hash_bytes(name, len) & mask; c->slots[i] != 0; i = (i + 1) & mask)
+    {
+        const vptree_node* nd = &c->nodes[c->slots[i] - 1];
+        if (nd->namelen == len && memcmp(c->names + nd->name, name, len) == 0)
+        {
+            return c->slots[i] - 1;
+        }
+    }
+
+    return UINT32_MAX;
+}
+
+
+/* called by the walkers for each file: the nodes found as they were
+ * built are fresh, the other files are kept to be compared directly */
+static int check_visit(const char* path, size_t len, int walker, void* arg)
+{
+    vptree_check* c = (vptree_check*) arg;
+    vptree_stale* w = &c->walkers[walker];
+
+    /* left out as the build does. An unreadable file goes on: it fails
+     * to map when compared, and gives no distance */
+    struct stat st;
+    if (file_is_own(path, len) || len <= c->rootlen || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return 0;
+    }
+
+    const char* name = path + c->rootlen;
+    if (*name == '/')
+    {
+        name++;
+    }
+
+    /* each path is visited once: no two walkers set the same node */
+    uint32_t i = node_find(c, name, path + len - name);
+    if (i != UINT32_MAX)
+    {
+        const vptree_node* nd = &c->nodes[i];
+        if ((uint64_t) st.st_size == nd->size && st.st_mtim.tv_sec == nd->mtime_sec
+            && st.st_mtim.tv_nsec == nd->mtime_nsec)
+        {
+            c->state[i] = NODE_FRESH;
+            return 0;
+        }
+
+        c->state[i] = NODE_CHANGED;
+        w->changed++;
+    }
+
+    if (w->n == w->cap)
+    {
+        size_t cap = w->cap ? w->cap * 2 : 16;
+        char** paths = realloc(w->paths, cap * sizeof(char*));
+        if (!paths)
+        {
+            return -1;
+        }
+
+        w->paths = paths;
+        w->cap = cap;
+    }
+
+    w->paths[w->n] = strdup(path);
+    if (!w->paths[w->n])
+    {
+        return -1;
+    }
+    w->n++;
+
+    return 0;
+}
+
+
+/* Walks the directory of s for what changed since the build: the state
+ * of each node, and in extras the files changed or added. res gets how
+ * many of each, the nodes gone counted as changed */
+static int query_check(vptree_search* s, size_t n, int threads, unsigned char* state, vptree_result* res)
+{
+    vptree_check c;
+    c.nodes = s->nodes;
+    c.names = s->names;
+    c.rootlen = s->rootlen;
+    c.nslots = 16;
+    while (c.nslots < 2 * n)
+    {
+        c.nslots *= 2;
+    }
+    c.slots = calloc(c.nslots, sizeof(uint32_t));
+    c.state = state;
+    c.walkers = calloc(threads, sizeof(vptree_stale));
+    if (!c.slots || !c.walkers)
+    {
+        free(c.slots);
+        free(c.walkers);
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const vptree_node* nd = &s->nodes[i];
+        size_t slot = hash_bytes(s->names + nd->name, nd->namelen) & (c.nslots - 1);
+        while (c.slots[slot] != 0)
+        {
+            slot = (slot + 1) & (c.nslots - 1);
+        }
+        c.slots[slot] = (uint32_t) i + 1;
+        state[i] = NODE_GONE;
+    }
+
+    int ret = walk_tree(s->root, threads, check_visit, &c);
+
+    size_t nextras = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        nextras += c.walkers[t].n;
+    }
+
+    s->extras = malloc((nextras ? nextras : 1) * sizeof(char*));
+    if (!s->extras)
+    {
+        ret = -1;
+    }
+
+    for (int t = 0; t < threads; t++)
+    {
+        vptree_stale* w = &c.walkers[t];
+        for (size_t i = 0; i < w->n; i++)
+        {
+            if (s->extras)
+                s->extras[s->nextras++] = w->paths[i];
+            else
+                free(w->paths[i]);
+        }
+        res->changed += w->changed;
+        res->added += w->n - w->changed;
+        free(w->paths);
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (state[i] == NODE_GONE)
+        {
+            res->changed++;
+        }
+    }
+
+    free(c.slots);
+    free(c.walkers);
+
+    return ret;
+}
+
+
+int vptree_query(const char* dir, const char* buf, size_t len, const token_table* tokens, long bound, size_t k,
+                 bool nearest, int threads, vptree_result* res)
+{
+    memset(res, 0, sizeof(vptree_result));
+
+    char* root = realpath(dir, NULL);
+    char file[PATH_MAX];
+    if (!root || (size_t) snprintf(file, sizeof(file), "%s/%s", root, VPTREE_NAME) >= sizeof(file))
+    {
+        free(root);
+        return -1;
+    }
+
+    const char* map = NULL;
+    size_t size = 0;
+    if (file_map(file, &map, &size) != 0 || !tree_valid(map, size))
+    {
+        file_unmap(map, size);
+        free(root);
+        return -1;
+    }
+
+    /* a tree of another unit measures other distances */
+    vptree_header h;
+    memcpy(&h, map, sizeof(h));
+    if (h.unit != (uint32_t) (tokens ? tokens->unit : UNIT_BYTE))
+    {
+        file_unmap(map, size);
+        free(root);
+        return -1;
+    }
+
+    vptree_search s;
+    memset(&s, 0, sizeof(s));
+    s.nodes = (const vptree_node*) (map + sizeof(h));
+    s.names = (const char*) (s.nodes + h.n);
+    s.root = root;
+    s.rootlen = strlen(root);
+    s.buf = buf;
+    s.len = len;
+    s.t = tokens;
+    s.k = k;
+    s.nearest = nearest;
+    s.tau = bound > BOUND_MAX ? BOUND_MAX : bound;
+    s.heap = malloc((k ? k : 1) * sizeof(long));
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    /* a stat of each file first: the changed ones don't prune and
+     * are compared directly, with those the tree hasn't */
+    int nthreads = threads < 1 ? 1 : threads;
+    unsigned char* state = malloc(h.n ? h.n : 1);
+    s.state = state;
+    if (!s.heap || !state || query_check(&s, h.n, nthreads, state, res) != 0
+        || (h.n > 0 && todo_push(&s, 0, 0) != 0))
+    {
+        s.failed = true;
+    }
+
+    /* the calling thread searches too */
+    pthread_t* tids = malloc(nthreads * sizeof(pthread_t));
+    int started = 1;
+    while (tids && !s.failed && started < nthreads && pthread_create(&tids[started], NULL, query_run, &s) == 0)
+    {
+        started++;
+    }
+
+    query_run(&s);
+
+    for (int i = 1; tids && i < started; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+
+    /* those found before the bound dropped below them are left out */
+    size_t n = 0;
+    for (size_t i = 0; i < s.nhits; i++)
+    {
+        if (s.hits[i].distance <= s.tau)
+            s.hits[n++] = s.hits[i];
+        else
+            free(s.hits[i].path);
+    }
+
+    res->hits = s.hits;
+    res->n = n;
+    res->files = h.n;
+    res->compared = s.compared;
+
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.cond);
+    for (size_t i = 0; i < s.nextras; i++)
+    {
+        free(s.extras[i]);
+    }
+    free(s.extras);
+    free(state);
+    free(s.todo);
+    free(s.heap);
+    file_unmap(map, size);
+    free(root);
+
+    if (s.failed)
+    {
+        vptree_result_free(res);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void vptree_result_free(vptree_result* res)
+{
+    for (size_t i = 0; res->hits && i < res->n; i++)
+    {
+        free(res->hits[i].path);
+    }
+    free(res->hits);
+    memset(res, 0, sizeof(vptree_result));
+}
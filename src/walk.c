@@ -0,0 +1,650 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>       // PATH_MAX
+#include <dirent.h>       // DT_*
+#include <fcntl.h>        // open, AT_*
+#include <unistd.h>       // close, syscall
+#include <sched.h>        // sched_yield
+#include <time.h>         // nanosleep
+#include <sys/stat.h>     // fstatat
+#include <sys/resource.h> // getrlimit
+#include <sys/syscall.h>  // SYS_getdents64
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../include/walk.h"
+#include "../include/util.h"
+
+
+/* bytes of directory entries read at once */
+#define DENTS_BYTES (1 << 16)
+
+/* empty steals before a walker naps */
+#define IDLE_SPINS 64
+
+/* directories kept open for their subdirectories, at most */
+#define HANDLES_MAX 4096
+
+
+/* entry filled by getdents64 */
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+
+/* A directory kept open while its subdirectories wait to be read: they
+ * are opened relative to it, the kernel doesn't resolve the whole path
+ * again for each one. Closed when the last of them is opened. */
+typedef struct
+{
+    int fd;
+    atomic_int refs;
+} walk_handle;
+
+
+/* a directory left to read, its absolute path built from the parent's */
+typedef struct
+{
+    walk_handle* parent; /* NULL to open it by its path */
+    size_t name;         /* where its name starts in path */
+    size_t len;
+    char path[];
+} walk_dir;
+
+
+/* Directories of one walker. The owner pushes and pops at the tail,
+ * the others steal from the head: the oldest directories, the ones
+ * closest to the root, carry the biggest subtrees. */
+typedef struct
+{
+    pthread_mutex_t lock;
+    walk_dir** dirs;
+    size_t head;
+    size_t tail;
+    size_t cap;
+} walk_deque;
+
+
+typedef struct
+{
+    walk_deque* deques;
+    int nthreads;
+    atomic_size_t pending; /* directories pushed and not read yet */
+    atomic_bool failed;
+    atomic_int handles;    /* open for their subdirectories */
+    int maxhandles;
+    walk_visit_f visit;
+    void* arg;
+} walk_job;
+
+
+typedef struct
+{
+    walk_job* job;
+    int index;
+} walk_thread;
+
+
+static int deque_push(walk_deque* q, walk_dir* d)
+{
+    pthread_mutex_lock(&q->lock);
+
+    if (q->tail == q->cap)
+    {
+        /* slide the live part down before growing */
+        if (q->head > 0)
+        {
+            memmove(q->dirs, q->dirs + q->head, (q->tail - q->head) * sizeof(walk_dir*));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+
+        if (q->tail == q->cap)
+        {
+            size_t cap = q->cap ? q->cap * 2 : 64;
+            walk_dir** dirs = realloc(q->dirs, cap * sizeof(walk_dir*));
+            if (!dirs)
+            {
+                pthread_mutex_unlock(&q->lock);
+                return -1;
+            }
+
+            q->dirs = dirs;
+            q->cap = cap;
+        }
+    }
+
+    q->dirs[q->tail++] = d;
+
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+
+static walk_dir* deque_take(walk_deque* q, bool steal)
+{
+    walk_dir* d = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+    {
+        d = steal ? q->dirs[q->head++] : q->dirs[--q->tail];
+        if (q->head == q->tail)
+        {
+            q->head = 0;
+            q->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return d;
+}
+
+
+static void handle_release(walk_job* job, walk_handle* h)
+{
+    if (h && atomic_fetch_sub(&h->refs, 1) == 1)
+    {
+        close(h->fd);
+        free(h);
+        atomic_fetch_sub(&job->handles, 1);
+    }
+}
+
+
+/* a directory named path + name, opened relative to parent if not NULL */
+static walk_dir* walk_dir_new(const char* path, size_t len, size_t name, walk_handle* parent)
+{
+    walk_dir* d = malloc(sizeof(walk_dir) + len + 1);
+    if (d)
+    {
+        d->parent = parent;
+        d->name = name;
+        d->len = len;
+        memcpy(d->path, path, len);
+        d->path[len] = '\0';
+        if (parent)
+        {
+            atomic_fetch_add(&parent->refs, 1);
+        }
+    }
+
+    return d;
+}
+
+
+static void walk_dir_free(walk_job* job, walk_dir* d)
+{
+    if (d)
+    {
+        handle_release(job, d->parent);
+        free(d);
+    }
+}
+
+
+static int walk_push(walk_job* job, int self, walk_dir* d)
+{
+    atomic_fetch_add(&job->pending, 1);
+    if (!d || deque_push(&job->deques[self], d) != 0)
+    {
+        walk_dir_free(job, d);
+        atomic_fetch_sub(&job->pending, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* the handle of directory fd for its subdirectories, NULL if too many are open */
+static walk_handle* handle_new(walk_job* job, int fd)
+{
+    if (atomic_fetch_add(&job->handles, 1) >= job->maxhandles)
+    {
+        atomic_fetch_sub(&job->handles, 1);
+        return NULL;
+    }
+
+    walk_handle* h = malloc(sizeof(walk_handle));
+    if (!h)
+    {
+        atomic_fetch_sub(&job->handles, 1);
+        return NULL;
+    }
+
+    h->fd = fd;
+    atomic_init(&h->refs, 1);
+
+    return h;
+}
+
+
+/* reads directory d, visiting its files and pushing its subdirectories.
+ * path is a PATH_MAX buffer, dents a DENTS_BYTES one */
+static int walk_read_dir(walk_job* job, int self, const walk_dir* d, char* path, char* dents)
+{
+    int fd = d->parent ? openat(d->parent->fd, d->path + d->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                       : open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        /* unreadable: skipped */
+        return 0;
+    }
+
+    /* children's paths are the parent's plus their name */
+    size_t plen = d->len;
+    memcpy(path, d->path, plen);
+    if (plen == 0 || path[plen - 1] != '/')
+    {
+        path[plen++] = '/';
+    }
+
+    /* made when the first subdirectory is met */
+    walk_handle* h = NULL;
+    bool tried = false;
+
+    int ret = 0;
+    long n;
+    while (ret == 0 && (n = syscall(SYS_getdents64, fd, dents, DENTS_BYTES)) > 0)
+    {
+        for (long off = 0; off < n && ret == 0;)
+        {
+            struct linux_dirent64* e = (struct linux_dirent64*) (dents + off);
+            off += e->d_reclen;
+
+            const char* name = e->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            {
+                continue;
+            }
+
+            unsigned char type = e->d_type;
+            struct stat st;
+
+            /* no hint from the file system */
+            if (type == DT_UNKNOWN)
+            {
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR
+                     : S_ISREG(st.st_mode) ? DT_REG
+                     : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+
+            /* a symlink counts if it leads to a regular file */
+            if (type == DT_LNK)
+            {
+                if (fstatat(fd, name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+                    continue;
+                type = DT_REG;
+            }
+
+            if (type != DT_DIR && type != DT_REG)
+            {
+                continue;
+            }
+
+            size_t nlen = strlen(name);
+            if (plen + nlen >= PATH_MAX)
+            {
+                continue;
+            }
+            memcpy(path + plen, name, nlen + 1);
+
+            if (type == DT_DIR)
+            {
+                if (!tried)
+                {
+                    h = handle_new(job, fd);
+                    tried = true;
+                }
+                ret = walk_push(job, self, walk_dir_new(path, plen + nlen, plen, h));
+            }
+            else if (job->visit(path, plen + nlen, self, job->arg) != 0)
+            {
+                ret = -1;
+            }
+        }
+    }
+
+    if (h)
+        handle_release(job, h);
+    else
+        close(fd);
+
+    return ret;
+}
+
+
+static void* walk_worker(void* arg)
+{
+    walk_thread* self = (walk_thread*) arg;
+    walk_job* job = self->job;
+
+    char* path = malloc(PATH_MAX);
+    char* dents = malloc(DENTS_BYTES);
+    if (!path || !dents)
+    {
+        job->failed = true;
+    }
+
+    unsigned idle = 0;
+    while (!job->failed)
+    {
+        /* own directories first, newest first, then the others' oldest */
+        walk_dir* d = deque_take(&job->deques[self->index], false);
+        for (int k = 1; !d && k < job->nthreads; k++)
+        {
+            d = deque_take(&job->deques[(self->index + k) % job->nthreads], true);
+        }
+
+        if (!d)
+        {
+            if (atomic_load(&job->pending) == 0)
+            {
+                break;
+            }
+
+            if (++idle < IDLE_SPINS)
+            {
+                sched_yield();
+            }
+            else
+            {
+                struct timespec nap = {0, 100000};
+                nanosleep(&nap, NULL);
+            }
+            continue;
+        }
+
+        idle = 0;
+        if (walk_read_dir(job, self->index, d, path, dents) != 0)
+        {
+            job->failed = true;
+        }
+        walk_dir_free(job, d);
+        atomic_fetch_sub(&job->pending, 1);
+    }
+
+    free(path);
+    free(dents);
+
+    return NULL;
+}
+
+
+int walk_tree(const char* root, int threads, walk_visit_f visit, void* arg)
+{
+    /* the root is made absolute once, paths below are built from it */
+    char* abs = realpath(root, NULL);
+    if (!abs)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if (stat(abs, &st) != 0)
+    {
+        free(abs);
+        return -1;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+    {
+        int ret = S_ISREG(st.st_mode) && visit(abs, strlen(abs), 0, arg) != 0 ? -1 : 0;
+        free(abs);
+        return ret;
+    }
+
+    /* an unreadable root fails the walk, unlike the directories below it */
+    int fd = open(abs, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+    {
+        free(abs);
+        return -1;
+    }
+    close(fd);
+
+    walk_job job;
+    job.nthreads = threads < 1 ? 1 : threads;
+    job.deques = calloc(job.nthreads, sizeof(walk_deque));
+    job.visit = visit;
+    job.arg = arg;
+    atomic_init(&job.pending, 0);
+    atomic_init(&job.failed, false);
+    atomic_init(&job.handles, 0);
+
+    /* half of the descriptors allowed, the rest for the files */
+    struct rlimit rl;
+    job.maxhandles = HANDLES_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 2 < HANDLES_MAX)
+    {
+        job.maxhandles = (int) (rl.rlim_cur / 2);
+    }
+
+    walk_thread* self = malloc(job.nthreads * sizeof(walk_thread));
+    pthread_t* tids = malloc(job.nthreads * sizeof(pthread_t));
+
+    if (!job.deques || !self || !tids)
+    {
+        free(job.deques);
+        free(self);
+        free(tids);
+        free(abs);
+        return -1;
+    }
+
+    for (int t = 0; t < job.nthreads; t++)
+    {
+        pthread_mutex_init(&job.deques[t].lock, NULL);
+    }
+
+    int ret = walk_push(&job, 0, walk_dir_new(abs, strlen(abs), 0, NULL));
+    free(abs);
+
+    /* the calling thread is walker 0, the others steal from it */
+    int started = 1;
+    while (ret == 0 && started < job.nthreads)
+    {
+        self[started] = (walk_thread) {&job, started};
+        if (pthread_create(&tids[started], NULL, walk_worker, &self[started]) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+
+    if (ret == 0)
+    {
+        self[0] = (walk_thread) {&job, 0};
+        walk_worker(&self[0]);
+    }
+
+    for (int t = 1; t < started; t++)
+    {
+        pthread_join(tids[t], NULL);
+    }
+
+    /* what's left after a failure */
+    for (int t = 0; t < job.nthreads; t++)
+    {
+        walk_deque* q = &job.deques[t];
+        for (size_t i = q->head; i < q->tail; i++)
+        {
+            walk_dir_free(&job, q->dirs[i]);
+        }
+        free(q->dirs);
+        pthread_mutex_destroy(&q->lock);
+    }
+
+    if (job.failed)
+    {
+        ret = -1;
+    }
+
+    free(job.deques);
+    free(self);
+    free(tids);
+
+    return ret;
+}
+
+
+/* the files found by one walker of walk_collect */
+typedef struct
+{
+    walk_file* files;
+    size_t n;
+    size_t cap;
+} collect_walker;
+
+
+typedef struct
+{
+    size_t rootlen;
+    collect_walker* walkers;
+} collect_job;
+
+
+static int collect_visit(const char* path, size_t len, int walker, void* arg)
+{
+    collect_job* job = (collect_job*) arg;
+    collect_walker* w = &job->walkers[walker];
+
+    /* unreadable files are left out */
+    struct stat st;
+    if (file_is_own(path, len) || len <= job->rootlen || stat(path, &st) != 0 || !S_ISREG(st.st_mode)
+        || access(path, R_OK) != 0)
+    {
+        return 0;
+    }
+
+    if (w->n == w->cap)
+    {
+        size_t cap = w->cap ? w->cap * 2 : 256;
+        walk_file* files = realloc(w->files, cap * sizeof(walk_file));
+        if (!files)
+        {
+            return -1;
+        }
+
+        w->files = files;
+        w->cap = cap;
+    }
+
+    /* the name under the root */
+    const char* name = path + job->rootlen;
+    if (*name == '/')
+    {
+        name++;
+    }
+
+    walk_file* f = &w->files[w->n];
+    f->name = strdup(name);
+    if (!f->name)
+    {
+        return -1;
+    }
+
+    f->size = st.st_size;
+    f->mtime_sec = st.st_mtim.tv_sec;
+    f->mtime_nsec = st.st_mtim.tv_nsec;
+    w->n++;
+
+    return 0;
+}
+
+
+static int walk_file_cmp(const void* a, const void* b)
+{
+    return strcmp(((const walk_file*) a)->name, ((const walk_file*) b)->name);
+}
+
+
+int walk_collect(const char* root, int threads, walk_file** files, size_t* n)
+{
+    *files = NULL;
+    *n = 0;
+
+    char* abs = realpath(root, NULL);
+    int nwalkers = threads < 1 ? 1 : threads;
+    collect_job job = {abs ? strlen(abs) : 0, calloc(nwalkers, sizeof(collect_walker))};
+    if (!abs || !job.walkers)
+    {
+        free(abs);
+        free(job.walkers);
+        return -1;
+    }
+
+    int res = walk_tree(abs, nwalkers, collect_visit, &job);
+    free(abs);
+
+    size_t total = 0;
+    for (int t = 0; t < nwalkers; t++)
+    {
+        total += job.walkers[t].n;
+    }
+
+    walk_file* all = malloc((total ? total : 1) * sizeof(walk_file));
+    size_t k = 0;
+    for (int t = 0; t < nwalkers; t++)
+    {
+        collect_walker* w = &job.walkers[t];
+        for (size_t i = 0; i < w->n; i++)
+        {
+            if (all)
+                all[k++] = w->files[i];
+            else
+                free(w->files[i].name);
+        }
+        free(w->files);
+    }
+    free(job.walkers);
+
+    if (res != 0 || !all)
+    {
+        walk_files_free(all, k);
+        return -1;
+    }
+
+    qsort(all, k, sizeof(walk_file), walk_file_cmp);
+    *files = all;
+    *n = k;
+
+    return 0;
+}
+
+
+void walk_files_free(walk_file* files, size_t n)
+{
+    for (size_t i = 0; files && i < n; i++)
+    {
+        free(files[i].name);
+    }
+    free(files);
+}
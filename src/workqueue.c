@@ -0,0 +1,120 @@
+/* This file is part of filedistance
+*  Copyright (C) 2020  Marco Savelli
+*
+*  This program is free software: you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation, either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../include/workqueue.h"
+
+
+int workqueue_init(workqueue* q, size_t capacity)
+{
+    q->cells = malloc(capacity * sizeof(workqueue_cell));
+    if (!q->cells)
+    {
+        return -1;
+    }
+
+    /* cell i is free for the push at position i */
+    for (size_t i = 0; i < capacity; i++)
+    {
+        atomic_init(&q->cells[i].seq, i);
+    }
+
+    q->mask = capacity - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+
+    return 0;
+}
+
+
+bool workqueue_push(workqueue* q, void* data)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    for (;;)
+    {
+        workqueue_cell* cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+
+        if (dif == 0)
+        {
+            /* free for this round: claim it */
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                cell->data = data;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (dif < 0)
+        {
+            /* still holds the item of the last round */
+            return false;
+        }
+        else
+        {
+            /* another push got there first */
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+
+bool workqueue_pop(workqueue* q, void** data)
+{
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    for (;;)
+    {
+        workqueue_cell* cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if (dif == 0)
+        {
+            /* full for this round: take it */
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                *data = cell->data;
+                atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (dif < 0)
+        {
+            /* not pushed yet */
+            return false;
+        }
+        else
+        {
+            /* another pop got there first */
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+}
+
+
+void workqueue_free(workqueue* q)
+{
+    free(q->cells);
+    q->cells = NULL;
+}
@@ -0,0 +1,77 @@
+#!/bin/sh
+# This file is part of filedistance
+# Copyright (C) 2020  Marco Savelli
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# The searches with --tree find what the plain ones do after files are
+# edited, added and removed since build-index.
+#
+# Usage: vptree_stale.sh filedistance
+
+set -e
+
+bin=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# 200 files of 40 random lines in two directories
+mkdir -p "$tmp/d/a" "$tmp/d/b"
+awk -v dir="$tmp/d" 'BEGIN {
+    srand(7)
+    for (i = 0; i < 200; i++) {
+        f = dir "/" (i % 2 ? "a" : "b") "/f" i
+        for (l = 0; l < 40; l++) {
+            s = ""
+            for (c = 0; c < 12; c++)
+                s = s sprintf("%c", 97 + int(rand() * 8))
+            print s > f
+        }
+        close(f)
+    }
+}'
+cp "$tmp/d/a/f1" "$tmp/q"
+echo "the query" >> "$tmp/q"
+
+"$bin" build-index "$tmp/d" > /dev/null
+"$bin" --unit=line build-index "$tmp/d/a" > /dev/null
+
+# the query itself, the nodes near it don't tell about it any more
+cp "$tmp/q" "$tmp/d/b/f120"
+cp "$tmp/q" "$tmp/d/a/f77"
+echo "one more" >> "$tmp/d/a/f77"
+rm "$tmp/d/a/f1"
+cp "$tmp/q" "$tmp/d/b/new"
+sed 's/a/b/' "$tmp/q" > "$tmp/d/a/new"
+
+check()
+{
+    "$bin" "$@" > "$tmp/plain" 2> /dev/null
+    "$bin" --tree "$@" > "$tmp/tree" 2> "$tmp/err"
+    grep -q "^STALE:" "$tmp/err"
+    if ! cmp -s "$tmp/plain" "$tmp/tree"; then
+        echo "differs with --tree: $*"
+        diff "$tmp/plain" "$tmp/tree"
+        exit 1
+    fi
+}
+
+check search "$tmp/q" "$tmp/d"
+check searchall "$tmp/q" "$tmp/d" 30
+check searchall "$tmp/q" "$tmp/d" 300
+check searchk "$tmp/q" "$tmp/d" 5
+grep -q "b/f120" "$tmp/tree"
+grep -q "b/new" "$tmp/tree"
+check --unit=line search "$tmp/q" "$tmp/d/a"
+check --unit=line searchk "$tmp/q" "$tmp/d/a" 3